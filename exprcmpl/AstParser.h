@@ -7,6 +7,9 @@
 #include "CallExpression.h"
 #include "NumberExpression.h"
 #include "BinaryExpression.h"
+#include "NumberParser.h"
+#include "CharScanner.h"
+#include "PodArray.h"
 
 enum AstTokens
 {
@@ -14,6 +17,7 @@ enum AstTokens
     AST_TOKEN_IDENTIFIER    = -1,
     AST_TOKEN_NUMBER        = -2,
     AST_TOKEN_EOF           = -3,
+    AST_TOKEN_SEPARATOR     = -4,       // ';' or a newline outside of parentheses, stream mode only
 };
 
 #ifndef EOF
@@ -22,15 +26,16 @@ enum AstTokens
 
 class AstParser
 {
-    static const int MAX_IDENT_LEN = 128;
-
 public:
-    AstParser(const char* str, int length)
+    // In stream mode the input holds many expressions separated by ';' or newlines,
+    // and the expressions refer to the identifiers in the input instead of copying them.
+    AstParser(const char* str, int length, bool stream = false)
         : m_input(str), m_inputLen(length), m_inputPos(0),
-        m_currentToken(0), m_identifierLen(0), m_numericValue(0.0),
+        m_stream(stream), m_started(false), m_parenDepth(0),
+        m_currentToken(0), m_tokenPos(0),
+        m_identifierStr(NULL), m_identifierLen(0), m_numericValue(0.0),
         m_lastChar(' ')
     {
-        m_identifierStr[0] = 0;
     };
 
 private:
@@ -38,19 +43,50 @@ private:
     int m_inputLen;
     int m_inputPos;
 
+    bool m_stream;
+    bool m_started;
+    int m_parenDepth;
+
     int m_currentToken;
-    char m_identifierStr[MAX_IDENT_LEN];
+    int m_tokenPos;                 // position of the current token in the input
+    const char* m_identifierStr;    // points into the input
     int m_identifierLen;
     double m_numericValue;
 
     int m_lastChar;
 
+    enum ParseFrameType
+    {
+        PARSE_FRAME_NEGATE  = 1,
+        PARSE_FRAME_BINOP,
+        PARSE_FRAME_PAREN,
+        PARSE_FRAME_CALL,
+        PARSE_FRAME_CONDITION,      // '?' waiting for its ':'
+        PARSE_FRAME_ELSE,           // ':' waiting for the end of its operand
+    };
+
+    static const int TERNARY_PRECEDENCE = 2;
+
+    // Construct being parsed around the current operand.
+    struct ParseFrame
+    {
+        int type;
+        int op;                     // PARSE_FRAME_BINOP
+        int precedence;
+        const char* name;           // PARSE_FRAME_CALL
+        int nameLen;
+        int operandBase;            // PARSE_FRAME_CALL, position of the first argument on the operand stack
+    };
+
+    PodArray<Expression*> m_operands;
+    PodArray<ParseFrame> m_frames;
+
     inline int GetChar()
     {
         if (m_inputLen <= m_inputPos)
             return -1;
 
-        return m_input[m_inputPos++];
+        return uint8(m_input[m_inputPos++]);
     }
 
     inline int PeekChar()
@@ -58,60 +94,56 @@ private:
         if (m_inputLen <= m_inputPos)
             return -1;
 
-        return m_input[m_inputPos];
+        return uint8(m_input[m_inputPos]);
+    }
+
+    inline bool IsSeparator(int c)
+    {
+        return m_stream && (c == ';' || (c == '\n' && m_parenDepth <= 0));
     }
 
     int GetToken()
     {
         // Skip any whitespace.
-        while (is_whitespace_char(m_lastChar))
+        if (is_whitespace_char(m_lastChar) && !IsSeparator(m_lastChar))
+        {
+            const char* next = CharScanner::SkipWhitespace(m_input + m_inputPos, m_input + m_inputLen,
+                !m_stream || m_parenDepth > 0);
+            m_inputPos = int(next - m_input);
             m_lastChar = GetChar();
+        }
+
+        // Position of m_lastChar, GetChar doesn't advance past the end.
+        m_tokenPos = m_lastChar == EOF ? m_inputPos : m_inputPos - 1;
+
+        if (IsSeparator(m_lastChar))
+        {
+            m_lastChar = GetChar();
+            return AST_TOKEN_SEPARATOR;
+        }
 
         if (is_identifier_char(m_lastChar) && !is_digit_char(m_lastChar))
         {
             // identifier: [a-zA-Z][a-zA-Z0-9]*
-            m_identifierLen = 0;
-            m_identifierStr[m_identifierLen++] = char(m_lastChar);
-            while (is_char(m_lastChar = GetChar()) && is_identifier_char(m_lastChar) && m_identifierLen < MAX_IDENT_LEN)
-                m_identifierStr[m_identifierLen++] = char(m_lastChar);
+            m_identifierStr = m_input + m_tokenPos;
+            const char* next = CharScanner::SkipIdentifier(m_input + m_inputPos, m_input + m_inputLen);
+            m_identifierLen = int(next - m_identifierStr);
+            m_inputPos = int(next - m_input);
+            m_lastChar = GetChar();
 
             return AST_TOKEN_IDENTIFIER;
         }
 
         if (is_digit_char(m_lastChar) || (m_lastChar == '.' && is_digit_char(PeekChar())))
         {
-            // Number: [0-9.]+
-            m_numericValue = 0.0;
-            bool places = false;
-            double qplaces = 1.0;
-            do
-            {
-                if (m_lastChar == '.')
-                {
-                    if (places)
-                        return AST_TOKEN_ERROR;
-
-                    places = true;
-                }
-                else if (is_digit_char(m_lastChar))
-                {
-                    if (places)
-                    {
-                        qplaces /= 10.0;
-                        m_numericValue += double(m_lastChar - '0') * qplaces;
-                    }
-                    else
-                    {
-                        m_numericValue *= 10.0;
-                        m_numericValue += double(m_lastChar - '0');
-                    }
-                }
-                else
-                    return AST_TOKEN_ERROR;
-
-                m_lastChar = GetChar();
+            // Number: see NumberParser::Parse
+            int len = NumberParser::Parse(m_input + m_tokenPos, m_input + m_inputLen, &m_numericValue);
+            m_inputPos = m_tokenPos + (len ? len : 1);
+            m_lastChar = GetChar();
 
-            } while (is_digit_char(m_lastChar) || m_lastChar == '.');
+            // 1.2.3
+            if (!len || m_lastChar == '.')
+                return AST_TOKEN_ERROR;
 
             return AST_TOKEN_NUMBER;
         }
@@ -120,9 +152,24 @@ private:
         if (m_lastChar == EOF)
             return AST_TOKEN_EOF;
 
+        if (m_lastChar == '(')
+            ++m_parenDepth;
+        else if (m_lastChar == ')')
+            --m_parenDepth;
+
         // Otherwise, just return the character as its ascii value.
         int ThisChar = m_lastChar;
         m_lastChar = GetChar();
+
+        // The doubled operators == && || are returned as their first character.
+        if (ThisChar == '=' || ThisChar == '&' || ThisChar == '|')
+        {
+            if (m_lastChar != ThisChar)
+                return AST_TOKEN_ERROR;
+
+            m_lastChar = GetChar();
+        }
+
         return ThisChar;
     }
 
@@ -131,174 +178,288 @@ private:
         return m_currentToken = GetToken();
     }
 
-    /// identifierexpr
-    ///   ::= identifier
-    ///   ::= identifier '(' expression* ')'
-    Expression* ParseIdentifierExpr()
+    int GetTokPrecedence()
     {
-        char IdName[MAX_IDENT_LEN];
-        int IdLen = m_identifierLen;
-        memcpy(IdName, m_identifierStr, IdLen);
-
-        GetNextToken();  // eat identifier.
-
-        if (m_currentToken != '(') // Simple variable ref.
-            return new VariableExpression(IdName, IdLen);
-
-        // Call.
-        GetNextToken();  // eat (
-        const int maxArgs = 32;
-        Expression** args = new Expression*[maxArgs];
-        int nArg = 0;
-        if (m_currentToken != ')')
+        switch (m_currentToken)
         {
-            while (nArg < maxArgs)
-            {
-                Expression* arg = ParseExpression(true);
-                if (arg == NULL)
-                    return NULL;
-
-                args[nArg++] = arg;
-
-                if (m_currentToken == ')')
-                    break;
-
-                if (m_currentToken != ',')
-                    return NULL;
-
-                GetNextToken();
-            }
+            case ':': return 1;
+            case '?': return TERNARY_PRECEDENCE;
         }
 
-        // Eat the ')'.
-        GetNextToken();
-
-        return new CallExpression(IdName, IdLen, args, nArg);
+        return BinaryExpression::GetPrecedence(m_currentToken);
     }
 
-    /// parenexpr ::= '(' expression ')'
-    Expression* ParseParenExpr()
+    // Replaces the operands of the binary operator with its expression.
+    void ReduceBinOp(const ParseFrame& frame)
     {
-        GetNextToken();  // eat (.
-        Expression* V = ParseExpression(true);
-        if (V == NULL)
-            return NULL;
-
-        if (m_currentToken != ')')
-            return NULL;
-
-        GetNextToken();  // eat ).
-        return V;
+        Expression* rhs = m_operands.pop();
+        Expression* lhs = m_operands.pop();
+        m_operands.append(new BinaryExpression(char(frame.op), lhs, rhs));
     }
 
-    /// primary
-    ///   ::= identifierexpr
-    ///   ::= numberexpr
-    ///   ::= parenexpr
-    Expression* ParsePrimary(bool allowPrefix)
+    // Replaces the arguments of the call with its expression.
+    void ReduceCall(const ParseFrame& frame)
     {
-        if (allowPrefix && m_currentToken == '-')
+        int argc = m_operands.size() - frame.operandBase;
+        Expression** args = NULL;
+        if (argc > 0)
         {
-            GetNextToken(); // Eat '-'.
-            Expression* expr = ParsePrimary(false);
-            if (!expr)
-                return NULL;
-
-            Expression** ptr = new Expression*[1];
-            ptr[0] = expr;
-            return new CallExpression("chs", 3, ptr, 1);
+            args = new Expression*[size_t(argc)];
+            for (int i = argc - 1; i >= 0; --i)
+                args[i] = m_operands.pop();
         }
-        else if (m_currentToken == AST_TOKEN_IDENTIFIER)
-            return ParseIdentifierExpr();
-        else if (m_currentToken == AST_TOKEN_NUMBER)
-            return ParseNumberExpr();
-        else if (m_currentToken == '(')
-            return ParseParenExpr();
-        else
-            return NULL;
+
+        m_operands.append(new CallExpression(frame.name, frame.nameLen, args, argc, !m_stream));
     }
 
-    int GetTokPrecedence()
+    // Replaces the condition and the branches with the conditional expression.
+    void ReduceConditional()
     {
-        switch (m_currentToken)
-        {
-            case '+': return 20;
-            case '-': return 20;
-            case '*': return 40;
-            case '/': return 40;
-        }
+        Expression** args = new Expression*[3];
+        for (int i = 2; i >= 0; --i)
+            args[i] = m_operands.pop();
 
-        return -1;
+        m_operands.append(new CallExpression("if", 2, args, 3, false));
     }
 
-    /// numberexpr ::= number
-    Expression* ParseNumberExpr()
+    void ReduceNegate()
     {
-        Expression* Result = new NumberExpression(m_numericValue);
-        GetNextToken(); // consume the number
-        return Result;
+        Expression** ptr = new Expression*[1];
+        ptr[0] = m_operands.pop();
+        m_operands.append(new CallExpression("chs", 3, ptr, 1, false));
     }
 
-    /// binoprhs
-    ///   ::= ('+' primary)*
-    Expression* ParseBinOpRHS(int ExprPrec, Expression* LHS)
+    /// expression
+    ///   ::= primary (binop primary)*
+    ///   ::= expression '?' expression ':' expression
+    /// primary
+    ///   ::= '-' primary                   at the start of an expression only
+    ///   ::= identifier
+    ///   ::= identifier '(' (expression (',' expression)*)? ')'
+    ///   ::= number
+    ///   ::= '(' expression ')'
+    ///
+    /// The nesting is kept on explicit stacks, so the depth of the input
+    /// doesn't use the native stack.
+    Expression* ParseExpression()
     {
-        // If this is a binop, find its precedence.
+        m_operands.clear();
+        m_frames.clear();
+
+        bool allowPrefix = true;
         while (true)
         {
-            int TokPrec = GetTokPrecedence();
-
-            // If this is a binop that binds at least as tightly as the current binop,
-            // consume it, otherwise we are done.
-            if (TokPrec < ExprPrec)
-                return LHS;
-
-            // Okay, we know this is a binop.
-            int BinOp = m_currentToken;
-            GetNextToken();  // eat binop
-
-            // Parse the primary expression after the binary operator.
-            Expression* RHS = ParsePrimary(false);
-            if (!RHS)
-                return NULL;
-
-            // If BinOp binds less tightly with RHS than the operator after RHS, let
-            // the pending operator take RHS as its LHS.
-            int NextPrec = GetTokPrecedence();
-            if (TokPrec < NextPrec)
+            // Primary
+            if (allowPrefix && m_currentToken == '-')
+            {
+                ParseFrame frame = { PARSE_FRAME_NEGATE };
+                m_frames.append(frame);
+                GetNextToken();  // eat '-'
+                allowPrefix = false;
+                continue;
+            }
+
+            if (m_currentToken == AST_TOKEN_IDENTIFIER)
             {
-                RHS = ParseBinOpRHS(TokPrec + 1, RHS);
-                if (!RHS)
-                    return NULL;
+                const char* IdName = m_identifierStr;
+                int IdLen = m_identifierLen;
+
+                GetNextToken();  // eat identifier.
+
+                if (m_currentToken != '(')  // Simple variable ref.
+                    m_operands.append(new VariableExpression(IdName, IdLen, !m_stream));
+                else
+                {
+                    ParseFrame frame = { PARSE_FRAME_CALL, 0, 0, IdName, IdLen, m_operands.size() };
+                    GetNextToken();  // eat (
+
+                    if (m_currentToken != ')')
+                    {
+                        m_frames.append(frame);
+                        allowPrefix = true;
+                        continue;
+                    }
+
+                    GetNextToken();  // eat )
+                    ReduceCall(frame);
+                }
             }
+            else if (m_currentToken == AST_TOKEN_NUMBER)
+            {
+                m_operands.append(new NumberExpression(m_numericValue));
+                GetNextToken(); // consume the number
+            }
+            else if (m_currentToken == '(')
+            {
+                ParseFrame frame = { PARSE_FRAME_PAREN };
+                m_frames.append(frame);
+                GetNextToken();  // eat (
+                allowPrefix = true;
+                continue;
+            }
+            else
+                return ParseFailed();
+
+            allowPrefix = false;
+
+            // The operand is complete, close the frames it completes.
+            while (true)
+            {
+                while (m_frames.size() && m_frames.back().type == PARSE_FRAME_NEGATE)
+                {
+                    m_frames.pop();
+                    ReduceNegate();
+                }
+
+                int TokPrec = GetTokPrecedence();
+
+                // Binary operators of the same precedence are left associative,
+                // the conditional operator is right associative.
+                while (m_frames.size())
+                {
+                    const ParseFrame& top = m_frames.back();
+                    if (top.type == PARSE_FRAME_BINOP && top.precedence >= TokPrec)
+                        ReduceBinOp(m_frames.pop());
+                    else if (top.type == PARSE_FRAME_ELSE && top.precedence > TokPrec)
+                    {
+                        m_frames.pop();
+                        ReduceConditional();
+                    }
+                    else
+                        break;
+                }
+
+                if (m_currentToken == '?')
+                {
+                    ParseFrame frame = { PARSE_FRAME_CONDITION, 0, TERNARY_PRECEDENCE };
+                    m_frames.append(frame);
+                    GetNextToken();  // eat ?
+                    allowPrefix = true;
+                    break;
+                }
+
+                if (m_currentToken == ':')
+                {
+                    if (!m_frames.size() || m_frames.back().type != PARSE_FRAME_CONDITION)
+                        return ParseFailed();
+
+                    m_frames.back().type = PARSE_FRAME_ELSE;
+                    GetNextToken();  // eat :
+                    allowPrefix = true;
+                    break;
+                }
+
+                if (TokPrec > 0)
+                {
+                    ParseFrame frame = { PARSE_FRAME_BINOP, m_currentToken, TokPrec };
+                    m_frames.append(frame);
+                    GetNextToken();  // eat binop
+                    break;
+                }
+
+                // Anything else ends the expression unless it closes a frame.
+                if (!m_frames.size())
+                {
+                    Expression* root = m_operands.pop();
+                    root->NumberNodes(0);
+                    return root;
+                }
+
+                if (m_currentToken == ')' &&
+                    (m_frames.back().type == PARSE_FRAME_PAREN || m_frames.back().type == PARSE_FRAME_CALL))
+                {
+                    ParseFrame frame = m_frames.pop();
+                    if (frame.type == PARSE_FRAME_CALL)
+                        ReduceCall(frame);
+
+                    GetNextToken();  // eat )
+                    continue;
+                }
 
-            // Merge LHS/RHS.
-            LHS = new BinaryExpression(BinOp, LHS, RHS);
+                if (m_currentToken == ',' && m_frames.back().type == PARSE_FRAME_CALL)
+                {
+                    GetNextToken();  // eat ,
+                    allowPrefix = true;
+                    break;
+                }
+
+                // unclosed parenthesis or conditional
+                return ParseFailed();
+            }
         }
     }
 
-    /// expression
-    ///   ::= primary binoprhs
-    ///
-    Expression* ParseExpression(bool allowPrefix)
+    Expression* ParseFailed()
     {
-        Expression* LHS = ParsePrimary(allowPrefix);
-        if (LHS == NULL)
-            return NULL;
+        while (m_operands.size())
+            delete m_operands.pop();
 
-        return ParseBinOpRHS(0, LHS);
+        return NULL;
     }
+
 public:
     Expression* GetExpression()
     {
         GetNextToken();
-        return ParseExpression(true);
+        return ParseExpression();
     }
 
     int GetInputPos()
     {
         return m_inputPos;
     }
+
+    // Parses the next expression of the stream.
+    // offset and length receive the location of the expression in the input,
+    // also when it has a syntax error. Parsing continues after the erroneous one.
+    int ParseNext(Expression** expr, int* offset, int* length)
+    {
+        if (!m_started)
+        {
+            GetNextToken();
+            m_started = true;
+        }
+
+        // Skip empty expressions.
+        while (m_currentToken == AST_TOKEN_SEPARATOR)
+            GetNextToken();
+
+        if (m_currentToken == AST_TOKEN_EOF)
+            return ERR_END_OF_INPUT;
+
+        int start = m_tokenPos;
+        *expr = ParseExpression();
+
+        int res = ERR_SUCCESS;
+        if (!*expr || (m_currentToken != AST_TOKEN_SEPARATOR && m_currentToken != AST_TOKEN_EOF))
+        {
+            if (*expr)
+                delete *expr;
+
+            *expr = NULL;
+            res = ERR_PARSING_FAILED;
+
+            // Skip the rest of the expression.
+            while (m_currentToken != AST_TOKEN_SEPARATOR && m_currentToken != AST_TOKEN_EOF)
+            {
+                if (m_currentToken == ')' && m_parenDepth < 0)
+                    m_parenDepth = 0;
+
+                GetNextToken();
+            }
+        }
+
+        int end = m_tokenPos;
+        while (end > start && is_whitespace_char(m_input[end - 1]))
+            --end;
+
+        *offset = start;
+        *length = end - start;
+
+        m_parenDepth = 0;
+
+        return res;
+    }
 };
 
 #endif
@@ -3,6 +3,8 @@
 
 #include "util.h"
 #include "Expression.h"
+#include "NumberExpression.h"
+#include "GradientBuilder.h"
 
 class BinaryExpression : public Expression
 {
@@ -15,166 +17,732 @@ public:
         m_rhs = right;
     }
 
-#ifdef _ENABLE_EXPR_TOSTRING
-    virtual int ToString(char* str, int len) const
+    // Precedence of the operator, operators of the same precedence are left associative.
+    static int GetPrecedence(int op)
     {
-        int OrigLen = len;
-        int l;
+        switch (op)
+        {
+            case '|': return 5;
+            case '&': return 6;
+            case '=': return 8;
+            case '<': return 10;
+            case '>': return 10;
+            case '+': return 20;
+            case '-': return 20;
+            case '*': return 40;
+            case '/': return 40;
+        }
 
-        l = sprintf_s(str, len, "(");
-        if (!l)
-            return 0;
-        str += l;
-        len -= l;
+        return -1;
+    }
+
+#ifdef _ENABLE_EXPR_TOSTRING
+    virtual int GetPrintPrecedence() const
+    {
+        return GetPrecedence(m_op);
+    }
 
-        l = m_lhs->ToString(str, len);
-        if (!l)
-            return 0;
-        len -= l;
-        str += l;
+    // The right operand is parenthesized at the same precedence too, so that
+    // a - (b - c) and a + (b + c) print as they are evaluated.
+    bool IsLhsParenthesized() const
+    {
+        return m_lhs->GetPrintPrecedence() < GetPrecedence(m_op);
+    }
 
-        l = sprintf_s(str, len, " %c ", m_op);
-        if (!l)
-            return 0;
-        len -= l;
-        str += l;
+    bool IsRhsParenthesized() const
+    {
+        return m_rhs->GetPrintPrecedence() <= GetPrecedence(m_op);
+    }
 
-        l = m_rhs->ToString(str, len);
-        if (!l)
-            return 0;
-        len -= l;
-        str += l;
+    virtual bool ToStringStep(TextBuffer& text, int step, const Expression** child) const
+    {
+        switch (step)
+        {
+            case 0:
+                *child = m_lhs;
+                return !IsLhsParenthesized() || text.append_char('(');
+            case 1:
+            {
+                // == && || are stored as their first character
+                bool doubled = m_op == '=' || m_op == '&' || m_op == '|';
+                char op[] = { ' ', m_op, m_op, ' ' };
+                if (!doubled)
+                    op[2] = ' ';
 
-        l = sprintf_s(str, len, ")");
-        if (!l)
-            return 0;
-        str += l;
-        len -= l;
+                if ((IsLhsParenthesized() && !text.append_char(')')) ||
+                    !text.append(op, doubled ? 4 : 3) ||
+                    (IsRhsParenthesized() && !text.append_char('(')))
+                    return false;
 
-        return OrigLen - len;
+                *child = m_rhs;
+                return true;
+            }
+            default:
+                return !IsRhsParenthesized() || text.append_char(')');
+        }
     }
+#endif
 
-    virtual int Emit(ByteBuffer& buf, pIdentifierInfoCallback identifierInfoCallback) const
+#ifdef _ENABLE_EXPR_EMIT
+    virtual int FoldNode(CompileContext& ctx) const
     {
-        MarshallingInfo linfo = m_lhs->GetMarshallingInfo();
-        MarshallingInfo rinfo = m_rhs->GetMarshallingInfo();
+        NodeState& state = GetState(ctx);
+        MarshallingInfo& info = state.Info;
+        info.Type = MARSHALLING_ST0;
+        info.Int32 = ctx.HasFlag(COMPILE_INT32_ARITHMETIC) &&
+            m_lhs->GetMarshallingInfo(ctx).Int32 && m_rhs->GetMarshallingInfo(ctx).Int32;
+        state.TreeLength = m_lhs->GetExpressionTreeLength(ctx) + m_rhs->GetExpressionTreeLength(ctx);
 
 #ifdef _ENABLE_EXPR_FOLDING
-        if (linfo.Type == MARSHALLING_IMM &&
-            rinfo.Type == MARSHALLING_IMM)
+        if (m_lhs->GetMarshallingInfo(ctx).Type == MARSHALLING_IMM &&
+            m_rhs->GetMarshallingInfo(ctx).Type == MARSHALLING_IMM)
         {
-            // Fold the constant, push the result onto the fpu stack.
-            double result;
-            if (compute(result))
-                return NumberExpression(result).Emit(buf, identifierInfoCallback);
+            // Fold the constant
+            if (!(info.Int32 ? computeInt32(ctx, info.Imm) : compute(ctx, info.Imm)))
+                return ERR_IMM_BINARY_COMPUTE_ERR;
 
-            return ERR_IMM_BINARY_COMPUTE_ERR;
+            info.Type = MARSHALLING_IMM;
+            return 1;
+        }
+#endif
+
+        info.Range = GetRange(ctx);
+
+#ifdef _ENABLE_EXPR_FOLDING
+        // Conditions the ranges of the operands decide are constants.
+        if (IsCondition() && info.Range.IsPoint() && !info.Effects)
+        {
+            info.Type = MARSHALLING_IMM;
+            info.Imm = info.Range.Min;
+            ++ctx.GetStats().range_simplified;
+            return 1;
         }
-        else
 #endif
+
+        if (info.Int32)
+        {
+            info.Type = MARSHALLING_EAX;
+            ++ctx.GetStats().int32_nodes;
+
+            if (m_op == '/' && IsDivisorSafe(ctx))
+                ++ctx.GetStats().range_simplified;
+        }
+        else if (ctx.HasFlag(COMPILE_HORNER))
+            FoldPolynomial(ctx);
+
+        return 1;
+    }
+
+    // Polynomial of + - * and of a division by a power of 2, which scales the coefficients exactly.
+    void FoldPolynomial(CompileContext& ctx) const
+    {
+        Polynomial one, two, poly;
+        if (!m_lhs->GetPolynomial(ctx, one) || !m_rhs->GetPolynomial(ctx, two) || !IsSameVariable(one, two))
+            return;
+
+        switch (m_op)
         {
-            if (m_rhs->GetExpressionTreeLength() > m_lhs->GetExpressionTreeLength())
+            case '+':
+                poly = Polynomial::Add(one, two, 1.0);
+                break;
+            case '-':
+                poly = Polynomial::Add(one, two, -1.0);
+                break;
+            case '*':
+                if (!Polynomial::Mul(one, two, poly))
+                    return;
+                break;
+            case '/':
             {
-                EXIT_ON_ERR(m_rhs->Emit(buf, identifierInfoCallback));
-                EXIT_ON_ERR(m_lhs->Emit(buf, identifierInfoCallback));
+                int exponent;
+                if (two.Variable || fabs(frexp(two.Coeffs[0], &exponent)) != 0.5)
+                    return;
+                poly = Polynomial::Div(one, two.Coeffs[0]);
+                break;
+            }
+            default:
+                return;
+        }
 
-                switch (m_op)
+        SetPolynomial(ctx, poly);
+    }
+
+#ifdef _ENABLE_EXPR_FOLDING
+    virtual int EvaluateNode(CompileContext& ctx) const
+    {
+        if (!compute(ctx, GetState(ctx).Info.Imm))
+            return ERR_UNKNOWN_OPERAND;
+
+        return 1;
+    }
+#endif
+
+    bool IsCondition() const
+    {
+        return m_op == '<' || m_op == '>' || m_op == '=' || m_op == '&' || m_op == '|';
+    }
+
+    // Range of the result from the ranges of the operands.
+    Interval GetRange(const CompileContext& ctx) const
+    {
+        Interval one = m_lhs->GetMarshallingInfo(ctx).Range;
+        Interval two = m_rhs->GetMarshallingInfo(ctx).Range;
+        bool int32 = GetState(ctx).Info.Int32;
+        double error = int32 ? 0.0 : ctx.GetRoundingError();
+
+        Interval range;
+        switch (m_op)
+        {
+            case '+':
+                range = Interval::Add(one, two, error);
+                break;
+            case '-':
+                range = Interval::Add(one, Interval::Negate(two), error);
+                break;
+            case '*':
+                range = Interval::Mul(one, two, error);
+                break;
+            case '/':
+                if (!int32)
+                    return Interval::Div(one, two, error);
+
+                // Truncated toward zero, x / 0 and x / -1 are special.
+                if (!IsDivisorSafe(ctx))
+                    return Interval::Int32();
+
+                range = Interval::Div(one, two, ctx.GetRoundingError());
+                range = Interval::Make(floor(range.Min), ceil(range.Max), false);
+                break;
+            case '<':
+                return GetAboveRange(two, one);
+            case '>':
+                return GetAboveRange(one, two);
+            case '=':
+                if (one.Max < two.Min || two.Max < one.Min)
+                    return Interval::Point(0.0);
+                if (one.IsPoint() && two.IsPoint() && one.Min == two.Min)
+                    return Interval::Point(1.0);
+                return Interval::Make(0.0, 1.0, false);
+            case '&':
+                one = GetTruthRange(one);
+                two = GetTruthRange(two);
+                return Interval::Make(one.Min * two.Min, one.Max * two.Max, false);
+            case '|':
+                one = GetTruthRange(one);
+                two = GetTruthRange(two);
+                return Interval::Make(one.Min > two.Min ? one.Min : two.Min, one.Max > two.Max ? one.Max : two.Max, false);
+            default:
+                return Interval::Full();
+        }
+
+        return int32 ? WrapInt32Range(range) : range;
+    }
+
+    // Range of a > b, NaN compares false.
+    static Interval GetAboveRange(const Interval& one, const Interval& two)
+    {
+        if (one.Max <= two.Min)
+            return Interval::Point(0.0);
+        if (one.Min > two.Max && !one.MayBeNaN && !two.MayBeNaN)
+            return Interval::Point(1.0);
+
+        return Interval::Make(0.0, 1.0, false);
+    }
+
+    // Range of the truth value, NaN is true.
+    static Interval GetTruthRange(const Interval& range)
+    {
+        if (range.Min > 0.0 || range.Max < 0.0)
+            return Interval::Point(1.0);
+        if (range.IsPoint())
+            return Interval::Point(0.0);
+
+        return Interval::Make(0.0, 1.0, false);
+    }
+
+    // Whether the range of the integer divisor excludes 0 and -1, idiv needs no check then.
+    bool IsDivisorSafe(const CompileContext& ctx) const
+    {
+        Interval divisor = m_rhs->GetMarshallingInfo(ctx).Range;
+        return !divisor.MayBeNaN && !divisor.Contains(0.0) && !divisor.Contains(-1.0);
+    }
+
+    virtual int EmitStep(ByteBuffer& buf, CompileContext& ctx, int step, const Expression** child) const
+    {
+        NodeState& state = GetState(ctx);
+        if (state.Info.Type == MARSHALLING_EAX)
+            return EmitInt32Step(buf, ctx, step, child);
+
+        if (UsesHorner(ctx))
+            return EmitHornerStep(buf, ctx, step, child);
+
+        if (state.Info.Type == MARSHALLING_ST0 && GetLazyOperand(ctx))
+            return EmitLazyStep(buf, ctx, step, child);
+
+        switch (step)
+        {
+            case 0:
+#ifdef _ENABLE_EXPR_FOLDING
+                // Push the folded constant onto the fpu stack.
+                if (state.Info.Type == MARSHALLING_IMM)
+                    return NumberExpression::EmitValue(buf, ctx, state.Info.Imm);
+#endif
+
+                // The larger operand goes first so that fewer values are held on the stack.
+                state.Swapped = m_rhs->GetExpressionTreeLength(ctx) > m_lhs->GetExpressionTreeLength(ctx);
+                *child = state.Swapped ? m_rhs : m_lhs;
+                return EMIT_STEP_CHILD;
+
+            case 1:
+                // The first operand is kept on the x87 stack while the second one is evaluated,
+                // unless the stack is too full for it.
+                state.Spilled = ctx.GetFpuDepth() >= MAX_FPU_DEPTH;
+                if (state.Spilled)
                 {
-                    case '+':
-                    case '*':
-                    default:
-                        goto _operation;
-                    case '-':
-                        if (!buf.append_16(0xE1DE)) // fsubrp
-                            return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                        break;
-                    case '/':
-                        if (!buf.append_16(0xF1DE)) // fdivrp
-                            return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                        break;
+                    if (!EmitSpill(buf))
+                        return ERR_OUTPUT_BUFFER_TOO_SMALL;
                 }
-            }
-            else
+                else
+                    ctx.SetFpuDepth(ctx.GetFpuDepth() + 1);
+
+                *child = state.Swapped ? m_lhs : m_rhs;
+                return EMIT_STEP_CHILD;
+        }
+
+        if (state.Spilled)
+        {
+            if (!EmitReload(buf))
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+        }
+        else
+            ctx.SetFpuDepth(ctx.GetFpuDepth() - 1);
+
+        switch (m_op)
+        {
+            case '<':
+            case '>':
+            case '=':
+                return EmitCompare(buf, state.Swapped);
+            case '&':
+            case '|':
+                return EmitLogical(buf);
+        }
+
+        // Operation, st1 holds the first operand.
+        if (state.Swapped)
+        {
+            switch (m_op)
             {
-                EXIT_ON_ERR(m_lhs->Emit(buf, identifierInfoCallback));
-                EXIT_ON_ERR(m_rhs->Emit(buf, identifierInfoCallback));
+                case '-':
+                    if (!buf.append_16(0xE1DE)) // fsubrp
+                        return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                    return EMIT_STEP_DONE;
+                case '/':
+                    if (!buf.append_16(0xF1DE)) // fdivrp
+                        return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                    return EMIT_STEP_DONE;
+            }
+        }
 
-                // Operation
-            _operation:
-                switch (m_op)
+        switch (m_op)
+        {
+            case '+':
+                if (!buf.append_16(0xC1DE))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            case '-':
+                if (!buf.append_16(0xE9DE))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            case '*':
+                if (!buf.append_16(0xC9DE))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            case '/':
+                if (!buf.append_16(0xF9DE))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            default:
+                // Must never happen
+                return ERR_UNKNOWN_OPERAND;
+        }
+
+        return EMIT_STEP_DONE;
+    }
+
+    virtual int DifferentiateNode(GradientBuilder& grad) const
+    {
+        switch (m_op)
+        {
+            case '+':
+                // d(a + b) = da + db
+                EXIT_ON_ERR(grad.Propagate(m_lhs, NULL));
+                return grad.Propagate(m_rhs, NULL);
+            case '-':
+                // d(a - b) = da - db
+                EXIT_ON_ERR(grad.Propagate(m_lhs, NULL));
+                return grad.Propagate(m_rhs, new BinaryExpression('-', new NumberExpression(0.0), grad.Adjoint()));
+            case '*':
+                // d(a * b) = b da + a db
+                if (grad.IsVarying(m_lhs))
+                    EXIT_ON_ERR(grad.Propagate(m_lhs, new BinaryExpression('*', grad.Adjoint(), grad.Value(m_rhs))));
+                if (grad.IsVarying(m_rhs))
+                    EXIT_ON_ERR(grad.Propagate(m_rhs, new BinaryExpression('*', grad.Adjoint(), grad.Value(m_lhs))));
+                return 1;
+            case '/':
+                // d(a / b) = (da - (a / b) db) / b
+                if (grad.IsVarying(m_lhs))
+                    EXIT_ON_ERR(grad.Propagate(m_lhs, new BinaryExpression('/', grad.Adjoint(), grad.Value(m_rhs))));
+                if (grad.IsVarying(m_rhs))
                 {
-                    case '+':
-                        if (!buf.append_16(0xC1DE))
-                            return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                        break;
-                    case '-':
-                        if (!buf.append_16(0xE9DE))
-                            return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                        break;
-                    case '*':
-                        if (!buf.append_16(0xC9DE))
-                            return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                        break;
-                    case '/':
-                        if (!buf.append_16(0xF9DE))
+                    Expression* product = new BinaryExpression('*', grad.Adjoint(), grad.Value(this));
+                    EXIT_ON_ERR(grad.Propagate(m_rhs, new BinaryExpression('/',
+                        new BinaryExpression('-', new NumberExpression(0.0), product), grad.Value(m_rhs))));
+                }
+                return 1;
+        }
+
+        // The comparisons and the logical operators are constant almost everywhere.
+        return 1;
+    }
+
+    // Replaces the value in st0 with 1.0 if it's not zero and 0.0 otherwise, NaN is true.
+    static bool EmitTruth(ByteBuffer& buf)
+    {
+        return buf.append_16(0xEED9) &&     // fldz
+            buf.append_16(0xE9DF) &&        // fucomip st0, st1
+            buf.append_16(0xD8DD) &&        // fstp st0
+            buf.append_16(0xE8D9) &&        // fld1
+            buf.append_16(0xEED9) &&        // fldz
+            buf.append_16(0xC9DB) &&        // fcmovne st0, st1
+            buf.append_16(0xD9DA) &&        // fcmovu st0, st1
+            buf.append_16(0xD9DD);          // fstp st1
+    }
+
+    // < > == without branches, the result is 1.0 or 0.0.
+    int EmitCompare(ByteBuffer& buf, bool swapped) const
+    {
+        // a > b is tested as "above" with a in st0, which is false for NaN.
+        // a < b is b > a.
+        bool lhsInSt0 = swapped;
+        if ((m_op == '<' && lhsInSt0) || (m_op == '>' && !lhsInSt0))
+        {
+            if (!buf.append_16(0xC9D9))     // fxch st1
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+        }
+
+        if (!buf.append_16(0xE9DF) ||       // fucomip st0, st1
+            !buf.append_16(0xD8DD) ||       // fstp st0
+            !buf.append_16(0xEED9) ||       // fldz
+            !buf.append_16(0xE8D9))         // fld1
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        if (m_op == '=')
+        {
+            if (!buf.append_16(0xC9DB) ||   // fcmovne st0, st1
+                !buf.append_16(0xD9DA))     // fcmovu st0, st1
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+        }
+        else if (!buf.append_16(0xD1DA))    // fcmovbe st0, st1
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        if (!buf.append_16(0xD9DD))         // fstp st1
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return EMIT_STEP_DONE;
+    }
+
+    // && || on the truth values of the operands, both are always evaluated.
+    int EmitLogical(ByteBuffer& buf) const
+    {
+        if (!EmitTruth(buf) ||
+            !buf.append_16(0xC9D9) ||       // fxch st1
+            !EmitTruth(buf))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        if (m_op == '&')
+        {
+            if (!buf.append_16(0xC9DE))     // fmulp
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+        }
+        else if (!buf.append_16(0xE9DB) ||  // fucomi st0, st1
+            !buf.append_16(0xC1DA) ||       // fcmovb st0, st1
+            !buf.append_16(0xD9DD))         // fstp st1
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return EMIT_STEP_DONE;
+    }
+
+    // Operand evaluated only when the result depends on it (COMPILE_LAZY_CALLS), NULL if there is none.
+    // A product skips only a finite operand, 0 * inf is NaN.
+    const Expression* GetLazyOperand(const CompileContext& ctx) const
+    {
+        if (!ctx.HasFlag(COMPILE_LAZY_CALLS) || (m_op != '*' && m_op != '&' && m_op != '|'))
+            return NULL;
+
+        const Expression* operands[] = { m_rhs, m_lhs };
+        for (int i = 0; i < 2; ++i)
+        {
+            MarshallingInfo info = operands[i]->GetMarshallingInfo(ctx);
+            if (info.Expensive && (m_op != '*' || (!info.Range.MayBeNaN && info.Range.IsFinite())))
+                return operands[i];
+        }
+
+        return NULL;
+    }
+
+    // The other operand goes first, the lazy one is skipped where it can't change the result:
+    // a * b is a for a 0 or NaN, a && b is 0 for a 0, a || b is 1 for a not 0.
+    int EmitLazyStep(ByteBuffer& buf, CompileContext& ctx, int step, const Expression** child) const
+    {
+        NodeState& state = GetState(ctx);
+        switch (step)
+        {
+            case 0:
+                state.Swapped = GetLazyOperand(ctx) == m_lhs;
+                ++ctx.GetStats().lazy_guards;
+                *child = state.Swapped ? m_rhs : m_lhs;
+                return EMIT_STEP_CHILD;
+
+            case 1:
+                if (m_op == '*')
+                {
+                    if (!buf.append_16(0xEED9) ||   // fldz
+                        !buf.append_16(0xE9DF))     // fucomip st0, st1
+                        return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+                    state.SkipJump = EmitJump(buf, JUMP_E);
+                    if (!state.SkipJump)
+                        return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+                    state.Spilled = ctx.GetFpuDepth() >= MAX_FPU_DEPTH;
+                    if (state.Spilled)
+                    {
+                        if (!EmitSpill(buf))
                             return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                        break;
-                    default:
-                        // Must never happen
-                        return ERR_UNKNOWN_OPERAND;
+                    }
+                    else
+                        ctx.SetFpuDepth(ctx.GetFpuDepth() + 1);
                 }
+                else
+                {
+                    // The truth value of the first operand is the result when the jump is taken.
+                    if (!EmitTruth(buf) ||
+                        !buf.append_16(0xEED9) ||   // fldz
+                        !buf.append_16(0xE9DF))     // fucomip st0, st1
+                        return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+                    state.SkipJump = EmitJump(buf, m_op == '&' ? JUMP_E : JUMP_NE);
+                    if (!state.SkipJump || !buf.append_16(0xD8DD))  // fstp st0
+                        return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                }
+
+                *child = state.Swapped ? m_lhs : m_rhs;
+                return EMIT_STEP_CHILD;
+        }
+
+        if (m_op == '*')
+        {
+            if (state.Spilled)
+            {
+                if (!EmitReload(buf))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
             }
+            else
+                ctx.SetFpuDepth(ctx.GetFpuDepth() - 1);
+
+            if (!buf.append_16(0xC9DE))             // fmulp
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
         }
+        else if (!EmitTruth(buf))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
 
-        return buf.pos();
+        PatchJump(buf, state.SkipJump);
+        return EMIT_STEP_DONE;
     }
 
-#ifdef _ENABLE_EXPR_FOLDING
-    bool compute(double& result) const
+    // The operation on integers, left to right. The first operand is pushed
+    // onto the native stack while the second one is evaluated, constants are used in place.
+    int EmitInt32Step(ByteBuffer& buf, CompileContext& ctx, int step, const Expression** child) const
     {
-        double one = m_lhs->GetMarshallingInfo().Imm;
-        double two = m_rhs->GetMarshallingInfo().Imm;
+        NodeState& state = GetState(ctx);
+        if (step == 0)
+        {
+            state.Spilled = 0;
+            if (m_lhs->GetMarshallingInfo(ctx).Type != MARSHALLING_IMM)
+            {
+                *child = m_lhs;
+                return EMIT_STEP_CHILD;
+            }
+
+            if (!buf.append_8(0xB8) ||              // mov eax, imm32
+                !buf.append_32(uint32(int32(m_lhs->GetMarshallingInfo(ctx).Imm))))
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+        }
+
+        if (state.Spilled)
+        {
+            if (!buf.append_16(0xC189) ||           // mov ecx, eax
+                !buf.append_8(0x58))                // pop eax
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+        }
+        else if (m_rhs->GetMarshallingInfo(ctx).Type != MARSHALLING_IMM)
+        {
+            if (!buf.append_8(0x50))                // push eax
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+            state.Spilled = 1;
+            *child = m_rhs;
+            return EMIT_STEP_CHILD;
+        }
+        else if (!buf.append_8(0xB9) ||             // mov ecx, imm32
+            !buf.append_32(uint32(int32(m_rhs->GetMarshallingInfo(ctx).Imm))))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        // eax holds the first operand, ecx the second one.
         switch (m_op)
         {
-            case '+': result = one + two; return true;
-            case '-': result = one - two; return true;
-            case '*': result = one * two; return true;
-            case '/': result = one / two; return true;
+            case '+':
+                if (!buf.append_16(0xC801))         // add eax, ecx
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                return EMIT_STEP_DONE;
+            case '-':
+                if (!buf.append_16(0xC829))         // sub eax, ecx
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                return EMIT_STEP_DONE;
+            case '*':
+                if (!buf.append_8(0x0F) ||          // imul eax, ecx
+                    !buf.append_16(0xC1AF))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                return EMIT_STEP_DONE;
+            case '/':
+                return EmitInt32Divide(buf, !IsDivisorSafe(ctx));
+            case '<':
+            case '>':
+            case '=':
+            {
+                // setl al, setg al, sete al
+                uint8 setcc = m_op == '<' ? 0x9C : m_op == '>' ? 0x9F : 0x94;
+                if (!buf.append_16(0xC839) ||       // cmp eax, ecx
+                    !buf.append_8(0x0F) ||          // setcc al
+                    !buf.append_8(setcc) ||
+                    !buf.append_8(0xC0))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            }
+            case '&':
+                if (!buf.append_16(0xC085) ||       // test eax, eax
+                    !buf.append_8(0x0F) ||          // setne al
+                    !buf.append_16(0xC095) ||
+                    !buf.append_16(0xC985) ||       // test ecx, ecx
+                    !buf.append_8(0x0F) ||          // setne cl
+                    !buf.append_16(0xC195) ||
+                    !buf.append_16(0xC820))         // and al, cl
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            case '|':
+                if (!buf.append_16(0xC809) ||       // or eax, ecx
+                    !buf.append_8(0x0F) ||          // setne al
+                    !buf.append_16(0xC095))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
             default:
                 // Must never happen
-                return false;
+                return ERR_UNKNOWN_OPERAND;
         }
+
+        if (!buf.append_8(0x0F) ||                  // movzx eax, al
+            !buf.append_16(0xC0B6))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return EMIT_STEP_DONE;
     }
-#endif
 
-    virtual MarshallingInfo GetMarshallingInfo() const
+    // eax / ecx truncated toward zero. idiv would fault for the divisors 0 and -1
+    // (with -2147483648), eax * ecx gives the defined results 0 and -eax for them
+    // unless the divisor isn't checked.
+    static int EmitInt32Divide(ByteBuffer& buf, bool checked)
     {
-        MarshallingInfo info;
-        MarshallingInfo linfo = m_lhs->GetMarshallingInfo();
-        MarshallingInfo rinfo = m_rhs->GetMarshallingInfo();
-
-#ifdef _ENABLE_EXPR_FOLDING
-        if (linfo.Type == MARSHALLING_IMM &&
-            rinfo.Type == MARSHALLING_IMM)
+        if (!checked)
         {
-            // Fold the constant
-            info.Type = MARSHALLING_IMM;
-            compute(info.Imm);
+            if (!buf.append_8(0x99) ||              // cdq
+                !buf.append_16(0xF9F7))             // idiv ecx
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+            return EMIT_STEP_DONE;
         }
-        else
-#endif
+
+        if (!buf.append_8(0x8D) ||                  // lea edx, [ecx+1]
+            !buf.append_16(0x0151) ||
+            !buf.append_8(0x83) ||                  // cmp edx, 1
+            !buf.append_16(0x01FA))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        int specialJump = EmitJump(buf, JUMP_BE);
+        if (!specialJump ||
+            !buf.append_8(0x99) ||                  // cdq
+            !buf.append_16(0xF9F7))                 // idiv ecx
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        int doneJump = EmitJump(buf, JUMP_ALWAYS);
+        if (!doneJump)
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        PatchJump(buf, specialJump);
+        if (!buf.append_8(0x0F) ||                  // imul eax, ecx
+            !buf.append_16(0xC1AF))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        PatchJump(buf, doneJump);
+
+        return EMIT_STEP_DONE;
+    }
+
+#ifdef _ENABLE_EXPR_FOLDING
+    // The operation on integer constants, with the results of EmitInt32Step.
+    bool computeInt32(const CompileContext& ctx, double& result) const
+    {
+        int64 one = int32(m_lhs->GetMarshallingInfo(ctx).Imm);
+        int64 two = int32(m_rhs->GetMarshallingInfo(ctx).Imm);
+        switch (m_op)
         {
-            info.Type = MARSHALLING_ST0;
+            case '+': result = WrapInt32(one + two); return true;
+            case '-': result = WrapInt32(one - two); return true;
+            case '*': result = WrapInt32(one * two); return true;
+            case '/': result = WrapInt32(two == 0 || two == -1 ? one * two : one / two); return true;
+            case '<': result = one < two ? 1.0 : 0.0; return true;
+            case '>': result = one > two ? 1.0 : 0.0; return true;
+            case '=': result = one == two ? 1.0 : 0.0; return true;
+            case '&': result = one != 0 && two != 0 ? 1.0 : 0.0; return true;
+            case '|': result = one != 0 || two != 0 ? 1.0 : 0.0; return true;
+            default:
+                // Must never happen
+                return false;
         }
-
-        return info;
     }
 
-    virtual int GetExpressionTreeLength() const
+    bool compute(const CompileContext& ctx, double& result) const
     {
-        return m_lhs->GetExpressionTreeLength() + m_rhs->GetExpressionTreeLength();
+        double one = m_lhs->GetMarshallingInfo(ctx).Imm;
+        double two = m_rhs->GetMarshallingInfo(ctx).Imm;
+        switch (m_op)
+        {
+            case '+': result = one + two; return true;
+            case '-': result = one - two; return true;
+            case '*': result = one * two; return true;
+            case '/': result = one / two; return true;
+            case '<': result = one < two ? 1.0 : 0.0; return true;
+            case '>': result = one > two ? 1.0 : 0.0; return true;
+            case '=': result = one == two ? 1.0 : 0.0; return true;
+            case '&': result = one != 0.0 && two != 0.0 ? 1.0 : 0.0; return true;
+            case '|': result = one != 0.0 || two != 0.0 ? 1.0 : 0.0; return true;
+            default:
+                // Must never happen
+                return false;
+        }
     }
 #endif
+#endif
 };
 
 #endif
@@ -3,6 +3,8 @@
 
 #include "util.h"
 
+// Appends bytes to a fixed size array. With NULL data nothing is written,
+// the buffer only counts the bytes (counting mode).
 class ByteBuffer
 {
 public:
@@ -21,6 +23,11 @@ public:
         return m_pos;
     }
 
+    inline uint8* data()
+    {
+        return m_data;
+    }
+
     inline bool ensureCapacity(int len)
     {
         return m_length - m_pos >= len;
@@ -31,7 +38,8 @@ public:
         if (!ensureCapacity(1))
             return false;
 
-        m_data[m_pos] = uint8(byte);
+        if (m_data)
+            m_data[m_pos] = uint8(byte);
         ++m_pos;
         return true;
     }
@@ -41,7 +49,8 @@ public:
         if (!ensureCapacity(2))
             return false;
 
-        *(uint16*)&m_data[m_pos] = uint16(twobytes);
+        if (m_data)
+            *(uint16*)&m_data[m_pos] = uint16(twobytes);
         m_pos += 2;
         return true;
     }
@@ -51,11 +60,58 @@ public:
         if (!ensureCapacity(4))
             return false;
 
-        *(uint32*)&m_data[m_pos] = uint32(val);
+        if (m_data)
+            *(uint32*)&m_data[m_pos] = uint32(val);
         m_pos += 4;
         return true;
     }
 
+    inline bool append_64(uint64 val)
+    {
+        if (!ensureCapacity(8))
+            return false;
+
+        if (m_data)
+            *(uint64*)&m_data[m_pos] = val;
+        m_pos += 8;
+        return true;
+    }
+
+    // Appends a pointer-sized absolute address.
+    inline bool append_ptr(const void* ptr)
+    {
+#ifdef _EXPR_TARGET_X64
+        return append_64(uint64(ptr));
+#else
+        return append_32(uint32(ptr));
+#endif
+    }
+
+    // Overwrites previously appended bytes.
+    inline void patch_8(int pos, int byte)
+    {
+        if (m_data)
+            m_data[pos] = uint8(byte);
+    }
+
+    inline void patch_32(int pos, uint32 val)
+    {
+        if (m_data)
+            *(uint32*)&m_data[pos] = val;
+    }
+
+    inline void patch_ptr(int pos, const void* ptr)
+    {
+        if (!m_data)
+            return;
+
+#ifdef _EXPR_TARGET_X64
+        *(uint64*)&m_data[pos] = uint64(ptr);
+#else
+        *(uint32*)&m_data[pos] = uint32(ptr);
+#endif
+    }
+
     inline ~ByteBuffer()
     {
         if (m_alloc)
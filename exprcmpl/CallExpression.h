@@ -4,6 +4,8 @@
 #include "util.h"
 #include "Expression.h"
 #include "NumberExpression.h"
+#include "BinaryExpression.h"
+#include "GradientBuilder.h"
 
 class CallExpression : public Expression
 {
@@ -11,25 +13,35 @@ class CallExpression : public Expression
     {
         const char* name;
         int argc;
-        int(CallExpression::*handler)(ByteBuffer&, pIdentifierInfoCallback) const;
-        double(CallExpression::*folder)() const;
+        int(CallExpression::*handler)(ByteBuffer&, CompileContext&) const;
+        double(CallExpression::*folder)(const CompileContext&) const;
+        int(CallExpression::*int32Handler)(ByteBuffer&) const;    // NULL if there is no integer form
+        int(CallExpression::*differentiator)(GradientBuilder&) const; // NULL if the derivative is 0
+        Interval(CallExpression::*ranger)(const CompileContext&) const;  // NULL if the range is unknown
+        int(CallExpression::*chooser)(const CompileContext&) const;  // NULL if the result is never an argument as it is
     };
 
     static const BuiltInFunct s_builtInFuncts[];
 
     const BuiltInFunct* m_builtInFunct;
     bool m_isBuiltInOverload;
-    MarshallingInfo m_info;
+
+    // Layout of a memo cache slot in CompileOptions::memo_storage.
+    enum
+    {
+        MEMO_SEQUENCE = 0,          // dword, 0 until the first store, odd during a store
+        MEMO_RESULT   = 16,         // tbyte, result of the call
+        MEMO_ARGS     = 32,         // arguments of the call as they were passed
+    };
+
+    // Limit of the stack arguments of a host function on x86, 4 byte words.
+    static const int MAX_ARG_WORDS = 32;
 
 public:
-    CallExpression(const char* name, int nameLen, Expression const* const* args, int argc)
+    CallExpression(const char* name, int nameLen, Expression const* const* args, int argc, bool copyName = true)
         : Expression()
     {
-        char* ident = new char[nameLen+1];
-        memcpy(ident, name, nameLen);
-        ident[nameLen] = 0;
-        m_identifier = ident;
-        m_identifierLen = nameLen;
+        SetIdentifier(name, nameLen, copyName);
 
         m_args = args;
         m_argc = argc;
@@ -40,7 +52,7 @@ public:
         const BuiltInFunct* funct = s_builtInFuncts;
         while (funct->name)
         {
-            if (!strcmp(funct->name, m_identifier))
+            if (!strncmp(funct->name, m_identifier, m_identifierLen) && !funct->name[m_identifierLen])
             {
                 m_isBuiltInOverload = true;
 
@@ -53,71 +65,26 @@ public:
             ++funct;
         }
 
-        m_info.Type = MARSHALLING_ST0;
-
-#ifdef _ENABLE_EXPR_FOLDING
-        if (m_builtInFunct)
-        {
-            bool ok = true;
-            for (int i = 0; i < m_argc; ++i)
-            {
-                if (m_args[i]->GetMarshallingInfo().Type != MARSHALLING_IMM)
-                {
-                    ok = false;
-                    break;
-                }
-            }
-
-            if (ok)
-            {
-                m_info.Type = MARSHALLING_IMM;
-                m_info.Imm = (this->*m_builtInFunct->folder)();
-            }
-        }
-#endif
     }
 
 #ifdef _ENABLE_EXPR_TOSTRING
-    virtual int ToString(char* str, int len) const
+    virtual bool ToStringStep(TextBuffer& text, int step, const Expression** child) const
     {
-        int OrigLen = len;
-
-        if (len < m_identifierLen+1 + 2*m_argc + 1)
-            return 0;
-
-        memcpy_s(str, len, m_identifier, m_identifierLen);
-        len -= m_identifierLen+1;
-        str += m_identifierLen;
-        str[0] = '(';
-        str += 1;
-
-        int l;
-        for (int i = 0; i < m_argc; ++i)
+        if (step == 0)
         {
-            l = m_args[i]->ToString(str, len);
-            if (!l)
-                goto ret;
-            len -= l;
-            str += l;
-
-            if (i + 1 < m_argc)
-            {
-                l = sprintf_s(str, len, ", ");
-                if (!l)
-                    goto ret;
-                str += l;
-                len -= l;
-            }
+            if (!text.append(m_identifier, m_identifierLen) || !text.append_char('('))
+                return false;
         }
+        else if (step < m_argc && !text.append(", ", 2))
+            return false;
 
-        l = sprintf_s(str, len, ")");
-        if (!l)
-            goto ret;
-        str += l;
-        len -= l;
+        if (step < m_argc)
+        {
+            *child = m_args[step];
+            return true;
+        }
 
-    ret:
-        return OrigLen - len;
+        return text.append_char(')');
     }
 #endif
 
@@ -125,13 +92,14 @@ public:
 private:
     int CheckArgs(const uint8* args) const
     {
+        if (!args)
+            return m_argc ? ERR_ARGC_DOESNT_MATCH : 1;
+
         int argc = 0;
-        while (true)
+        while (*args != IDENTIFIER_NONE)
         {
-            uint8 type = *++args;
-            if (type == IDENTIFIER_NONE)
-                break;
-            else if (type == IDENTIFIER_FUNC)
+            uint8 type = GetArgType(args++, 0);
+            if (type == IDENTIFIER_NONE || type > IDENTIFIER_FLOAT64)
                 return ERR_ARG_TYPE_ERR;
 
             ++argc;
@@ -145,10 +113,20 @@ private:
         return 1;
     }
 
-    int EmitSin(ByteBuffer& buf, pIdentifierInfoCallback identifierInfoCallback) const
+    // Type of the argument without the IdentifierArgFlags.
+    static uint8 GetArgType(const uint8* args, int i)
+    {
+        return uint8(args[i] & ~IDENTIFIER_ARG_UNUSED);
+    }
+
+    // Unused arguments are skipped unless they call host functions that aren't pure.
+    bool IsArgPruned(const CompileContext& ctx, const Identifier& ident, int i) const
     {
-        EXIT_ON_ERR(m_args[0]->Emit(buf, identifierInfoCallback));
+        return (ident.func_argtypes[i] & IDENTIFIER_ARG_UNUSED) && !m_args[i]->GetMarshallingInfo(ctx).Effects;
+    }
 
+    int EmitSin(ByteBuffer& buf, CompileContext& ctx) const
+    {
         if (!buf.append_8(0xD9) ||      // fsin
             !buf.append_8(0xFE))
             return ERR_OUTPUT_BUFFER_TOO_SMALL;
@@ -156,15 +134,13 @@ private:
         return buf.pos();
     }
 
-    double FoldSin() const
+    double FoldSin(const CompileContext& ctx) const
     {
-        return sin(m_args[0]->GetMarshallingInfo().Imm);
+        return sin(m_args[0]->GetMarshallingInfo(ctx).Imm);
     }
 
-    int EmitCos(ByteBuffer& buf, pIdentifierInfoCallback identifierInfoCallback) const
+    int EmitCos(ByteBuffer& buf, CompileContext& ctx) const
     {
-        EXIT_ON_ERR(m_args[0]->Emit(buf, identifierInfoCallback));
-
         if (!buf.append_8(0xD9) ||      // fcos
             !buf.append_8(0xFF))
             return ERR_OUTPUT_BUFFER_TOO_SMALL;
@@ -172,15 +148,13 @@ private:
         return buf.pos();
     }
 
-    double FoldCos() const
+    double FoldCos(const CompileContext& ctx) const
     {
-        return cos(m_args[0]->GetMarshallingInfo().Imm);
+        return cos(m_args[0]->GetMarshallingInfo(ctx).Imm);
     }
 
-    int EmitAbs(ByteBuffer& buf, pIdentifierInfoCallback identifierInfoCallback) const
+    int EmitAbs(ByteBuffer& buf, CompileContext& ctx) const
     {
-        EXIT_ON_ERR(m_args[0]->Emit(buf, identifierInfoCallback));
-
         if (!buf.append_8(0xD9) ||      // fabs
             !buf.append_8(0xE1))
             return ERR_OUTPUT_BUFFER_TOO_SMALL;
@@ -188,15 +162,13 @@ private:
         return buf.pos();
     }
 
-    double FoldAbs() const
+    double FoldAbs(const CompileContext& ctx) const
     {
-        return fabs(m_args[0]->GetMarshallingInfo().Imm);
+        return fabs(m_args[0]->GetMarshallingInfo(ctx).Imm);
     }
 
-    int EmitChs(ByteBuffer& buf, pIdentifierInfoCallback identifierInfoCallback) const
+    int EmitChs(ByteBuffer& buf, CompileContext& ctx) const
     {
-        EXIT_ON_ERR(m_args[0]->Emit(buf, identifierInfoCallback));
-
         if (!buf.append_8(0xD9) ||      // fchs
             !buf.append_8(0xE0))
             return ERR_OUTPUT_BUFFER_TOO_SMALL;
@@ -204,35 +176,31 @@ private:
         return buf.pos();
     }
 
-    double FoldChs() const
+    double FoldChs(const CompileContext& ctx) const
     {
-        return -m_args[0]->GetMarshallingInfo().Imm;
+        return -m_args[0]->GetMarshallingInfo(ctx).Imm;
     }
 
-    int EmitTan(ByteBuffer& buf, pIdentifierInfoCallback identifierInfoCallback) const
+    int EmitTan(ByteBuffer& buf, CompileContext& ctx) const
     {
-        EXIT_ON_ERR(m_args[0]->Emit(buf, identifierInfoCallback));
-
-        if (!buf.append_8(0xD9) ||      // ftan
+        if (!buf.append_8(0xD9) ||      // fptan
             !buf.append_8(0xF2) ||
-            !buf.append_8(0xDD) ||      // ffree st(0)
-            !buf.append_8(0xC0))
+            !buf.append_8(0xDD) ||      // fstp st0, drops the 1.0 pushed by fptan
+            !buf.append_8(0xD8))
             return ERR_OUTPUT_BUFFER_TOO_SMALL;
 
         return buf.pos();
     }
 
-    double FoldTan() const
+    double FoldTan(const CompileContext& ctx) const
     {
-        return tan(m_args[0]->GetMarshallingInfo().Imm);
+        return tan(m_args[0]->GetMarshallingInfo(ctx).Imm);
     }
 
-    int EmitCot(ByteBuffer& buf, pIdentifierInfoCallback identifierInfoCallback) const
+    int EmitCot(ByteBuffer& buf, CompileContext& ctx) const
     {
-        EXIT_ON_ERR(m_args[0]->Emit(buf, identifierInfoCallback));
-
-        if (!buf.append_8(0xD9) ||      // ftan
-            !buf.append_8(0xE0) ||
+        if (!buf.append_8(0xD9) ||      // fptan
+            !buf.append_8(0xF2) ||
             !buf.append_8(0xDE) ||      // fdivrp
             !buf.append_8(0xF1))
             return ERR_OUTPUT_BUFFER_TOO_SMALL;
@@ -240,15 +208,13 @@ private:
         return buf.pos();
     }
 
-    double FoldCot() const
+    double FoldCot(const CompileContext& ctx) const
     {
-        return 1.0/tan(m_args[0]->GetMarshallingInfo().Imm);
+        return 1.0/tan(m_args[0]->GetMarshallingInfo(ctx).Imm);
     }
 
-    int EmitSqrt(ByteBuffer& buf, pIdentifierInfoCallback identifierInfoCallback) const
+    int EmitSqrt(ByteBuffer& buf, CompileContext& ctx) const
     {
-        EXIT_ON_ERR(m_args[0]->Emit(buf, identifierInfoCallback));
-
         if (!buf.append_8(0xD9) ||      // fsqrt
             !buf.append_8(0xFA))
             return ERR_OUTPUT_BUFFER_TOO_SMALL;
@@ -256,12 +222,12 @@ private:
         return buf.pos();
     }
 
-    double FoldSqrt() const
+    double FoldSqrt(const CompileContext& ctx) const
     {
-        return sqrt(m_args[0]->GetMarshallingInfo().Imm);
+        return sqrt(m_args[0]->GetMarshallingInfo(ctx).Imm);
     }
 
-    int EmitPi(ByteBuffer& buf, pIdentifierInfoCallback identifierInfoCallback) const
+    int EmitPi(ByteBuffer& buf, CompileContext& ctx) const
     {
         if (!buf.append_8(0xD9) ||      // fldpi
             !buf.append_8(0xEB))
@@ -270,163 +236,2171 @@ private:
         return buf.pos();
     }
 
-    double FoldPi() const
+    double FoldPi(const CompileContext& ctx) const
     {
         return M_PI;
     }
 
-public:
-    virtual int Emit(ByteBuffer& buf, pIdentifierInfoCallback identifierInfoCallback) const
+    // 2^st0, st0 is finite or infinite unless finite is set.
+    static bool EmitExp2(ByteBuffer& buf, bool finite)
     {
-#ifdef _ENABLE_EXPR_FOLDING
-        // check if the call foldable
-        if (m_info.Type == MARSHALLING_IMM)
-            return NumberExpression(m_info.Imm).Emit(buf, identifierInfoCallback);
-#endif
+        if (!buf.append_16(0xC0D9) ||       // fld st0
+            !buf.append_16(0xFCD9) ||       // frndint
+            !buf.append_16(0xE9DC) ||       // fsub st1, st0
+            !buf.append_16(0xC9D9))         // fxch st1
+            return false;
+
+        // The fraction of an infinity is NaN, fscale alone gives the result then.
+        if (!finite &&
+            (!buf.append_16(0xEED9) ||      // fldz
+            !buf.append_16(0xE9DB) ||       // fucomi st0, st1
+            !buf.append_16(0xD9DB) ||       // fcmovnu st0, st1
+            !buf.append_16(0xD9DD)))        // fstp st1
+            return false;
+
+        return buf.append_16(0xF0D9) &&     // f2xm1
+            buf.append_16(0xE8D9) &&        // fld1
+            buf.append_16(0xC1DE) &&        // faddp
+            buf.append_16(0xFDD9) &&        // fscale
+            buf.append_16(0xD9DD);          // fstp st1
+    }
 
-        // check built-in functions
-        if (m_builtInFunct)
-            return (this->*m_builtInFunct->handler)(buf, identifierInfoCallback);
+    int EmitExp(ByteBuffer& buf, CompileContext& ctx) const
+    {
+        bool finite = m_args[0]->GetMarshallingInfo(ctx).Range.IsFinite();
+        if (finite)
+            ++ctx.GetStats().range_simplified;
 
-        Identifier ident;
-        if (!identifierInfoCallback(m_identifier, m_identifierLen, &ident))
-            return !m_isBuiltInOverload ? ERR_UNKNOWN_IDENTIFIER : ERR_ARGC_DOESNT_MATCH;
+        if (!buf.append_16(0xEAD9) ||       // fldl2e
+            !buf.append_16(0xC9DE) ||       // fmulp
+            !EmitExp2(buf, finite))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
 
-        if (ident.Type != IDENTIFIER_FUNC)
-            return ERR_IDENTIFIER_MISUSE;
+        return buf.pos();
+    }
 
-        // check args
-        EXIT_ON_ERR(CheckArgs(ident.func_argtypes));
+    double FoldExp(const CompileContext& ctx) const
+    {
+        return exp(m_args[0]->GetMarshallingInfo(ctx).Imm);
+    }
 
-        // Emit Code
-        for (int i = 0; i < m_argc; ++i)
+    int EmitLog(ByteBuffer& buf, CompileContext& ctx) const
+    {
+        if (!buf.append_16(0xEDD9) ||       // fldln2
+            !buf.append_16(0xC9D9) ||       // fxch st1
+            !buf.append_16(0xF1D9))         // fyl2x
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return buf.pos();
+    }
+
+    double FoldLog(const CompileContext& ctx) const
+    {
+        return log(m_args[0]->GetMarshallingInfo(ctx).Imm);
+    }
+
+    int EmitLog10(ByteBuffer& buf, CompileContext& ctx) const
+    {
+        if (!buf.append_16(0xECD9) ||       // fldlg2
+            !buf.append_16(0xC9D9) ||       // fxch st1
+            !buf.append_16(0xF1D9))         // fyl2x
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return buf.pos();
+    }
+
+    double FoldLog10(const CompileContext& ctx) const
+    {
+        return log10(m_args[0]->GetMarshallingInfo(ctx).Imm);
+    }
+
+    // Exponent of pow that is lowered to a multiplication chain, if any.
+    bool GetIntegerExponent(const CompileContext& ctx, int32& exponent) const
+    {
+        if (m_builtInFunct->folder != &CallExpression::FoldPow)
+            return false;
+
+        MarshallingInfo info = m_args[1]->GetMarshallingInfo(ctx);
+        if (info.Type != MARSHALLING_IMM ||
+            !(info.Imm >= -MAX_POW_CHAIN_EXPONENT && info.Imm <= MAX_POW_CHAIN_EXPONENT) ||
+            info.Imm != double(int32(info.Imm)))
+            return false;
+
+        exponent = int32(info.Imm);
+        return true;
+    }
+
+    // x^n by squaring and multiplying, x is in st0.
+    static bool EmitPowChain(ByteBuffer& buf, int32 exponent)
+    {
+        if (exponent == 0)
+            return buf.append_16(0xD8DD) && // fstp st0
+                buf.append_16(0xE8D9);      // fld1
+
+        uint32 n = exponent < 0 ? uint32(-exponent) : uint32(exponent);
+        int bit = 31;
+        while (!(n & (1u << bit)))
+            --bit;
+
+        if (n > 1 && !buf.append_16(0xC0D9))    // fld st0
+            return false;
+
+        while (--bit >= 0)
         {
-            const Expression* expr = m_args[i];
-            MarshallingInfo einfo = expr->GetMarshallingInfo();
-#ifdef _ENABLE_EXPR_FOLDING
-            if (einfo.Type == MARSHALLING_IMM)
-            {
-                // push imm value to the stack
-                switch (ident.func_argtypes[i])
-                {
-                    case IDENTIFIER_FLOAT64:
-                        if (!buf.append_8(0x68) ||  // push imm32
-                            !buf.append_32(*((uint32*)&einfo.Imm + 1)) ||
-                            !buf.append_8(0x68) ||  // push imm32
-                            !buf.append_32(*((uint32*)&einfo.Imm + 0)))
-                            return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                        break;
-                    case IDENTIFIER_FLOAT32:
-                    {
-                        float val = float(einfo.Imm);
-                        if (!buf.append_8(0x68) ||  // push imm32
-                            !buf.append_32(*(uint32*)&val))
-                            return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                        break;
-                    }
-                    case IDENTIFIER_INT32:
-                    {
-                        int32 val = int32(einfo.Imm);
-                        if (!buf.append_8(0x68) ||  // push imm32
-                            !buf.append_32(*(uint32*)&val))
-                            return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                        break;
-                    }
-                    default:
-                        return ERR_ARG_TYPE_ERR;
-                }
-            }
-            else
-#endif
-            {
-                EXIT_ON_ERR(expr->Emit(buf, identifierInfoCallback));
+            if (!buf.append_16(0xC8D8))     // fmul st0, st0
+                return false;
 
-                // push st0 to the stack and pop the x87 stack
-                switch (ident.func_argtypes[i])
-                {
-                    case IDENTIFIER_FLOAT64:
-                        if (!buf.append_8(0x50) ||  // push eax
-                            !buf.append_8(0x50) ||  // push eax
-                            !buf.append_8(0xDD) ||  // fstp qword ptr [esp]
-                            !buf.append_8(0x1C) ||
-                            !buf.append_8(0x24))
-                            return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                        break;
-                    case IDENTIFIER_FLOAT32:
-                        if (!buf.append_8(0x50) ||  // push eax
-                            !buf.append_8(0xD9) ||  // fstp dword ptr [esp]
-                            !buf.append_8(0x1C) ||
-                            !buf.append_8(0x24))
-                            return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                        break;
-                    case IDENTIFIER_INT32:
-                        if (!buf.append_8(0x50) ||  // push eax
-                            !buf.append_8(0xDB) ||  // fistp dword ptr [esp]
-                            !buf.append_8(0x1C) ||
-                            !buf.append_8(0x24))
-                            return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                        break;
-                    default:
-                        return ERR_ARG_TYPE_ERR;
-                }
-            }
+            if ((n & (1u << bit)) && !buf.append_16(0xC9D8))    // fmul st0, st1
+                return false;
+        }
+
+        if (n > 1 && !buf.append_16(0xD9DD))    // fstp st1
+            return false;
 
-            if (!buf.append_8(0xB8) ||              // mov eax, imm dword
-                !buf.append_32(uint32(ident.ptr)) ||
-                !buf.append_8(0xFF) ||              // call eax
-                !buf.append_8(0xD0))
+        if (exponent < 0)
+            return buf.append_16(0xE8D9) && // fld1
+                buf.append_16(0xF1DE);      // fdivrp
+
+        return true;
+    }
+
+    // 2^(y*log2(x)), x must not be negative unless the exponent is a constant integer.
+    int EmitPow(ByteBuffer& buf, CompileContext& ctx) const
+    {
+        int32 exponent;
+        if (GetIntegerExponent(ctx, exponent))
+        {
+            if (!EmitPowChain(buf, exponent))
                 return ERR_OUTPUT_BUFFER_TOO_SMALL;
 
-            switch (ident.func_rtype)
-            {
-                case IDENTIFIER_INT32:
-                    if (!buf.append_8(0x50) ||      // push eax
-                        !buf.append_8(0xDB) ||      // fild dword ptr [esp]
-                        !buf.append_8(0x04) ||
-                        !buf.append_8(0x24) ||
-                        !buf.append_8(0x58))        // pop eax
-                        return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                    break;
-                case IDENTIFIER_FLOAT32:
-                case IDENTIFIER_FLOAT64:
-                    // value already in st0
-                    break;
-                default:
-                    return ERR_RET_TYPE_ERR;
-            }
+            return buf.pos();
         }
 
+        // y*log2(x) is finite for finite y and x > 0.
+        Interval x = m_args[0]->GetMarshallingInfo(ctx).Range;
+        bool finite = x.Min > 0.0 && x.IsFinite() && m_args[1]->GetMarshallingInfo(ctx).Range.IsFinite();
+        if (finite)
+            ++ctx.GetStats().range_simplified;
+
+        if (!buf.append_16(0xC9D9) ||       // fxch st1
+            !buf.append_16(0xF1D9) ||       // fyl2x
+            !EmitExp2(buf, finite))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
         return buf.pos();
     }
 
-    virtual MarshallingInfo GetMarshallingInfo() const
+    double FoldPow(const CompileContext& ctx) const
     {
-        return m_info;
+        return pow(m_args[0]->GetMarshallingInfo(ctx).Imm, m_args[1]->GetMarshallingInfo(ctx).Imm);
     }
 
-    virtual int GetExpressionTreeLength() const
+    int EmitAtan2(ByteBuffer& buf, CompileContext& ctx) const
     {
-        int ret = 1;
+        if (!buf.append_16(0xF3D9))         // fpatan
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
 
-        for (int i = 0; i < m_argc; ++i)
-            ret += m_args[i]->GetExpressionTreeLength();
+        return buf.pos();
+    }
 
-        return ret;
+    double FoldAtan2(const CompileContext& ctx) const
+    {
+        return atan2(m_args[0]->GetMarshallingInfo(ctx).Imm, m_args[1]->GetMarshallingInfo(ctx).Imm);
     }
-#endif
-};
 
-const CallExpression::BuiltInFunct CallExpression::s_builtInFuncts[] =
-{
-    { "sin", 1, &CallExpression::EmitSin, &CallExpression::FoldSin },
-    { "cos", 1, &CallExpression::EmitCos, &CallExpression::FoldCos },
-    { "abs", 1, &CallExpression::EmitAbs, &CallExpression::FoldAbs },
-    { "chs", 1, &CallExpression::EmitChs, &CallExpression::FoldChs },
-    { "tan", 1, &CallExpression::EmitTan, &CallExpression::FoldTan },
-    { "cot", 1, &CallExpression::EmitCot, &CallExpression::FoldCot },
-    { "sqrt", 1, &CallExpression::EmitSqrt, &CallExpression::FoldSqrt },
-    { "pi", 0, &CallExpression::EmitPi, &CallExpression::FoldPi },
-    { NULL, 0, NULL, NULL }
-};
+    // Rounds to nearest and corrects by one, the control word is left alone.
+    int EmitFloor(ByteBuffer& buf, CompileContext& ctx) const
+    {
+        if (!buf.append_16(0xC0D9) ||       // fld st0
+            !buf.append_16(0xFCD9) ||       // frndint
+            !buf.append_16(0xE9DB) ||       // fucomi st0, st1
+            !buf.append_16(0xD9DD) ||       // fstp st1
+            !buf.append_16(0xEED9) ||       // fldz
+            !buf.append_16(0xE8D9) ||       // fld1
+            !buf.append_16(0xD1DA) ||       // fcmovbe st0, st1
+            !buf.append_16(0xD9DD) ||       // fstp st1
+            !buf.append_16(0xE9DE))         // fsubp
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return buf.pos();
+    }
+
+    double FoldFloor(const CompileContext& ctx) const
+    {
+        return floor(m_args[0]->GetMarshallingInfo(ctx).Imm);
+    }
+
+    // -floor(-x), correcting upward instead would give 0.0 for values in (-1, 0).
+    int EmitCeil(ByteBuffer& buf, CompileContext& ctx) const
+    {
+        if (!buf.append_16(0xE0D9) ||       // fchs
+            EmitFloor(buf, ctx) <= 0 ||
+            !buf.append_16(0xE0D9))         // fchs
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return buf.pos();
+    }
+
+    double FoldCeil(const CompileContext& ctx) const
+    {
+        return ceil(m_args[0]->GetMarshallingInfo(ctx).Imm);
+    }
+
+    // The arguments of the functions below are in st(argc-1)..st0.
+    // The comparisons leave the second argument of min and max when one of them is NaN.
+
+    int EmitMin(ByteBuffer& buf, CompileContext& ctx) const
+    {
+        if (!buf.append_16(0xE9DB) ||       // fucomi st0, st1
+            !buf.append_16(0xD1DB) ||       // fcmovnbe st0, st1
+            !buf.append_16(0xD9DD))         // fstp st1
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return buf.pos();
+    }
+
+    double FoldMin(const CompileContext& ctx) const
+    {
+        double a = m_args[0]->GetMarshallingInfo(ctx).Imm;
+        double b = m_args[1]->GetMarshallingInfo(ctx).Imm;
+        return b > a ? a : b;
+    }
+
+    int EmitMax(ByteBuffer& buf, CompileContext& ctx) const
+    {
+        if (!buf.append_16(0xC9D9) ||       // fxch st1
+            !buf.append_16(0xE9DB) ||       // fucomi st0, st1
+            !buf.append_16(0xD1DA) ||       // fcmovbe st0, st1
+            !buf.append_16(0xD9DD))         // fstp st1
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return buf.pos();
+    }
+
+    double FoldMax(const CompileContext& ctx) const
+    {
+        double a = m_args[0]->GetMarshallingInfo(ctx).Imm;
+        double b = m_args[1]->GetMarshallingInfo(ctx).Imm;
+        return a > b ? a : b;
+    }
+
+    // min(max(x, lo), hi)
+    int EmitClamp(ByteBuffer& buf, CompileContext& ctx) const
+    {
+        if (!buf.append_16(0xCAD9) ||       // fxch st2
+            !buf.append_16(0xE9DB) ||       // fucomi st0, st1
+            !buf.append_16(0xD1DA) ||       // fcmovbe st0, st1
+            !buf.append_16(0xD9DD) ||       // fstp st1
+            !buf.append_16(0xC9D9))         // fxch st1
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return EmitMin(buf, ctx);
+    }
+
+    double FoldClamp(const CompileContext& ctx) const
+    {
+        double x = m_args[0]->GetMarshallingInfo(ctx).Imm;
+        double lo = m_args[1]->GetMarshallingInfo(ctx).Imm;
+        double hi = m_args[2]->GetMarshallingInfo(ctx).Imm;
+        double m = x > lo ? x : lo;
+        return hi > m ? m : hi;
+    }
+
+    // c ? a : b, the parser's form of the conditional operator.
+    // Both branches are evaluated, NaN is true.
+    int EmitIf(ByteBuffer& buf, CompileContext& ctx) const
+    {
+        if (!buf.append_16(0xCAD9) ||       // fxch st2
+            !buf.append_16(0xEED9) ||       // fldz
+            !buf.append_16(0xE9DF) ||       // fucomip st0, st1
+            !buf.append_16(0xD8DD) ||       // fstp st0
+            !buf.append_16(0xC9D9) ||       // fxch st1
+            !buf.append_16(0xC9DB) ||       // fcmovne st0, st1
+            !buf.append_16(0xD9DA) ||       // fcmovu st0, st1
+            !buf.append_16(0xD9DD))         // fstp st1
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return buf.pos();
+    }
+
+    double FoldIf(const CompileContext& ctx) const
+    {
+        double c = m_args[0]->GetMarshallingInfo(ctx).Imm;
+        return c != 0.0 ? m_args[1]->GetMarshallingInfo(ctx).Imm : m_args[2]->GetMarshallingInfo(ctx).Imm;
+    }
+
+    // The integer forms take the arguments from the native stack, the last one on top,
+    // and leave the result in eax.
+
+    int EmitInt32Abs(ByteBuffer& buf) const
+    {
+        if (!buf.append_8(0x58) ||          // pop eax
+            !buf.append_8(0x99) ||          // cdq
+            !buf.append_16(0xD031) ||       // xor eax, edx
+            !buf.append_16(0xD029))         // sub eax, edx
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return buf.pos();
+    }
+
+    int EmitInt32Chs(ByteBuffer& buf) const
+    {
+        if (!buf.append_8(0x58) ||          // pop eax
+            !buf.append_16(0xD8F7))         // neg eax
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return buf.pos();
+    }
+
+    int EmitInt32Min(ByteBuffer& buf) const
+    {
+        if (!buf.append_8(0x59) ||          // pop ecx
+            !buf.append_8(0x58) ||          // pop eax
+            !buf.append_16(0xC839) ||       // cmp eax, ecx
+            !buf.append_8(0x0F) ||          // cmovg eax, ecx
+            !buf.append_16(0xC14F))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return buf.pos();
+    }
+
+    int EmitInt32Max(ByteBuffer& buf) const
+    {
+        if (!buf.append_8(0x59) ||          // pop ecx
+            !buf.append_8(0x58) ||          // pop eax
+            !buf.append_16(0xC839) ||       // cmp eax, ecx
+            !buf.append_8(0x0F) ||          // cmovl eax, ecx
+            !buf.append_16(0xC14C))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return buf.pos();
+    }
+
+    int EmitInt32Clamp(ByteBuffer& buf) const
+    {
+        if (!buf.append_8(0x5A) ||          // pop edx
+            !buf.append_8(0x59) ||          // pop ecx
+            !buf.append_8(0x58) ||          // pop eax
+            !buf.append_16(0xC839) ||       // cmp eax, ecx
+            !buf.append_8(0x0F) ||          // cmovl eax, ecx
+            !buf.append_16(0xC14C) ||
+            !buf.append_16(0xD039) ||       // cmp eax, edx
+            !buf.append_8(0x0F) ||          // cmovg eax, edx
+            !buf.append_16(0xC24F))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return buf.pos();
+    }
+
+    int EmitInt32If(ByteBuffer& buf) const
+    {
+        if (!buf.append_8(0x5A) ||          // pop edx
+            !buf.append_8(0x59) ||          // pop ecx
+            !buf.append_8(0x58) ||          // pop eax
+            !buf.append_16(0xC085) ||       // test eax, eax
+            !buf.append_16(0xD089) ||       // mov eax, edx
+            !buf.append_8(0x0F) ||          // cmovne eax, ecx
+            !buf.append_16(0xC145))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return buf.pos();
+    }
+
+    // Ranges of the results of the built-in functions from the ranges of the arguments.
+    // The rounded ones are widened by the rounding error.
+
+    // fsin and fcos leave arguments beyond 2^63 as they are.
+    Interval RangeSinCos(const CompileContext& ctx) const
+    {
+        Interval u = m_args[0]->GetMarshallingInfo(ctx).Range;
+        if (!(u.Min > -TRIG_ARG_LIMIT && u.Max < TRIG_ARG_LIMIT))
+            return Interval::Full();
+
+        return Interval::Make(-1.0, 1.0, u.MayBeNaN);
+    }
+
+    // -2147483648 stays negative in the integer forms of abs and chs.
+    Interval RangeAbs(const CompileContext& ctx) const
+    {
+        Interval u = m_args[0]->GetMarshallingInfo(ctx).Range;
+        if (GetState(ctx).Info.Int32 && u.Contains(-2147483648.0))
+            return Interval::Int32();
+
+        if (u.Min >= 0.0)
+            return u;
+        else if (u.Max <= 0.0)
+            return Interval::Negate(u);
+
+        return Interval::Make(0.0, -u.Min > u.Max ? -u.Min : u.Max, u.MayBeNaN);
+    }
+
+    Interval RangeChs(const CompileContext& ctx) const
+    {
+        Interval u = m_args[0]->GetMarshallingInfo(ctx).Range;
+        if (GetState(ctx).Info.Int32 && u.Contains(-2147483648.0))
+            return Interval::Int32();
+
+        return Interval::Negate(u);
+    }
+
+    Interval RangeSqrt(const CompileContext& ctx) const
+    {
+        Interval u = m_args[0]->GetMarshallingInfo(ctx).Range;
+        return Interval::Bounds(sqrt(u.Min > 0.0 ? u.Min : 0.0), sqrt(u.Max),
+            u.MayBeNaN || u.Min < 0.0, ctx.GetRoundingError());
+    }
+
+    // The range of the second argument is included when the first one may be NaN,
+    // the result is NaN only if the second one is.
+    Interval RangeMin(const CompileContext& ctx) const
+    {
+        return GetMinRange(m_args[0]->GetMarshallingInfo(ctx).Range, m_args[1]->GetMarshallingInfo(ctx).Range);
+    }
+
+    static Interval GetMinRange(const Interval& a, const Interval& b)
+    {
+        Interval range = Interval::Make(a.Min < b.Min ? a.Min : b.Min, a.Max < b.Max ? a.Max : b.Max, b.MayBeNaN);
+        return a.MayBeNaN ? Interval::Hull(range, b) : range;
+    }
+
+    Interval RangeMax(const CompileContext& ctx) const
+    {
+        return GetMaxRange(m_args[0]->GetMarshallingInfo(ctx).Range, m_args[1]->GetMarshallingInfo(ctx).Range);
+    }
+
+    static Interval GetMaxRange(const Interval& a, const Interval& b)
+    {
+        Interval range = Interval::Make(a.Min > b.Min ? a.Min : b.Min, a.Max > b.Max ? a.Max : b.Max, b.MayBeNaN);
+        return a.MayBeNaN ? Interval::Hull(range, b) : range;
+    }
+
+    // min(max(x, lo), hi) with the argument order of EmitClamp, hi is chosen over NaN.
+    Interval RangeClamp(const CompileContext& ctx) const
+    {
+        Interval m = GetMaxRange(m_args[0]->GetMarshallingInfo(ctx).Range, m_args[1]->GetMarshallingInfo(ctx).Range);
+        Interval hi = m_args[2]->GetMarshallingInfo(ctx).Range;
+        Interval range = Interval::Make(m.Min < hi.Min ? m.Min : hi.Min, m.Max < hi.Max ? m.Max : hi.Max, hi.MayBeNaN);
+        return m.MayBeNaN ? Interval::Hull(range, hi) : range;
+    }
+
+    Interval RangeIf(const CompileContext& ctx) const
+    {
+        return Interval::Hull(m_args[1]->GetMarshallingInfo(ctx).Range, m_args[2]->GetMarshallingInfo(ctx).Range);
+    }
+
+    Interval RangeExp(const CompileContext& ctx) const
+    {
+        Interval u = m_args[0]->GetMarshallingInfo(ctx).Range;
+        return Interval::Bounds(exp(u.Min), exp(u.Max), u.MayBeNaN, ctx.GetRoundingError());
+    }
+
+    Interval RangeLog(const CompileContext& ctx) const
+    {
+        Interval u = m_args[0]->GetMarshallingInfo(ctx).Range;
+        return Interval::Bounds(log(u.Min > 0.0 ? u.Min : 0.0), log(u.Max),
+            u.MayBeNaN || u.Min < 0.0, ctx.GetRoundingError());
+    }
+
+    Interval RangeLog10(const CompileContext& ctx) const
+    {
+        Interval u = m_args[0]->GetMarshallingInfo(ctx).Range;
+        return Interval::Bounds(log10(u.Min > 0.0 ? u.Min : 0.0), log10(u.Max),
+            u.MayBeNaN || u.Min < 0.0, ctx.GetRoundingError());
+    }
+
+    // Only the sign of the power is tracked.
+    Interval RangePow(const CompileContext& ctx) const
+    {
+        Interval a = m_args[0]->GetMarshallingInfo(ctx).Range;
+        Interval b = m_args[1]->GetMarshallingInfo(ctx).Range;
+
+        int32 exponent;
+        if (GetIntegerExponent(ctx, exponent))
+        {
+            if (exponent == 0)
+                return Interval::Point(1.0);
+
+            // x^-n is 1 / x^n, the sign of a zero x decides the sign of the infinity.
+            bool positive = exponent > 0 ? a.Min >= 0.0 : a.Min > 0.0;
+            bool negative = exponent > 0 ? a.Max <= 0.0 : a.Max < 0.0;
+            if (!(exponent & 1) || positive)
+                return Interval::Make(0.0, HUGE_VAL, a.MayBeNaN);
+            else if (negative)
+                return Interval::Make(-HUGE_VAL, 0.0, a.MayBeNaN);
+
+            return Interval::Make(-HUGE_VAL, HUGE_VAL, a.MayBeNaN);
+        }
+
+        // 2^(y*log2(x)), 0 * inf is NaN.
+        if (a.Min > 0.0)
+            return Interval::Make(0.0, HUGE_VAL, a.MayBeNaN || b.MayBeNaN || !a.IsFinite() || !b.IsFinite());
+
+        return Interval::Full();
+    }
+
+    Interval RangeAtan2(const CompileContext& ctx) const
+    {
+        double pi = Interval::Above(M_PI, ctx.GetRoundingError());
+        return Interval::Make(-pi, pi, m_args[0]->GetMarshallingInfo(ctx).Range.MayBeNaN ||
+            m_args[1]->GetMarshallingInfo(ctx).Range.MayBeNaN);
+    }
+
+    Interval RangeFloor(const CompileContext& ctx) const
+    {
+        Interval u = m_args[0]->GetMarshallingInfo(ctx).Range;
+        return Interval::Make(floor(u.Min), floor(u.Max), u.MayBeNaN);
+    }
+
+    Interval RangeCeil(const CompileContext& ctx) const
+    {
+        Interval u = m_args[0]->GetMarshallingInfo(ctx).Range;
+        return Interval::Make(ceil(u.Min), ceil(u.Max), u.MayBeNaN);
+    }
+
+    // Arguments the ranges make the result, -1 if they don't decide it.
+    // The comparisons are the ones of the folders.
+
+    int ChooseAbs(const CompileContext& ctx) const
+    {
+        return m_args[0]->GetMarshallingInfo(ctx).Range.IsPositive() ? 0 : -1;
+    }
+
+    // b > a ? a : b
+    int ChooseMin(const CompileContext& ctx) const
+    {
+        Interval a = m_args[0]->GetMarshallingInfo(ctx).Range;
+        Interval b = m_args[1]->GetMarshallingInfo(ctx).Range;
+        if (b.Max <= a.Min)
+            return 1;
+        if (b.Min > a.Max && !a.MayBeNaN && !b.MayBeNaN)
+            return 0;
+
+        return -1;
+    }
+
+    // a > b ? a : b
+    int ChooseMax(const CompileContext& ctx) const
+    {
+        Interval a = m_args[0]->GetMarshallingInfo(ctx).Range;
+        Interval b = m_args[1]->GetMarshallingInfo(ctx).Range;
+        if (a.Max <= b.Min)
+            return 1;
+        if (a.Min > b.Max && !a.MayBeNaN && !b.MayBeNaN)
+            return 0;
+
+        return -1;
+    }
+
+    // m = x > lo ? x : lo, hi > m ? m : hi
+    int ChooseClamp(const CompileContext& ctx) const
+    {
+        Interval x = m_args[0]->GetMarshallingInfo(ctx).Range;
+        Interval lo = m_args[1]->GetMarshallingInfo(ctx).Range;
+        Interval hi = m_args[2]->GetMarshallingInfo(ctx).Range;
+
+        double m = x.MayBeNaN || lo.Min > x.Min ? lo.Min : x.Min;
+        if (hi.Max <= m)
+            return 2;
+
+        if (hi.MayBeNaN || lo.MayBeNaN)
+            return -1;
+
+        if (!x.MayBeNaN && x.Min > lo.Max && hi.Min > x.Max)
+            return 0;
+        if (x.Max <= lo.Min && hi.Min > lo.Max)
+            return 1;
+
+        return -1;
+    }
+
+    // NaN is true.
+    int ChooseIf(const CompileContext& ctx) const
+    {
+        Interval c = m_args[0]->GetMarshallingInfo(ctx).Range;
+        if (c.Min > 0.0 || c.Max < 0.0)
+            return 1;
+        if (c.IsPoint())
+            return 2;
+
+        return -1;
+    }
+
+    // Derivative rules, see GradientBuilder. u is the argument of the unary functions.
+
+    // New call of a built-in function.
+    static Expression* NewCall(const char* name, Expression* arg0, Expression* arg1 = NULL, Expression* arg2 = NULL)
+    {
+        int argc = arg2 ? 3 : arg1 ? 2 : 1;
+        const Expression** args = new const Expression*[argc];
+        args[0] = arg0;
+        if (arg1)
+            args[1] = arg1;
+        if (arg2)
+            args[2] = arg2;
+
+        return new CallExpression(name, int(strlen(name)), args, argc, false);
+    }
+
+    // d sin(u) = cos(u) du
+    int DifferentiateSin(GradientBuilder& grad) const
+    {
+        return grad.Propagate(m_args[0], new BinaryExpression('*', grad.Adjoint(),
+            NewCall("cos", grad.Value(m_args[0]))));
+    }
+
+    // d cos(u) = -sin(u) du
+    int DifferentiateCos(GradientBuilder& grad) const
+    {
+        return grad.Propagate(m_args[0], NewCall("chs", new BinaryExpression('*', grad.Adjoint(),
+            NewCall("sin", grad.Value(m_args[0])))));
+    }
+
+    // d abs(u) = sgn(u) du, at 0 the derivative from the right
+    int DifferentiateAbs(GradientBuilder& grad) const
+    {
+        Expression* negative = new BinaryExpression('<', grad.Value(m_args[0]), new NumberExpression(0.0));
+        return grad.Propagate(m_args[0], NewCall("if", negative, NewCall("chs", grad.Adjoint()), grad.Adjoint()));
+    }
+
+    // d chs(u) = -du
+    int DifferentiateChs(GradientBuilder& grad) const
+    {
+        return grad.Propagate(m_args[0], NewCall("chs", grad.Adjoint()));
+    }
+
+    // d tan(u) = (1 + tan(u)^2) du
+    int DifferentiateTan(GradientBuilder& grad) const
+    {
+        Expression* square = new BinaryExpression('*', grad.Value(this), grad.Value(this));
+        return grad.Propagate(m_args[0], new BinaryExpression('*', grad.Adjoint(),
+            new BinaryExpression('+', new NumberExpression(1.0), square)));
+    }
+
+    // d cot(u) = -(1 + cot(u)^2) du
+    int DifferentiateCot(GradientBuilder& grad) const
+    {
+        Expression* square = new BinaryExpression('*', grad.Value(this), grad.Value(this));
+        return grad.Propagate(m_args[0], NewCall("chs", new BinaryExpression('*', grad.Adjoint(),
+            new BinaryExpression('+', new NumberExpression(1.0), square))));
+    }
+
+    // d sqrt(u) = du / (2 sqrt(u))
+    int DifferentiateSqrt(GradientBuilder& grad) const
+    {
+        return grad.Propagate(m_args[0], new BinaryExpression('/', grad.Adjoint(),
+            new BinaryExpression('*', new NumberExpression(2.0), grad.Value(this))));
+    }
+
+    // The derivatives of min, max, clamp and if are the one of the argument
+    // the function chooses, with the comparisons of the folders.
+
+    int DifferentiateMin(GradientBuilder& grad) const
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            if (!grad.IsVarying(m_args[i]))
+                continue;
+
+            Expression* second = new BinaryExpression('>', grad.Value(m_args[1]), grad.Value(m_args[0]));
+            Expression* zero = new NumberExpression(0.0);
+            EXIT_ON_ERR(grad.PropagateChoice(m_args[i], i == 0 ?
+                NewCall("if", second, grad.Adjoint(), zero) :
+                NewCall("if", second, zero, grad.Adjoint())));
+        }
+
+        return 1;
+    }
+
+    int DifferentiateMax(GradientBuilder& grad) const
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            if (!grad.IsVarying(m_args[i]))
+                continue;
+
+            Expression* first = new BinaryExpression('>', grad.Value(m_args[0]), grad.Value(m_args[1]));
+            Expression* zero = new NumberExpression(0.0);
+            EXIT_ON_ERR(grad.PropagateChoice(m_args[i], i == 0 ?
+                NewCall("if", first, grad.Adjoint(), zero) :
+                NewCall("if", first, zero, grad.Adjoint())));
+        }
+
+        return 1;
+    }
+
+    // min(max(x, lo), hi)
+    int DifferentiateClamp(GradientBuilder& grad) const
+    {
+        const Expression* x = m_args[0];
+        const Expression* lo = m_args[1];
+        const Expression* hi = m_args[2];
+
+        // x if x > lo and hi > x
+        if (grad.IsVarying(x))
+        {
+            Expression* chosen = new BinaryExpression('&',
+                new BinaryExpression('>', grad.Value(x), grad.Value(lo)),
+                new BinaryExpression('>', grad.Value(hi), grad.Value(x)));
+            EXIT_ON_ERR(grad.PropagateChoice(x, NewCall("if", chosen, grad.Adjoint(), new NumberExpression(0.0))));
+        }
+
+        // lo if x <= lo and hi > lo
+        if (grad.IsVarying(lo))
+        {
+            Expression* above = new BinaryExpression('>', grad.Value(x), grad.Value(lo));
+            Expression* below = new BinaryExpression('>', grad.Value(hi), grad.Value(lo));
+            EXIT_ON_ERR(grad.PropagateChoice(lo, NewCall("if", above, new NumberExpression(0.0),
+                NewCall("if", below, grad.Adjoint(), new NumberExpression(0.0)))));
+        }
+
+        // hi if hi <= max(x, lo)
+        if (grad.IsVarying(hi))
+        {
+            Expression* below = new BinaryExpression('>', grad.Value(hi),
+                NewCall("max", grad.Value(x), grad.Value(lo)));
+            EXIT_ON_ERR(grad.PropagateChoice(hi, NewCall("if", below, new NumberExpression(0.0), grad.Adjoint())));
+        }
+
+        return 1;
+    }
+
+    int DifferentiateIf(GradientBuilder& grad) const
+    {
+        if (grad.IsVarying(m_args[1]))
+            EXIT_ON_ERR(grad.PropagateChoice(m_args[1], NewCall("if", grad.Value(m_args[0]),
+                grad.Adjoint(), new NumberExpression(0.0))));
+
+        if (grad.IsVarying(m_args[2]))
+            EXIT_ON_ERR(grad.PropagateChoice(m_args[2], NewCall("if", grad.Value(m_args[0]),
+                new NumberExpression(0.0), grad.Adjoint())));
+
+        return 1;
+    }
+
+    // d exp(u) = exp(u) du
+    int DifferentiateExp(GradientBuilder& grad) const
+    {
+        return grad.Propagate(m_args[0], new BinaryExpression('*', grad.Adjoint(), grad.Value(this)));
+    }
+
+    // d log(u) = du / u
+    int DifferentiateLog(GradientBuilder& grad) const
+    {
+        return grad.Propagate(m_args[0], new BinaryExpression('/', grad.Adjoint(), grad.Value(m_args[0])));
+    }
+
+    // d log10(u) = du / (u ln(10))
+    int DifferentiateLog10(GradientBuilder& grad) const
+    {
+        return grad.Propagate(m_args[0], new BinaryExpression('/', grad.Adjoint(),
+            new BinaryExpression('*', grad.Value(m_args[0]), new NumberExpression(M_LN10))));
+    }
+
+    // d pow(a, b) = b pow(a, b - 1) da + pow(a, b) log(a) db
+    int DifferentiatePow(GradientBuilder& grad) const
+    {
+        const Expression* a = m_args[0];
+        const Expression* b = m_args[1];
+
+        // pow(a, 0) is 1 for every a, also where a^-1 is infinite or NaN.
+        int32 exponent;
+        if (GetIntegerExponent(grad.GetContext(), exponent) && exponent == 0)
+            return 1;
+
+        // A constant b - 1 is lowered to multiplications like b is.
+        if (grad.IsVarying(a))
+        {
+            Expression* power = NewCall("pow", grad.Value(a),
+                new BinaryExpression('-', grad.Value(b), new NumberExpression(1.0)));
+            EXIT_ON_ERR(grad.Propagate(a, new BinaryExpression('*',
+                new BinaryExpression('*', grad.Adjoint(), grad.Value(b)), power)));
+        }
+
+        if (grad.IsVarying(b))
+            EXIT_ON_ERR(grad.Propagate(b, new BinaryExpression('*',
+                new BinaryExpression('*', grad.Adjoint(), grad.Value(this)), NewCall("log", grad.Value(a)))));
+
+        return 1;
+    }
+
+    // d atan2(y, x) = (x dy - y dx) / (x^2 + y^2)
+    int DifferentiateAtan2(GradientBuilder& grad) const
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            if (!grad.IsVarying(m_args[i]))
+                continue;
+
+            Expression* norm = new BinaryExpression('+',
+                new BinaryExpression('*', grad.Value(m_args[1]), grad.Value(m_args[1])),
+                new BinaryExpression('*', grad.Value(m_args[0]), grad.Value(m_args[0])));
+            Expression* factor = i == 0 ? grad.Value(m_args[1]) : NewCall("chs", grad.Value(m_args[0]));
+            EXIT_ON_ERR(grad.Propagate(m_args[i], new BinaryExpression('/',
+                new BinaryExpression('*', grad.Adjoint(), factor), norm)));
+        }
+
+        return 1;
+    }
+
+    // Resolves CALLCONV_DEFAULT and rejects conventions the target doesn't have.
+    static int GetCallingConvention(const Identifier& ident)
+    {
+        int conv = ident.func_callconv;
+
+#ifdef _EXPR_TARGET_X64
+        if (conv == CALLCONV_DEFAULT)
+            conv = CALLCONV_SYSV64;
+
+#ifdef _WIN64
+        // The code passes the arguments the System V way. Windows functions take them in
+        // rcx, rdx, r8, r9 and xmm0-3 below 32 bytes of shadow space and keep rsi and rdi.
+        return ERR_CALLCONV_UNSUPPORTED;
+#else
+        if (conv != CALLCONV_SYSV64)
+            return ERR_CALLCONV_UNSUPPORTED;
+#endif
+#else
+        if (conv == CALLCONV_DEFAULT)
+            conv = CALLCONV_STDCALL;
+
+        if (conv != CALLCONV_STDCALL && conv != CALLCONV_CDECL)
+            return ERR_CALLCONV_UNSUPPORTED;
+#endif
+
+        return conv;
+    }
+
+#ifdef _EXPR_TARGET_X64
+    // The arguments are evaluated left to right.
+    int GetArgIndex(int n) const
+    {
+        return n;
+    }
+
+    // Arguments that would go to the stack are not supported.
+    int CheckArgRegisters(const Identifier& ident) const
+    {
+        int fpArgs = 0;
+        int intArgs = 0;
+        for (int i = 0; i < m_argc; ++i)
+        {
+            if (GetArgType(ident.func_argtypes, i) == IDENTIFIER_INT32)
+                ++intArgs;
+            else
+                ++fpArgs;
+        }
+
+        if (fpArgs > 8 || intArgs > 6)
+            return ERR_CALLCONV_UNSUPPORTED;
+
+        return 1;
+    }
+
+    // Pushes 0 into an 8 byte slot on the native stack for an unused argument.
+    static int EmitZeroArg(ByteBuffer& buf, uint8 type)
+    {
+        if (!buf.append_8(0x6A) ||                  // push 0
+            !buf.append_8(0x00))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return 8;
+    }
+
+#ifdef _ENABLE_EXPR_FOLDING
+    // Pushes the folded argument into an 8 byte slot on the native stack.
+    static int EmitImmArg(ByteBuffer& buf, double imm, uint8 type)
+    {
+        switch (type)
+        {
+            case IDENTIFIER_FLOAT64:
+            {
+                uint64 bits;
+                memcpy(&bits, &imm, sizeof(bits));
+                if (!buf.append_8(0x48) ||          // mov rax, imm64
+                    !buf.append_8(0xB8) ||
+                    !buf.append_64(bits))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            }
+            case IDENTIFIER_FLOAT32:
+            {
+                float val = float(imm);
+                uint32 bits;
+                memcpy(&bits, &val, sizeof(bits));
+                if (!buf.append_8(0xB8) ||          // mov eax, imm32
+                    !buf.append_32(bits))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            }
+            case IDENTIFIER_INT32:
+            {
+                int32 val = ToInt32Arg(imm);
+                if (!buf.append_8(0xB8) ||          // mov eax, imm32
+                    !buf.append_32(*(uint32*)&val))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            }
+            default:
+                return ERR_ARG_TYPE_ERR;
+        }
+
+        if (!buf.append_8(0x50))                    // push rax
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return 8;
+    }
+#endif
+
+    // Moves the evaluated argument from st0 into an 8 byte slot on the native stack.
+    // The slot of a 4 byte argument is zeroed first, the memo caches compare whole slots.
+    static int EmitStoreArg(ByteBuffer& buf, uint8 type)
+    {
+        // push st0 to the stack and pop the x87 stack
+        switch (type)
+        {
+            case IDENTIFIER_FLOAT64:
+                if (!buf.append_8(0x50) ||          // push rax
+                    !buf.append_8(0xDD) ||          // fstp qword ptr [rsp]
+                    !buf.append_8(0x1C) ||
+                    !buf.append_8(0x24))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            case IDENTIFIER_FLOAT32:
+                if (!buf.append_8(0x6A) ||          // push 0
+                    !buf.append_8(0x00) ||
+                    !buf.append_8(0xD9) ||          // fstp dword ptr [rsp]
+                    !buf.append_8(0x1C) ||
+                    !buf.append_8(0x24))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            case IDENTIFIER_INT32:
+                if (!buf.append_8(0x6A) ||          // push 0
+                    !buf.append_8(0x00) ||
+                    !buf.append_8(0xDB) ||          // fistp dword ptr [rsp]
+                    !buf.append_8(0x1C) ||
+                    !buf.append_8(0x24))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            default:
+                return ERR_ARG_TYPE_ERR;
+        }
+
+        return 8;
+    }
+
+    // Moves the evaluated integer argument from eax into an 8 byte slot on the native stack.
+    static int EmitStoreInt32Arg(ByteBuffer& buf, uint8 type)
+    {
+        if (!buf.append_8(0x50))                    // push rax
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        switch (type)
+        {
+            case IDENTIFIER_FLOAT64:
+                if (!buf.append_8(0xDB) ||          // fild dword ptr [rsp]
+                    !buf.append_8(0x04) ||
+                    !buf.append_8(0x24) ||
+                    !buf.append_8(0xDD) ||          // fstp qword ptr [rsp]
+                    !buf.append_8(0x1C) ||
+                    !buf.append_8(0x24))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            case IDENTIFIER_FLOAT32:
+                if (!buf.append_8(0xDB) ||          // fild dword ptr [rsp]
+                    !buf.append_8(0x04) ||
+                    !buf.append_8(0x24) ||
+                    !buf.append_8(0xD9) ||          // fstp dword ptr [rsp]
+                    !buf.append_8(0x1C) ||
+                    !buf.append_8(0x24))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            case IDENTIFIER_INT32:
+                break;
+            default:
+                return ERR_ARG_TYPE_ERR;
+        }
+
+        return 8;
+    }
+
+    // Moves the arguments staged on the native stack into registers, zeroes the ones of unused arguments.
+    int EmitLoadArgs(ByteBuffer& buf, const Identifier& ident) const
+    {
+        static const uint8 intRegs[][2] =
+        {
+            { 0x00, 0x7C },     // edi
+            { 0x00, 0x74 },     // esi
+            { 0x00, 0x54 },     // edx
+            { 0x00, 0x4C },     // ecx
+            { 0x44, 0x44 },     // r8d
+            { 0x44, 0x4C },     // r9d
+        };
+
+        int fpArgs = 0;
+        int intArgs = 0;
+        for (int i = 0; i < m_argc; ++i)
+        {
+            int disp = (m_argc - 1 - i) * 8;
+            uint8 type = GetArgType(ident.func_argtypes, i);
+            bool unused = (ident.func_argtypes[i] & IDENTIFIER_ARG_UNUSED) != 0;
+            switch (type)
+            {
+                case IDENTIFIER_FLOAT64:
+                case IDENTIFIER_FLOAT32:
+                    if (unused)
+                    {
+                        // xorps xmmN, xmmN
+                        if (!buf.append_8(0x0F) ||
+                            !buf.append_8(0x57) ||
+                            !buf.append_8(0xC0 | (fpArgs << 3) | fpArgs))
+                            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                    }
+                    // movsd/movss xmmN, [rsp+disp]
+                    else if (!buf.append_8(type == IDENTIFIER_FLOAT64 ? 0xF2 : 0xF3) ||
+                        !buf.append_8(0x0F) ||
+                        !buf.append_8(0x10) ||
+                        !buf.append_8(0x44 | (fpArgs << 3)) ||
+                        !buf.append_8(0x24) ||
+                        !buf.append_8(disp))
+                        return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                    ++fpArgs;
+                    break;
+                default:
+                    if (unused)
+                    {
+                        // xor r32, r32
+                        int reg = (intRegs[intArgs][1] >> 3) & 7;
+                        if ((intRegs[intArgs][0] && !buf.append_8(0x45)) ||
+                            !buf.append_8(0x31) ||
+                            !buf.append_8(0xC0 | (reg << 3) | reg))
+                            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                    }
+                    // mov r32, [rsp+disp]
+                    else if ((intRegs[intArgs][0] && !buf.append_8(intRegs[intArgs][0])) ||
+                        !buf.append_8(0x8B) ||
+                        !buf.append_8(intRegs[intArgs][1]) ||
+                        !buf.append_8(0x24) ||
+                        !buf.append_8(disp))
+                        return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                    ++intArgs;
+                    break;
+            }
+        }
+
+        if (!EmitAdjustStack(buf, m_argc * 8))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return 1;
+    }
+
+    int EmitCall(ByteBuffer& buf, const CompileContext& ctx, const Identifier& ident) const
+    {
+        // The stack is realigned to 16 bytes, rbx keeps the original one.
+        if (!buf.append_8(0x53) ||                  // push rbx
+            !buf.append_8(0x48) ||                  // mov rbx, rsp
+            !buf.append_8(0x89) ||
+            !buf.append_8(0xE3) ||
+            !buf.append_8(0x48) ||                  // and rsp, -16
+            !buf.append_8(0x83) ||
+            !buf.append_8(0xE4) ||
+            !buf.append_8(0xF0) ||
+            !buf.append_8(0x48) ||                  // mov rax, imm64
+            !buf.append_8(0xB8) ||
+            !buf.append_ptr(ident.ptr) ||
+            !buf.append_8(0xFF) ||                  // call rax
+            !buf.append_8(0xD0) ||
+            !buf.append_8(0x48) ||                  // mov rsp, rbx
+            !buf.append_8(0x89) ||
+            !buf.append_8(0xDC) ||
+            !buf.append_8(0x5B))                    // pop rbx
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        switch (ident.func_rtype)
+        {
+            case IDENTIFIER_INT32:
+                // The upper half of rax is undefined, it is cleared for the memo caches
+                // of the calls taking the value.
+                if (GetState(ctx).Info.Type == MARSHALLING_EAX)
+                {
+                    if (!buf.append_16(0xC089))     // mov eax, eax
+                        return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                    break;
+                }
+
+                if (!buf.append_8(0x50) ||          // push rax
+                    !buf.append_8(0xDB) ||          // fild dword ptr [rsp]
+                    !buf.append_8(0x04) ||
+                    !buf.append_8(0x24) ||
+                    !buf.append_8(0x58))            // pop rax
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            case IDENTIFIER_FLOAT32:
+                if (!buf.append_8(0x50) ||          // push rax
+                    !buf.append_8(0xF3) ||          // movss dword ptr [rsp], xmm0
+                    !buf.append_8(0x0F) ||
+                    !buf.append_8(0x11) ||
+                    !buf.append_8(0x04) ||
+                    !buf.append_8(0x24) ||
+                    !buf.append_8(0xD9) ||          // fld dword ptr [rsp]
+                    !buf.append_8(0x04) ||
+                    !buf.append_8(0x24) ||
+                    !buf.append_8(0x58))            // pop rax
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            case IDENTIFIER_FLOAT64:
+                if (!buf.append_8(0x50) ||          // push rax
+                    !buf.append_8(0xF2) ||          // movsd qword ptr [rsp], xmm0
+                    !buf.append_8(0x0F) ||
+                    !buf.append_8(0x11) ||
+                    !buf.append_8(0x04) ||
+                    !buf.append_8(0x24) ||
+                    !buf.append_8(0xDD) ||          // fld qword ptr [rsp]
+                    !buf.append_8(0x04) ||
+                    !buf.append_8(0x24) ||
+                    !buf.append_8(0x58))            // pop rax
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            default:
+                return ERR_RET_TYPE_ERR;
+        }
+
+        return buf.pos();
+    }
+#else
+    // The arguments are pushed right to left.
+    int GetArgIndex(int n) const
+    {
+        return m_argc - 1 - n;
+    }
+
+    // The arguments take at most MAX_ARG_WORDS stack words, the direct calls pass that many.
+    int CheckArgRegisters(const Identifier& ident) const
+    {
+        int words = 0;
+        for (int i = 0; i < m_argc; ++i)
+            words += GetArgType(ident.func_argtypes, i) == IDENTIFIER_FLOAT64 ? 2 : 1;
+
+        if (words > MAX_ARG_WORDS)
+            return ERR_CALLCONV_UNSUPPORTED;
+
+        return 1;
+    }
+
+    // Pushes 0 onto the native stack for an unused argument, returns the number of bytes pushed.
+    static int EmitZeroArg(ByteBuffer& buf, uint8 type)
+    {
+        int bytes = type == IDENTIFIER_FLOAT64 ? 8 : 4;
+        for (int pushed = 0; pushed < bytes; pushed += 4)
+            if (!buf.append_8(0x6A) ||              // push 0
+                !buf.append_8(0x00))
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return bytes;
+    }
+
+#ifdef _ENABLE_EXPR_FOLDING
+    // Pushes the folded argument onto the native stack, returns the number of bytes pushed.
+    static int EmitImmArg(ByteBuffer& buf, double imm, uint8 type)
+    {
+        // push imm value to the stack
+        switch (type)
+        {
+            case IDENTIFIER_FLOAT64:
+            {
+                uint64 bits;
+                memcpy(&bits, &imm, sizeof(bits));
+                if (!buf.append_8(0x68) ||          // push imm32
+                    !buf.append_32(uint32(bits >> 32)) ||
+                    !buf.append_8(0x68) ||          // push imm32
+                    !buf.append_32(uint32(bits)))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                return 8;
+            }
+            case IDENTIFIER_FLOAT32:
+            {
+                float val = float(imm);
+                uint32 bits;
+                memcpy(&bits, &val, sizeof(bits));
+                if (!buf.append_8(0x68) ||          // push imm32
+                    !buf.append_32(bits))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                return 4;
+            }
+            case IDENTIFIER_INT32:
+            {
+                int32 val = ToInt32Arg(imm);
+                if (!buf.append_8(0x68) ||          // push imm32
+                    !buf.append_32(*(uint32*)&val))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                return 4;
+            }
+            default:
+                return ERR_ARG_TYPE_ERR;
+        }
+    }
+#endif
+
+    // Moves the evaluated argument from st0 onto the native stack,
+    // returns the number of bytes pushed.
+    static int EmitStoreArg(ByteBuffer& buf, uint8 type)
+    {
+        // push st0 to the stack and pop the x87 stack
+        switch (type)
+        {
+            case IDENTIFIER_FLOAT64:
+                if (!buf.append_8(0x50) ||          // push eax
+                    !buf.append_8(0x50) ||          // push eax
+                    !buf.append_8(0xDD) ||          // fstp qword ptr [esp]
+                    !buf.append_8(0x1C) ||
+                    !buf.append_8(0x24))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                return 8;
+            case IDENTIFIER_FLOAT32:
+                if (!buf.append_8(0x50) ||          // push eax
+                    !buf.append_8(0xD9) ||          // fstp dword ptr [esp]
+                    !buf.append_8(0x1C) ||
+                    !buf.append_8(0x24))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                return 4;
+            case IDENTIFIER_INT32:
+                if (!buf.append_8(0x50) ||          // push eax
+                    !buf.append_8(0xDB) ||          // fistp dword ptr [esp]
+                    !buf.append_8(0x1C) ||
+                    !buf.append_8(0x24))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                return 4;
+            default:
+                return ERR_ARG_TYPE_ERR;
+        }
+    }
+
+    // Moves the evaluated integer argument from eax onto the native stack,
+    // returns the number of bytes pushed.
+    static int EmitStoreInt32Arg(ByteBuffer& buf, uint8 type)
+    {
+        if (!buf.append_8(0x50))                    // push eax
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        switch (type)
+        {
+            case IDENTIFIER_FLOAT64:
+                if (!buf.append_8(0xDB) ||          // fild dword ptr [esp]
+                    !buf.append_8(0x04) ||
+                    !buf.append_8(0x24) ||
+                    !buf.append_8(0x50) ||          // push eax
+                    !buf.append_8(0xDD) ||          // fstp qword ptr [esp]
+                    !buf.append_8(0x1C) ||
+                    !buf.append_8(0x24))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                return 8;
+            case IDENTIFIER_FLOAT32:
+                if (!buf.append_8(0xDB) ||          // fild dword ptr [esp]
+                    !buf.append_8(0x04) ||
+                    !buf.append_8(0x24) ||
+                    !buf.append_8(0xD9) ||          // fstp dword ptr [esp]
+                    !buf.append_8(0x1C) ||
+                    !buf.append_8(0x24))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                return 4;
+            case IDENTIFIER_INT32:
+                return 4;
+            default:
+                return ERR_ARG_TYPE_ERR;
+        }
+    }
+
+    int EmitCall(ByteBuffer& buf, const CompileContext& ctx, const Identifier& ident, int conv, int argBytes) const
+    {
+        if (!buf.append_8(0xB8) ||                  // mov eax, imm dword
+            !buf.append_ptr(ident.ptr) ||
+            !buf.append_8(0xFF) ||                  // call eax
+            !buf.append_8(0xD0))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        if (conv == CALLCONV_CDECL && !EmitAdjustStack(buf, argBytes))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        switch (ident.func_rtype)
+        {
+            case IDENTIFIER_INT32:
+                if (GetState(ctx).Info.Type == MARSHALLING_EAX)
+                    break;
+
+                if (!buf.append_8(0x50) ||          // push eax
+                    !buf.append_8(0xDB) ||          // fild dword ptr [esp]
+                    !buf.append_8(0x04) ||
+                    !buf.append_8(0x24) ||
+                    !buf.append_8(0x58))            // pop eax
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+                break;
+            case IDENTIFIER_FLOAT32:
+            case IDENTIFIER_FLOAT64:
+                // value already in st0
+                break;
+            default:
+                return ERR_RET_TYPE_ERR;
+        }
+
+        return buf.pos();
+    }
+#endif
+
+    // Larger constant exponents go through fyl2x.
+    static const int MAX_POW_CHAIN_EXPONENT = 1024;
+
+    // Magnitude from which fsin, fcos and fptan don't reduce their argument.
+    static const double TRIG_ARG_LIMIT;
+
+    // Word sized operations on the memo slot.
+#ifdef _EXPR_TARGET_X64
+    static const int MEMO_WORD_SIZE = 8;
+#else
+    static const int MEMO_WORD_SIZE = 4;
+#endif
+
+    // mov ecx, address of the memo slot
+    static bool EmitLoadMemoSlot(ByteBuffer& buf, CompileContext& ctx, int slot)
+    {
+        return EmitRexW(buf) &&
+            buf.append_8(0xB9) &&
+            ctx.AppendMemoAddress(buf, slot);
+    }
+
+    // Emits a jump to the miss of a memo lookup, the position is added to jumps.
+    static bool EmitMissJump(ByteBuffer& buf, JumpCondition cond, int* jumps, int& count)
+    {
+        int pos = EmitJump(buf, cond);
+        jumps[count++] = pos;
+        return pos != 0;
+    }
+
+    // Checks the arguments on the native stack against the memo slot.
+    // The slot is read between two reads of its sequence, which is odd while a store
+    // is under way, so the result is only taken along with the arguments it was stored with.
+    // On a hit the cached result is loaded, the arguments are dropped
+    // and the position of the jump past the call is returned, 0 if out of space.
+    // On a miss the call gets a copy of the arguments, EmitMemoStore stores the originals.
+    static int EmitMemoLookup(ByteBuffer& buf, CompileContext& ctx, int slot, int argBytes)
+    {
+        int missJumps[MAX_ARG_WORDS + 2];
+        int misses = 0;
+
+        // A slot that was never stored or is being stored misses.
+        if (!EmitLoadMemoSlot(buf, ctx, slot) ||
+            !buf.append_8(0x8B) ||              // mov edx, dword ptr [ecx+MEMO_SEQUENCE]
+            !EmitModRM(buf, REG_EDX, REG_ECX, MEMO_SEQUENCE) ||
+            !buf.append_8(0xF6) ||              // test dl, 1
+            !buf.append_8(0xC2) ||
+            !buf.append_8(0x01) ||
+            !EmitMissJump(buf, JUMP_NE, missJumps, misses) ||
+            !buf.append_8(0x85) ||              // test edx, edx
+            !buf.append_8(0xD2) ||
+            !EmitMissJump(buf, JUMP_E, missJumps, misses))
+            return 0;
+
+        for (int disp = 0; disp < argBytes; disp += MEMO_WORD_SIZE)
+        {
+            if (!EmitRexW(buf) ||               // mov eax, [esp+disp]
+                !buf.append_8(0x8B) ||
+                !EmitModRM(buf, REG_EAX, REG_ESP, disp) ||
+                !EmitRexW(buf) ||               // cmp eax, [ecx+MEMO_ARGS+disp]
+                !buf.append_8(0x3B) ||
+                !EmitModRM(buf, REG_EAX, REG_ECX, MEMO_ARGS + disp) ||
+                !EmitMissJump(buf, JUMP_NE, missJumps, misses))
+                return 0;
+        }
+
+        // A store that began since the sequence was read may have torn the result.
+        if (!buf.append_8(0xDB) ||              // fld tbyte ptr [ecx+MEMO_RESULT]
+            !EmitModRM(buf, 5, REG_ECX, MEMO_RESULT) ||
+            !buf.append_8(0x3B) ||              // cmp edx, dword ptr [ecx+MEMO_SEQUENCE]
+            !EmitModRM(buf, REG_EDX, REG_ECX, MEMO_SEQUENCE))
+            return 0;
+
+        int tornJump = EmitJump(buf, JUMP_NE);
+        if (!tornJump || !EmitAdjustStack(buf, argBytes))
+            return 0;
+
+        int hitJump = EmitJump(buf, JUMP_ALWAYS);
+        if (!hitJump)
+            return 0;
+
+        PatchJump(buf, tornJump);
+        if (!buf.append_16(0xD8DD))             // fstp st0
+            return 0;
+
+        for (int i = 0; i < misses; ++i)
+            PatchJump(buf, missJumps[i]);
+
+        if (!EmitAdjustStack(buf, -argBytes))
+            return 0;
+
+        for (int disp = 0; disp < argBytes; disp += MEMO_WORD_SIZE)
+        {
+            if (!EmitRexW(buf) ||               // mov eax, [esp+argBytes+disp]
+                !buf.append_8(0x8B) ||
+                !EmitModRM(buf, REG_EAX, REG_ESP, argBytes + disp) ||
+                !EmitRexW(buf) ||               // mov [esp+disp], eax
+                !buf.append_8(0x89) ||
+                !EmitModRM(buf, REG_EAX, REG_ESP, disp))
+                return 0;
+        }
+
+        return hitJump;
+    }
+
+    // Stores the arguments left on the native stack by EmitMemoLookup and the result in st0
+    // into the memo slot, then drops the arguments. A locked compare and exchange makes the
+    // sequence odd for the store, the slot is left alone while another thread stores into it.
+    static bool EmitMemoStore(ByteBuffer& buf, CompileContext& ctx, int slot, int argBytes)
+    {
+        if (!EmitLoadMemoSlot(buf, ctx, slot) ||
+            !buf.append_8(0x8B) ||              // mov eax, dword ptr [ecx+MEMO_SEQUENCE]
+            !EmitModRM(buf, REG_EAX, REG_ECX, MEMO_SEQUENCE) ||
+            !buf.append_8(0xA8) ||              // test al, 1
+            !buf.append_8(0x01))
+            return false;
+
+        int busyJump = EmitJump(buf, JUMP_NE);
+        if (!busyJump ||
+            !buf.append_8(0x8D) ||              // lea edx, [eax+1]
+            !buf.append_8(0x50) ||
+            !buf.append_8(0x01) ||
+            !buf.append_8(0xF0) ||              // lock cmpxchg dword ptr [ecx+MEMO_SEQUENCE], edx
+            !buf.append_8(0x0F) ||
+            !buf.append_8(0xB1) ||
+            !EmitModRM(buf, REG_EDX, REG_ECX, MEMO_SEQUENCE))
+            return false;
+
+        int lostJump = EmitJump(buf, JUMP_NE);
+        if (!lostJump)
+            return false;
+
+        for (int disp = 0; disp < argBytes; disp += MEMO_WORD_SIZE)
+        {
+            if (!EmitRexW(buf) ||               // mov eax, [esp+disp]
+                !buf.append_8(0x8B) ||
+                !EmitModRM(buf, REG_EAX, REG_ESP, disp) ||
+                !EmitRexW(buf) ||               // mov [ecx+MEMO_ARGS+disp], eax
+                !buf.append_8(0x89) ||
+                !EmitModRM(buf, REG_EAX, REG_ECX, MEMO_ARGS + disp))
+                return false;
+        }
+
+        if (!buf.append_8(0xD9) ||              // fld st0
+            !buf.append_8(0xC0) ||
+            !buf.append_8(0xDB) ||              // fstp tbyte ptr [ecx+MEMO_RESULT]
+            !EmitModRM(buf, 7, REG_ECX, MEMO_RESULT) ||
+            !buf.append_8(0xFF) ||              // inc edx
+            !buf.append_8(0xC2) ||
+            !buf.append_8(0x89) ||              // mov dword ptr [ecx+MEMO_SEQUENCE], edx
+            !EmitModRM(buf, REG_EDX, REG_ECX, MEMO_SEQUENCE))
+            return false;
+
+        PatchJump(buf, busyJump);
+        PatchJump(buf, lostJump);
+
+        return EmitAdjustStack(buf, argBytes);
+    }
+
+#ifdef _ENABLE_EXPR_FOLDING
+#ifdef _EXPR_TARGET_X64
+    // The integers in rdi, rsi, rdx, rcx, r8, r9 and the floating point values in xmm0-7,
+    // each kind in the order of the arguments. A float is the low half of its xmm register.
+    struct HostArgs
+    {
+        uint64 ints[6];
+        double fps[8];
+        int intCount;
+        int fpCount;
+    };
+
+    static void AddHostArg(HostArgs& args, uint8 type, double value)
+    {
+        if (type == IDENTIFIER_INT32)
+        {
+            args.ints[args.intCount++] = uint32(ToInt32Arg(value));
+            return;
+        }
+
+        uint64 bits = 0;
+        if (type == IDENTIFIER_FLOAT32)
+        {
+            float single = float(value);
+            memcpy(&bits, &single, sizeof(single));
+        }
+        else
+            memcpy(&bits, &value, sizeof(value));
+        memcpy(&args.fps[args.fpCount++], &bits, sizeof(bits));
+    }
+
+    // CheckArgRegisters keeps the arguments off the stack, the unused registers are passed as 0.
+    template <typename R>
+    static double CallHost(void* ptr, int conv, const HostArgs& a)
+    {
+        typedef R(*Host)(uint64, uint64, uint64, uint64, uint64, uint64,
+            double, double, double, double, double, double, double, double);
+        return double(((Host)ptr)(a.ints[0], a.ints[1], a.ints[2], a.ints[3], a.ints[4], a.ints[5],
+            a.fps[0], a.fps[1], a.fps[2], a.fps[3], a.fps[4], a.fps[5], a.fps[6], a.fps[7]));
+    }
+#else
+    // The image of the arguments on the stack, the first one at the lowest address.
+    struct HostArgs
+    {
+        uint32 words[MAX_ARG_WORDS];
+        int count;
+    };
+
+    static void AddHostArg(HostArgs& args, uint8 type, double value)
+    {
+        if (type == IDENTIFIER_INT32)
+            args.words[args.count++] = uint32(ToInt32Arg(value));
+        else if (type == IDENTIFIER_FLOAT32)
+        {
+            float single = float(value);
+            memcpy(&args.words[args.count++], &single, sizeof(single));
+        }
+        else
+        {
+            memcpy(&args.words[args.count], &value, sizeof(value));
+            args.count += 2;
+        }
+    }
+
+    // Passed by value the words are copied onto the stack where the arguments go,
+    // and stdcall functions pop as many bytes as the structure has.
+    template <int N>
+    struct ArgWords
+    {
+        uint32 words[N];
+    };
+
+    // Calls with the N words of arguments, or with fewer through HostCaller<R, N - 1>.
+    template <typename R, int N>
+    struct HostCaller
+    {
+        static double Call(void* ptr, int conv, const HostArgs& a)
+        {
+            if (a.count < N)
+                return HostCaller<R, N - 1>::Call(ptr, conv, a);
+
+            ArgWords<N> words;
+            memcpy(words.words, a.words, sizeof(words.words));
+            if (conv == CALLCONV_STDCALL)
+                return double(((R(__stdcall*)(ArgWords<N>))ptr)(words));
+
+            return double(((R(__cdecl*)(ArgWords<N>))ptr)(words));
+        }
+    };
+
+    template <typename R>
+    struct HostCaller<R, 0>
+    {
+        static double Call(void* ptr, int conv, const HostArgs& a)
+        {
+            if (conv == CALLCONV_STDCALL)
+                return double(((R(__stdcall*)())ptr)());
+
+            return double(((R(__cdecl*)())ptr)());
+        }
+    };
+
+    template <typename R>
+    static double CallHost(void* ptr, int conv, const HostArgs& a)
+    {
+        return HostCaller<R, MAX_ARG_WORDS>::Call(ptr, conv, a);
+    }
+#endif
+
+    // Calls the host function with the folded or evaluated values of the arguments,
+    // for the pure calls folded at compile time and for Evaluate.
+    // The values are converted to the declared types like the code converts them.
+    int CallHostDirect(const CompileContext& ctx, const Identifier& ident, int conv, double& result) const
+    {
+        EXIT_ON_ERR(CheckArgRegisters(ident));
+
+        HostArgs args;
+        memset(&args, 0, sizeof(args));
+        for (int i = 0; i < m_argc; ++i)
+        {
+            bool unused = (ident.func_argtypes[i] & IDENTIFIER_ARG_UNUSED) != 0;
+            AddHostArg(args, GetArgType(ident.func_argtypes, i), unused ? 0.0 : m_args[i]->GetMarshallingInfo(ctx).Imm);
+        }
+
+        switch (ident.func_rtype)
+        {
+            case IDENTIFIER_INT32:
+                result = CallHost<int32>(ident.ptr, conv, args);
+                return 1;
+            case IDENTIFIER_FLOAT32:
+                result = CallHost<float>(ident.ptr, conv, args);
+                return 1;
+            case IDENTIFIER_FLOAT64:
+                result = CallHost<double>(ident.ptr, conv, args);
+                return 1;
+            default:
+                return ERR_RET_TYPE_ERR;
+        }
+    }
+#endif
+
+    // Moves the values the enclosing nodes keep on the x87 stack onto the native stack.
+    int EmitSpillAll(ByteBuffer& buf, CompileContext& ctx) const
+    {
+        NodeState& state = GetState(ctx);
+        state.Spilled = ctx.GetFpuDepth();
+        for (int i = 0; i < state.Spilled; ++i)
+            if (!EmitSpill(buf))
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        state.BaseDepth = 0;
+        ctx.SetFpuDepth(0);
+
+        return 1;
+    }
+
+    // Loads the values moved out by EmitSpillAll back below the result.
+    int EmitReloadAll(ByteBuffer& buf, CompileContext& ctx) const
+    {
+        const NodeState& state = GetState(ctx);
+        for (int i = 0; i < state.Spilled; ++i)
+            if (!EmitReload(buf, state.Info.Type != MARSHALLING_EAX))
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        ctx.SetFpuDepth(state.BaseDepth + state.Spilled);
+
+        return 1;
+    }
+
+    // The arguments of a built-in function are left on the x87 stack for the handler,
+    // except for the constant exponent of pow which is compiled into the code.
+    int EmitBuiltInStep(ByteBuffer& buf, CompileContext& ctx, int step, const Expression** child) const
+    {
+        NodeState& state = GetState(ctx);
+        int argc = m_argc;
+        int32 exponent;
+        if (GetIntegerExponent(ctx, exponent))
+            argc = 1;
+
+        if (step == 0)
+        {
+            state.Spilled = 0;
+            state.BaseDepth = ctx.GetFpuDepth();
+
+            if (argc > 1 && state.BaseDepth + argc - 1 > MAX_FPU_DEPTH)
+                EXIT_ON_ERR(EmitSpillAll(buf, ctx));
+        }
+
+        if (step < argc)
+        {
+            ctx.SetFpuDepth(state.BaseDepth + step);
+            *child = m_args[step];
+            return EMIT_STEP_CHILD;
+        }
+
+        ctx.SetFpuDepth(state.BaseDepth);
+        EXIT_ON_ERR((this->*m_builtInFunct->handler)(buf, ctx));
+        EXIT_ON_ERR(EmitReloadAll(buf, ctx));
+
+        return EMIT_STEP_DONE;
+    }
+
+    // Whether the if evaluates only the argument the condition chooses (COMPILE_LAZY_CALLS).
+    bool IsLazyIf(const CompileContext& ctx) const
+    {
+        return ctx.HasFlag(COMPILE_LAZY_CALLS) && m_builtInFunct->folder == &CallExpression::FoldIf &&
+            (m_args[1]->GetMarshallingInfo(ctx).Expensive || m_args[2]->GetMarshallingInfo(ctx).Expensive);
+    }
+
+    // The condition is tested with a branch, NaN is true like in EmitIf.
+    int EmitLazyIfStep(ByteBuffer& buf, CompileContext& ctx, int step, const Expression** child) const
+    {
+        NodeState& state = GetState(ctx);
+        switch (step)
+        {
+            case 0:
+                ++ctx.GetStats().lazy_guards;
+                *child = m_args[0];
+                return EMIT_STEP_CHILD;
+
+            case 1:
+                if (!buf.append_16(0xEED9) ||       // fldz
+                    !buf.append_16(0xE9DF) ||       // fucomip st0, st1
+                    !buf.append_16(0xD8DD) ||       // fstp st0
+                    !buf.append_16(0x067A))         // jp past the je
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+                state.ElseJump = EmitJump(buf, JUMP_E);
+                if (!state.ElseJump)
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+                *child = m_args[1];
+                return EMIT_STEP_CHILD;
+
+            case 2:
+                state.DoneJump = EmitJump(buf, JUMP_ALWAYS);
+                if (!state.DoneJump)
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+                PatchJump(buf, state.ElseJump);
+                *child = m_args[2];
+                return EMIT_STEP_CHILD;
+        }
+
+        PatchJump(buf, state.DoneJump);
+        return EMIT_STEP_DONE;
+    }
+
+    // The arguments of the integer form of a built-in function are pushed onto the native stack.
+    int EmitInt32BuiltInStep(ByteBuffer& buf, CompileContext& ctx, int step, const Expression** child) const
+    {
+        NodeState& state = GetState(ctx);
+        if (step == 0)
+            state.ArgIndex = 0;
+        else
+        {
+            if (!buf.append_8(0x50))                // push eax
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+            ++state.ArgIndex;
+        }
+
+        for (; state.ArgIndex < m_argc; ++state.ArgIndex)
+        {
+            MarshallingInfo einfo = m_args[state.ArgIndex]->GetMarshallingInfo(ctx);
+            if (einfo.Type == MARSHALLING_IMM)
+            {
+                if (!buf.append_8(0x68) ||          // push imm32
+                    !buf.append_32(uint32(int32(einfo.Imm))))
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+                continue;
+            }
+
+            *child = m_args[state.ArgIndex];
+            return EMIT_STEP_CHILD;
+        }
+
+        EXIT_ON_ERR((this->*m_builtInFunct->int32Handler)(buf));
+
+        return EMIT_STEP_DONE;
+    }
+
+    // Calls the host function with the arguments staged on the native stack.
+    int EmitHostCall(ByteBuffer& buf, CompileContext& ctx) const
+    {
+        const NodeState& state = GetState(ctx);
+        int slot = 0;
+        int hitJump = 0;
+        if ((state.Ident.flags & IDENTIFIER_FLAG_PURE) && ctx.HasFlag(COMPILE_MEMOIZE_PURE_CALLS))
+        {
+            slot = ctx.AllocMemo(MEMO_ARGS + state.ArgBytes);
+            hitJump = EmitMemoLookup(buf, ctx, slot, state.ArgBytes);
+            if (!hitJump)
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+            ++ctx.GetStats().memoized_calls;
+        }
+
+        // The host function runs with the caller's precision.
+        if (!ctx.EmitLoadControlWord(buf, true))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+#ifdef _EXPR_TARGET_X64
+        EXIT_ON_ERR(EmitLoadArgs(buf, state.Ident));
+        EXIT_ON_ERR(EmitCall(buf, ctx, state.Ident));
+#else
+        EXIT_ON_ERR(EmitCall(buf, ctx, state.Ident, state.Conv, state.ArgBytes));
+#endif
+
+        if (!ctx.EmitLoadControlWord(buf, false))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        if (hitJump)
+        {
+            if (!EmitMemoStore(buf, ctx, slot, state.ArgBytes))
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+            PatchJump(buf, hitJump);
+        }
+
+        return buf.pos();
+    }
+
+    // Each argument is evaluated by a step and moved onto the native stack by the next one.
+    int EmitHostCallStep(ByteBuffer& buf, CompileContext& ctx, int step, const Expression** child) const
+    {
+        NodeState& state = GetState(ctx);
+        if (step == 0)
+        {
+            if (!ctx.GetIdentifierInfo(m_identifier, m_identifierLen, &state.Ident))
+                return !m_isBuiltInOverload ? ERR_UNKNOWN_IDENTIFIER : ERR_ARGC_DOESNT_MATCH;
+
+            if (state.Ident.Type != IDENTIFIER_FUNC)
+                return ERR_IDENTIFIER_MISUSE;
+
+            // check args
+            EXIT_ON_ERR(CheckArgs(state.Ident.func_argtypes));
+            EXIT_ON_ERR(CheckArgRegisters(state.Ident));
+
+            state.Conv = GetCallingConvention(state.Ident);
+            if (state.Conv < 0)
+                return state.Conv;
+
+            // The callee is free to use the whole x87 stack,
+            // so the values the enclosing nodes keep there are moved out.
+            EXIT_ON_ERR(EmitSpillAll(buf, ctx));
+
+            state.ArgIndex = 0;
+            state.ArgBytes = 0;
+        }
+        else
+        {
+            int i = GetArgIndex(state.ArgIndex);
+            uint8 type = GetArgType(state.Ident.func_argtypes, i);
+            bool int32 = m_args[i]->GetMarshallingInfo(ctx).Type == MARSHALLING_EAX;
+            int pushed;
+            if (state.Ident.func_argtypes[i] & IDENTIFIER_ARG_UNUSED)
+            {
+                // The argument was evaluated for its host calls only.
+                if (!int32 && !buf.append_16(0xD8DD))   // fstp st0
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+                pushed = EmitZeroArg(buf, type);
+            }
+            else
+                pushed = int32 ? EmitStoreInt32Arg(buf, type) : EmitStoreArg(buf, type);
+            if (pushed <= 0)
+                return pushed;
+
+            state.ArgBytes += pushed;
+            ++state.ArgIndex;
+        }
+
+        for (; state.ArgIndex < m_argc; ++state.ArgIndex)
+        {
+            int i = GetArgIndex(state.ArgIndex);
+            uint8 type = GetArgType(state.Ident.func_argtypes, i);
+
+            if (IsArgPruned(ctx, state.Ident, i))
+            {
+                int pushed = EmitZeroArg(buf, type);
+                if (pushed <= 0)
+                    return pushed;
+
+                state.ArgBytes += pushed;
+                continue;
+            }
+
+#ifdef _ENABLE_EXPR_FOLDING
+            MarshallingInfo einfo = m_args[i]->GetMarshallingInfo(ctx);
+            if (einfo.Type == MARSHALLING_IMM)
+            {
+                int pushed = EmitImmArg(buf, einfo.Imm, type);
+                if (pushed <= 0)
+                    return pushed;
+
+                state.ArgBytes += pushed;
+                continue;
+            }
+#endif
+
+            *child = m_args[i];
+            return EMIT_STEP_CHILD;
+        }
+
+        EXIT_ON_ERR(EmitHostCall(buf, ctx));
+        EXIT_ON_ERR(EmitReloadAll(buf, ctx));
+
+        return EMIT_STEP_DONE;
+    }
+
+public:
+    virtual int FoldNode(CompileContext& ctx) const
+    {
+        NodeState& state = GetState(ctx);
+        MarshallingInfo& info = state.Info;
+        bool imm = true;
+        bool int32 = ctx.HasFlag(COMPILE_INT32_ARITHMETIC);
+        state.TreeLength = 1;
+        for (int i = 0; i < m_argc; ++i)
+        {
+            if (m_args[i]->GetMarshallingInfo(ctx).Type != MARSHALLING_IMM)
+                imm = false;
+
+            if (!m_args[i]->GetMarshallingInfo(ctx).Int32)
+                int32 = false;
+
+            state.TreeLength += m_args[i]->GetExpressionTreeLength(ctx);
+        }
+
+        info.Type = MARSHALLING_ST0;
+        info.Int32 = false;
+        state.Chosen = -1;
+
+        if (m_builtInFunct)
+        {
+            int32 = int32 && m_builtInFunct->int32Handler;
+
+#ifdef _ENABLE_EXPR_FOLDING
+            if (imm)
+            {
+                info.Type = MARSHALLING_IMM;
+                info.Imm = (this->*m_builtInFunct->folder)(ctx);
+                if (int32)
+                    info.Imm = WrapInt32(int64(info.Imm));
+
+                info.Int32 = int32;
+                return 1;
+            }
+#endif
+
+            if (m_builtInFunct->chooser && ChooseArg(ctx, int32))
+            {
+                ++ctx.GetStats().range_simplified;
+                return 1;
+            }
+
+            info.Int32 = int32;
+            if (m_builtInFunct->ranger)
+                info.Range = (this->*m_builtInFunct->ranger)(ctx);
+
+#ifdef _ENABLE_EXPR_FOLDING
+            // Values the ranges decide, like pow(x, 0), don't need the arguments.
+            // The ranges don't tell the sign of a zero, so zeros are computed.
+            if (info.Range.IsPoint() && info.Range.Min != 0.0 && !info.Effects)
+            {
+                info.Type = MARSHALLING_IMM;
+                info.Imm = info.Range.Min;
+                ++ctx.GetStats().range_simplified;
+                return 1;
+            }
+#endif
+
+            if (int32)
+            {
+                info.Type = MARSHALLING_EAX;
+                ++ctx.GetStats().int32_nodes;
+            }
+            else if (ctx.HasFlag(COMPILE_HORNER))
+                FoldPolynomial(ctx);
+
+            return 1;
+        }
+
+        // Errors in the use of the identifier are reported by Emit.
+        Identifier ident;
+        if (!ctx.GetIdentifierInfo(m_identifier, m_identifierLen, &ident) ||
+            ident.Type != IDENTIFIER_FUNC ||
+            CheckArgs(ident.func_argtypes) <= 0)
+            return 1;
+
+        bool pure = (ident.flags & IDENTIFIER_FLAG_PURE) != 0;
+        if (!pure)
+            info.Effects = true;
+
+        if (ident.flags & IDENTIFIER_FLAG_EXPENSIVE)
+            info.Expensive = true;
+
+        // The unused arguments don't keep a pure call from being folded.
+        imm = true;
+        for (int i = 0; i < m_argc; ++i)
+        {
+            if (IsArgPruned(ctx, ident, i))
+            {
+                if (m_args[i]->GetMarshallingInfo(ctx).Type != MARSHALLING_IMM)
+                    ++ctx.GetStats().pruned_args;
+            }
+            else if (m_args[i]->GetMarshallingInfo(ctx).Type != MARSHALLING_IMM)
+                imm = false;
+        }
+
+        if (ident.func_rtype == IDENTIFIER_INT32)
+            info.Range = Interval::Int32();
+
+        EXIT_ON_ERR(ApplyDeclaredRange(ident, ident.func_rtype == IDENTIFIER_INT32, info.Range));
+
+        int32 = ctx.HasFlag(COMPILE_INT32_ARITHMETIC) && ident.func_rtype == IDENTIFIER_INT32;
+
+#ifdef _ENABLE_EXPR_FOLDING
+        int conv = GetCallingConvention(ident);
+        if (imm && pure && conv > 0 && CallHostDirect(ctx, ident, conv, info.Imm) > 0)
+        {
+            info.Type = MARSHALLING_IMM;
+            info.Int32 = int32;
+            ++ctx.GetStats().folded_calls;
+            return 1;
+        }
+#else
+        (void)imm;
+#endif
+
+        // The memo caches hold floating point results.
+        if (int32 && !(pure && ctx.HasFlag(COMPILE_MEMOIZE_PURE_CALLS)))
+        {
+            info.Type = MARSHALLING_EAX;
+            info.Int32 = true;
+            ++ctx.GetStats().int32_nodes;
+        }
+
+        return 1;
+    }
+
+#ifdef _ENABLE_EXPR_FOLDING
+    virtual int EvaluateNode(CompileContext& ctx) const
+    {
+        if (m_builtInFunct)
+        {
+            GetState(ctx).Info.Imm = (this->*m_builtInFunct->folder)(ctx);
+            return 1;
+        }
+
+        Identifier ident;
+        if (!ctx.GetIdentifierInfo(m_identifier, m_identifierLen, &ident))
+            return !m_isBuiltInOverload ? ERR_UNKNOWN_IDENTIFIER : ERR_ARGC_DOESNT_MATCH;
+
+        if (ident.Type != IDENTIFIER_FUNC)
+            return ERR_IDENTIFIER_MISUSE;
+
+        EXIT_ON_ERR(CheckArgs(ident.func_argtypes));
+
+        int conv = GetCallingConvention(ident);
+        if (conv < 0)
+            return conv;
+
+        return CallHostDirect(ctx, ident, conv, GetState(ctx).Info.Imm);
+    }
+#endif
+
+    // Polynomial of chs and of pow with a constant integer exponent.
+    void FoldPolynomial(CompileContext& ctx) const
+    {
+        Polynomial arg, poly;
+        int32 exponent;
+        if (!m_args[0]->GetPolynomial(ctx, arg))
+            return;
+
+        if (m_builtInFunct->folder == &CallExpression::FoldChs)
+            poly = Polynomial::Add(Polynomial::Constant(0.0, 0), arg, -1.0);
+        else if (!GetIntegerExponent(ctx, exponent) || exponent < 0 || !Polynomial::Pow(arg, exponent, poly))
+            return;
+
+        SetPolynomial(ctx, poly);
+    }
+
+    // Makes the argument the ranges choose the result, it's the only one evaluated.
+    // The others mustn't call host functions that aren't pure.
+    // The result stays a floating point value unless the call computes an integer,
+    // an integer argument is converted then.
+    bool ChooseArg(CompileContext& ctx, bool int32) const
+    {
+        int chosen = (this->*m_builtInFunct->chooser)(ctx);
+        if (chosen < 0)
+            return false;
+
+        for (int i = 0; i < m_argc; ++i)
+            if (i != chosen && m_args[i]->GetMarshallingInfo(ctx).Effects)
+                return false;
+
+        NodeState& state = GetState(ctx);
+        state.Chosen = chosen;
+
+        MarshallingInfo info = m_args[chosen]->GetMarshallingInfo(ctx);
+        state.Info.Type = info.Type == MARSHALLING_EAX && !int32 ? MARSHALLING_ST0 : info.Type;
+        state.Info.Imm = info.Imm;
+        state.Info.Int32 = int32;
+        state.Info.Range = info.Range;
+        state.Info.Expensive = info.Expensive;
+        state.TreeLength = m_args[chosen]->GetExpressionTreeLength(ctx);
+
+        return true;
+    }
+
+    virtual int EmitStep(ByteBuffer& buf, CompileContext& ctx, int step, const Expression** child) const
+    {
+        const NodeState& state = GetState(ctx);
+#ifdef _ENABLE_EXPR_FOLDING
+        // check if the call foldable
+        if (state.Info.Type == MARSHALLING_IMM)
+            return NumberExpression::EmitValue(buf, ctx, state.Info.Imm);
+#endif
+
+        if (state.Chosen >= 0)
+        {
+            if (step > 0)
+                return EMIT_STEP_DONE;
+
+            *child = m_args[state.Chosen];
+            return EMIT_STEP_CHILD;
+        }
+
+        if (UsesHorner(ctx))
+            return EmitHornerStep(buf, ctx, step, child);
+
+        // check built-in functions
+        if (m_builtInFunct)
+        {
+            if (state.Info.Type == MARSHALLING_EAX)
+                return EmitInt32BuiltInStep(buf, ctx, step, child);
+
+            if (IsLazyIf(ctx))
+                return EmitLazyIfStep(buf, ctx, step, child);
+
+            return EmitBuiltInStep(buf, ctx, step, child);
+        }
+
+        return EmitHostCallStep(buf, ctx, step, child);
+    }
+
+    virtual int DifferentiateNode(GradientBuilder& grad) const
+    {
+        if (!m_builtInFunct)
+            return ERR_NOT_DIFFERENTIABLE;
+
+        // Skipped while the adjoint is 0 like the argument the function chooses in the code.
+        int chosen = GetState(grad.GetContext()).Chosen;
+        if (chosen >= 0)
+            return grad.PropagateChoice(m_args[chosen], NULL);
+
+        if (!m_builtInFunct->differentiator)
+            return 1;
+
+        return (this->*m_builtInFunct->differentiator)(grad);
+    }
+
+protected:
+    // Host functions take the integer arguments from eax.
+    virtual bool TakesInt32Operands(const CompileContext& ctx) const
+    {
+        return !m_builtInFunct || GetState(ctx).Info.Type == MARSHALLING_EAX;
+    }
+#endif
+};
+
+const CallExpression::BuiltInFunct CallExpression::s_builtInFuncts[] =
+{
+    { "sin", 1, &CallExpression::EmitSin, &CallExpression::FoldSin, NULL, &CallExpression::DifferentiateSin, &CallExpression::RangeSinCos, NULL },
+    { "cos", 1, &CallExpression::EmitCos, &CallExpression::FoldCos, NULL, &CallExpression::DifferentiateCos, &CallExpression::RangeSinCos, NULL },
+    { "abs", 1, &CallExpression::EmitAbs, &CallExpression::FoldAbs, &CallExpression::EmitInt32Abs, &CallExpression::DifferentiateAbs, &CallExpression::RangeAbs, &CallExpression::ChooseAbs },
+    { "chs", 1, &CallExpression::EmitChs, &CallExpression::FoldChs, &CallExpression::EmitInt32Chs, &CallExpression::DifferentiateChs, &CallExpression::RangeChs, NULL },
+    { "tan", 1, &CallExpression::EmitTan, &CallExpression::FoldTan, NULL, &CallExpression::DifferentiateTan, NULL, NULL },
+    { "cot", 1, &CallExpression::EmitCot, &CallExpression::FoldCot, NULL, &CallExpression::DifferentiateCot, NULL, NULL },
+    { "sqrt", 1, &CallExpression::EmitSqrt, &CallExpression::FoldSqrt, NULL, &CallExpression::DifferentiateSqrt, &CallExpression::RangeSqrt, NULL },
+    { "pi", 0, &CallExpression::EmitPi, &CallExpression::FoldPi, NULL, NULL, NULL, NULL },
+    { "min", 2, &CallExpression::EmitMin, &CallExpression::FoldMin, &CallExpression::EmitInt32Min, &CallExpression::DifferentiateMin, &CallExpression::RangeMin, &CallExpression::ChooseMin },
+    { "max", 2, &CallExpression::EmitMax, &CallExpression::FoldMax, &CallExpression::EmitInt32Max, &CallExpression::DifferentiateMax, &CallExpression::RangeMax, &CallExpression::ChooseMax },
+    { "clamp", 3, &CallExpression::EmitClamp, &CallExpression::FoldClamp, &CallExpression::EmitInt32Clamp, &CallExpression::DifferentiateClamp, &CallExpression::RangeClamp, &CallExpression::ChooseClamp },
+    { "if", 3, &CallExpression::EmitIf, &CallExpression::FoldIf, &CallExpression::EmitInt32If, &CallExpression::DifferentiateIf, &CallExpression::RangeIf, &CallExpression::ChooseIf },
+    { "exp", 1, &CallExpression::EmitExp, &CallExpression::FoldExp, NULL, &CallExpression::DifferentiateExp, &CallExpression::RangeExp, NULL },
+    { "log", 1, &CallExpression::EmitLog, &CallExpression::FoldLog, NULL, &CallExpression::DifferentiateLog, &CallExpression::RangeLog, NULL },
+    { "log10", 1, &CallExpression::EmitLog10, &CallExpression::FoldLog10, NULL, &CallExpression::DifferentiateLog10, &CallExpression::RangeLog10, NULL },
+    { "pow", 2, &CallExpression::EmitPow, &CallExpression::FoldPow, NULL, &CallExpression::DifferentiatePow, &CallExpression::RangePow, NULL },
+    { "atan2", 2, &CallExpression::EmitAtan2, &CallExpression::FoldAtan2, NULL, &CallExpression::DifferentiateAtan2, &CallExpression::RangeAtan2, NULL },
+    { "floor", 1, &CallExpression::EmitFloor, &CallExpression::FoldFloor, NULL, NULL, &CallExpression::RangeFloor, NULL },
+    { "ceil", 1, &CallExpression::EmitCeil, &CallExpression::FoldCeil, NULL, NULL, &CallExpression::RangeCeil, NULL },
+    { NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+const double CallExpression::TRIG_ARG_LIMIT = 9223372036854775808.0;
 
 #endif
@@ -0,0 +1,127 @@
+#ifndef _CHARSCANNER_H
+#define _CHARSCANNER_H
+
+#include "util.h"
+
+#if defined(__AVX2__)
+# define _EXPR_SCAN_AVX2
+# include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define _EXPR_SCAN_SSE2
+# include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+# include <intrin.h>        // _BitScanForward
+#endif
+
+// Finds the end of runs of identifier characters and whitespace,
+// 16 (SSE2) or 32 (AVX2) bytes at a time.
+class CharScanner
+{
+public:
+    // Returns the first character at or after str that is not [a-zA-Z0-9_].
+    static const char* SkipIdentifier(const char* str, const char* end)
+    {
+#if defined(_EXPR_SCAN_AVX2)
+        for (; end - str >= 32; str += 32)
+        {
+            __m256i chars = _mm256_loadu_si256((const __m256i*)str);
+            __m256i lower = _mm256_or_si256(chars, _mm256_set1_epi8(0x20));
+            __m256i match = _mm256_or_si256(
+                _mm256_or_si256(InRange(lower, 'a', 'z'), InRange(chars, '0', '9')),
+                _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('_')));
+
+            uint32 mask = ~uint32(_mm256_movemask_epi8(match));
+            if (mask)
+                return str + FirstBit(mask);
+        }
+#elif defined(_EXPR_SCAN_SSE2)
+        for (; end - str >= 16; str += 16)
+        {
+            __m128i chars = _mm_loadu_si128((const __m128i*)str);
+            __m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+            __m128i match = _mm_or_si128(
+                _mm_or_si128(InRange(lower, 'a', 'z'), InRange(chars, '0', '9')),
+                _mm_cmpeq_epi8(chars, _mm_set1_epi8('_')));
+
+            uint32 mask = ~uint32(_mm_movemask_epi8(match)) & 0xFFFF;
+            if (mask)
+                return str + FirstBit(mask);
+        }
+#endif
+
+        while (str < end && (s_charClasses[uint8(*str)] & CHAR_IDENTIFIER))
+            ++str;
+
+        return str;
+    }
+
+    // Returns the first character at or after str that is not whitespace.
+    // Newlines end the run unless skipNewlines is set.
+    static const char* SkipWhitespace(const char* str, const char* end, bool skipNewlines)
+    {
+#if defined(_EXPR_SCAN_AVX2)
+        __m256i newline = _mm256_set1_epi8(skipNewlines ? '\n' : ' ');
+        for (; end - str >= 32; str += 32)
+        {
+            __m256i chars = _mm256_loadu_si256((const __m256i*)str);
+            __m256i match = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\t'))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\r')), _mm256_cmpeq_epi8(chars, newline)));
+
+            uint32 mask = ~uint32(_mm256_movemask_epi8(match));
+            if (mask)
+                return str + FirstBit(mask);
+        }
+#elif defined(_EXPR_SCAN_SSE2)
+        __m128i newline = _mm_set1_epi8(skipNewlines ? '\n' : ' ');
+        for (; end - str >= 16; str += 16)
+        {
+            __m128i chars = _mm_loadu_si128((const __m128i*)str);
+            __m128i match = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(chars, _mm_set1_epi8('\t'))),
+                _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(chars, newline)));
+
+            uint32 mask = ~uint32(_mm_movemask_epi8(match)) & 0xFFFF;
+            if (mask)
+                return str + FirstBit(mask);
+        }
+#endif
+
+        while (str < end && (s_charClasses[uint8(*str)] & CHAR_WHITESPACE) && (skipNewlines || *str != '\n'))
+            ++str;
+
+        return str;
+    }
+
+private:
+    static inline int FirstBit(uint32 mask)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return int(index);
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+
+    // The bytes are biased so that [lo, hi] maps onto the lowest signed values,
+    // SSE2 and AVX2 have no unsigned byte compares.
+#if defined(_EXPR_SCAN_AVX2)
+    static inline __m256i InRange(__m256i chars, char lo, char hi)
+    {
+        __m256i biased = _mm256_add_epi8(chars, _mm256_set1_epi8(char(0x80 - lo)));
+        return _mm256_cmpgt_epi8(_mm256_set1_epi8(char(0x80 + (hi - lo) + 1)), biased);
+    }
+#elif defined(_EXPR_SCAN_SSE2)
+    static inline __m128i InRange(__m128i chars, char lo, char hi)
+    {
+        __m128i biased = _mm_add_epi8(chars, _mm_set1_epi8(char(0x80 - lo)));
+        return _mm_cmplt_epi8(biased, _mm_set1_epi8(char(0x80 + (hi - lo) + 1)));
+    }
+#endif
+};
+
+#endif
@@ -0,0 +1,282 @@
+#ifndef _CODESYMBOL_H
+#define _CODESYMBOL_H
+
+#include <stdio.h>          // fopen, fprintf
+#include <string.h>         // memcpy, memset, strlen
+
+#include "util.h"
+#include "Expression.h"
+
+#ifdef __linux__
+# include <unistd.h>        // getpid
+#endif
+
+// GDB reads ELF objects, the one built here describes x86-64 code.
+#if defined(__linux__) && defined(_EXPR_TARGET_X64)
+# define _EXPR_GDB_JIT
+#endif
+
+#ifdef _EXPR_GDB_JIT
+# include <elf.h>
+# include <pthread.h>
+
+// GDB JIT interface. GDB stops in __jit_debug_register_code and reads
+// the object of relevant_entry from the descriptor, both are defined in exprcmpl.cpp.
+extern "C"
+{
+    enum jit_actions
+    {
+        JIT_NOACTION = 0,
+        JIT_REGISTER_FN,
+        JIT_UNREGISTER_FN
+    };
+
+    struct jit_code_entry
+    {
+        jit_code_entry* next_entry;
+        jit_code_entry* prev_entry;
+        const char* symfile_addr;
+        uint64 symfile_size;
+    };
+
+    struct jit_descriptor
+    {
+        uint32 version;
+        uint32 action_flag;
+        jit_code_entry* relevant_entry;
+        jit_code_entry* first_entry;
+    };
+
+    extern jit_descriptor __jit_debug_descriptor;
+    void __jit_debug_register_code();
+}
+#endif
+
+// Name of compiled code for profilers and debuggers. perf reads it from
+// /tmp/perf-<pid>.map, GDB from an ELF object registered with its JIT interface.
+class CodeSymbol
+{
+public:
+    CodeSymbol(const uint8* code, int size)
+        : m_code(code), m_size(size), m_name(NULL)
+#ifdef _EXPR_GDB_JIT
+        , m_image(NULL)
+#endif
+    {
+    }
+
+    ~CodeSymbol()
+    {
+#ifdef _EXPR_GDB_JIT
+        if (m_image)
+            UnregisterGdb();
+#endif
+
+        if (m_name)
+            delete[] m_name;
+    }
+
+    // Without a name the code is named expr_ and the FNV-1a hash of the printed
+    // expression in hex, so the code of a formula gets the same name in every run.
+    int Register(const Expression* expr, const char* name, uint32 flags)
+    {
+        char* text = NULL;
+        if (expr)
+        {
+            int len = expr->ToString(NULL, 0);
+            text = new char[len + 1];
+            expr->ToString(text, len + 1);
+        }
+
+        if (name)
+        {
+            int len = int(strlen(name));
+            m_name = new char[len + 1];
+            memcpy(m_name, name, len + 1);
+        }
+        else
+        {
+            m_name = new char[NAME_LENGTH + 1];
+            sprintf_s(m_name, NAME_LENGTH + 1, "expr_%016llx", (unsigned long long)Hash(text));
+        }
+
+        int res = ERR_SUCCESS;
+        if (flags & SYMBOLS_PERF_MAP)
+            res = WritePerfMap(text);
+        if (res > 0 && (flags & SYMBOLS_GDB_JIT))
+            res = RegisterGdb();
+
+        if (text)
+            delete[] text;
+
+        return res;
+    }
+
+    static uint64 Hash(const char* text)
+    {
+        uint64 hash = 0xCBF29CE484222325ull;
+        for (; *text; ++text)
+            hash = (hash ^ uint8(*text)) * 0x100000001B3ull;
+
+        return hash;
+    }
+
+private:
+    CodeSymbol(const CodeSymbol&);
+    CodeSymbol& operator=(const CodeSymbol&);
+
+    static const int NAME_LENGTH = 21;      // expr_ and 16 hex digits
+    static const int MAX_PERF_TEXT = 256;
+
+    // Appends "<address> <size> <name> <expression>" in one write, perf takes
+    // the rest of the line as the name. The file is never truncated, perf reads
+    // the last entry for an address.
+    int WritePerfMap(const char* text) const
+    {
+#ifdef __linux__
+        char path[32];
+        sprintf_s(path, sizeof(path), "/tmp/perf-%d.map", int(getpid()));
+
+        FILE* file = fopen(path, "a");
+        if (!file)
+            return ERR_SYMBOLS_UNAVAILABLE;
+
+        int written = fprintf(file, "%llx %x %s%s%.*s\n", (unsigned long long)(size_t)m_code, m_size, m_name,
+            text ? " " : "", MAX_PERF_TEXT, text ? text : "");
+        if (fclose(file) || written <= 0)
+            return ERR_SYMBOLS_UNAVAILABLE;
+
+        return ERR_SUCCESS;
+#else
+        return ERR_SYMBOLS_UNAVAILABLE;
+#endif
+    }
+
+#ifdef _EXPR_GDB_JIT
+    static pthread_mutex_t& GdbLock()
+    {
+        static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        return lock;
+    }
+
+    // Relocatable object with a NOBITS .text section at the address of the code and
+    // one function symbol at its start. It has no unwind information.
+    int RegisterGdb()
+    {
+        static const char sectionNames[] = "\0.text\0.symtab\0.strtab\0.shstrtab";
+        enum { SECTION_TEXT = 1, SECTION_SYMTAB, SECTION_STRTAB, SECTION_SHSTRTAB, SECTION_COUNT };
+
+        int nameLen = int(strlen(m_name)) + 1;
+        int symtabPos = int(sizeof(Elf64_Ehdr));
+        int strtabPos = symtabPos + 2 * int(sizeof(Elf64_Sym));
+        int shstrtabPos = strtabPos + 1 + nameLen;
+        int headersPos = (shstrtabPos + int(sizeof(sectionNames)) + 7) & ~7;
+        int size = headersPos + SECTION_COUNT * int(sizeof(Elf64_Shdr));
+
+        m_image = new uint8[size];
+        memset(m_image, 0, size);
+
+        Elf64_Ehdr* header = (Elf64_Ehdr*)m_image;
+        memcpy(header->e_ident, ELFMAG, SELFMAG);
+        header->e_ident[EI_CLASS] = ELFCLASS64;
+        header->e_ident[EI_DATA] = ELFDATA2LSB;
+        header->e_ident[EI_VERSION] = EV_CURRENT;
+        header->e_ident[EI_OSABI] = ELFOSABI_SYSV;
+        header->e_type = ET_REL;
+        header->e_machine = EM_X86_64;
+        header->e_version = EV_CURRENT;
+        header->e_shoff = headersPos;
+        header->e_ehsize = sizeof(Elf64_Ehdr);
+        header->e_shentsize = sizeof(Elf64_Shdr);
+        header->e_shnum = SECTION_COUNT;
+        header->e_shstrndx = SECTION_SHSTRTAB;
+
+        Elf64_Sym* symbol = (Elf64_Sym*)(m_image + symtabPos) + 1;
+        symbol->st_name = 1;
+        symbol->st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+        symbol->st_shndx = SECTION_TEXT;
+        symbol->st_size = m_size;
+
+        memcpy(m_image + strtabPos + 1, m_name, nameLen);
+        memcpy(m_image + shstrtabPos, sectionNames, sizeof(sectionNames));
+
+        Elf64_Shdr* sections = (Elf64_Shdr*)(m_image + headersPos);
+        sections[SECTION_TEXT].sh_name = 1;
+        sections[SECTION_TEXT].sh_type = SHT_NOBITS;
+        sections[SECTION_TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+        sections[SECTION_TEXT].sh_addr = (Elf64_Addr)m_code;
+        sections[SECTION_TEXT].sh_size = m_size;
+        sections[SECTION_TEXT].sh_addralign = 1;
+
+        sections[SECTION_SYMTAB].sh_name = 7;
+        sections[SECTION_SYMTAB].sh_type = SHT_SYMTAB;
+        sections[SECTION_SYMTAB].sh_offset = symtabPos;
+        sections[SECTION_SYMTAB].sh_size = 2 * sizeof(Elf64_Sym);
+        sections[SECTION_SYMTAB].sh_link = SECTION_STRTAB;
+        sections[SECTION_SYMTAB].sh_info = 1;       // first global symbol
+        sections[SECTION_SYMTAB].sh_addralign = 8;
+        sections[SECTION_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+
+        sections[SECTION_STRTAB].sh_name = 15;
+        sections[SECTION_STRTAB].sh_type = SHT_STRTAB;
+        sections[SECTION_STRTAB].sh_offset = strtabPos;
+        sections[SECTION_STRTAB].sh_size = 1 + nameLen;
+        sections[SECTION_STRTAB].sh_addralign = 1;
+
+        sections[SECTION_SHSTRTAB].sh_name = 23;
+        sections[SECTION_SHSTRTAB].sh_type = SHT_STRTAB;
+        sections[SECTION_SHSTRTAB].sh_offset = shstrtabPos;
+        sections[SECTION_SHSTRTAB].sh_size = sizeof(sectionNames);
+        sections[SECTION_SHSTRTAB].sh_addralign = 1;
+
+        memset(&m_entry, 0, sizeof(m_entry));
+        m_entry.symfile_addr = (const char*)m_image;
+        m_entry.symfile_size = size;
+
+        pthread_mutex_lock(&GdbLock());
+        m_entry.next_entry = __jit_debug_descriptor.first_entry;
+        if (m_entry.next_entry)
+            m_entry.next_entry->prev_entry = &m_entry;
+        __jit_debug_descriptor.first_entry = &m_entry;
+        __jit_debug_descriptor.relevant_entry = &m_entry;
+        __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+        __jit_debug_register_code();
+        pthread_mutex_unlock(&GdbLock());
+
+        return ERR_SUCCESS;
+    }
+
+    void UnregisterGdb()
+    {
+        pthread_mutex_lock(&GdbLock());
+        if (m_entry.prev_entry)
+            m_entry.prev_entry->next_entry = m_entry.next_entry;
+        else
+            __jit_debug_descriptor.first_entry = m_entry.next_entry;
+        if (m_entry.next_entry)
+            m_entry.next_entry->prev_entry = m_entry.prev_entry;
+        __jit_debug_descriptor.relevant_entry = &m_entry;
+        __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+        __jit_debug_register_code();
+        pthread_mutex_unlock(&GdbLock());
+
+        delete[] m_image;
+        m_image = NULL;
+    }
+#else
+    int RegisterGdb()
+    {
+        return ERR_SYMBOLS_UNAVAILABLE;
+    }
+#endif
+
+    const uint8* m_code;
+    int m_size;
+    char* m_name;
+#ifdef _EXPR_GDB_JIT
+    uint8* m_image;
+    jit_code_entry m_entry;
+#endif
+};
+
+#endif
@@ -0,0 +1,565 @@
+#ifndef _COMPILECONTEXT_H
+#define _COMPILECONTEXT_H
+
+#include <string.h>         // memset, memcmp, memcpy
+#include <time.h>           // clock
+
+#include "util.h"
+#include "exprcmpl.h"
+#include "ByteBuffer.h"
+#include "PodArray.h"
+#include "Polynomial.h"
+#include "CpuInfo.h"
+#include "NodeState.h"
+
+// State shared by the nodes of a single expression while it is being compiled,
+// and the state of each of them (NodeState).
+class CompileContext
+{
+    struct DataFixup
+    {
+        int pos;            // position of the address in the code
+        int offset;         // offset into the data area
+    };
+
+    struct DataConstant
+    {
+        int offset;         // offset into the data area
+        double value;
+    };
+
+public:
+    CompileContext(pIdentifierInfoCallback identifierInfoCallback, const CompileOptions* options)
+        : m_identifierInfoCallback(identifierInfoCallback),
+        m_flags(options ? options->flags : COMPILE_DEFAULT),
+        m_cpuFeatures(CpuInfo::GetFeatures() & ~(options ? options->disabled_cpu_features : 0)),
+        m_patchSites(options ? options->patch_sites : NULL),
+        m_maxPatchSites(options && options->patch_sites ? options->max_patch_sites : 0),
+        m_frozen(options ? options->frozen_variables : NULL),
+        m_frozenCount(options && options->frozen_variables ? options->frozen_count : 0),
+        m_gradient(options ? options->gradient_variables : NULL),
+        m_gradientCount(options && options->gradient_variables ? options->gradient_count : 0),
+        m_maxNodes(options ? options->max_nodes : 0),
+        m_nodes(0), m_timed(options && options->max_compile_ms > 0), m_deadline(0), m_ticks(0),
+        m_fpuDepth(0), m_frameSize(FRAME_CONTROL_WORDS), m_dataSize(0),
+        m_counters(options ? options->counters : NULL),
+        m_memoStorage(options ? (uint8*)options->memo_storage : NULL)
+    {
+        memset(&m_stats, 0, sizeof(m_stats));
+        m_stats.cpu_features = m_cpuFeatures;
+
+        // The derivatives are computed on the x87 stack, integer nodes would need conversions.
+        // They need the values of the nodes a polynomial in Horner form or a skipped operand
+        // doesn't compute.
+        if (m_gradientCount)
+            m_flags &= ~(COMPILE_INT32_ARITHMETIC | COMPILE_HORNER | COMPILE_LAZY_CALLS);
+
+        if (m_timed)
+            m_deadline = clock() + clock_t(double(options->max_compile_ms) * CLOCKS_PER_SEC / 1000);
+    }
+
+    // Queries the identifier. Fields the callback doesn't set are zero.
+    bool GetIdentifierInfo(const char* identifier, int identifierLen, Identifier* info) const
+    {
+        memset(info, 0, sizeof(Identifier));
+        return m_identifierInfoCallback(identifier, identifierLen, info) != 0;
+    }
+
+    // Looks the identifier up among the frozen variables.
+    bool GetFrozenValue(const char* identifier, int identifierLen, double* value) const
+    {
+        for (int i = 0; i < m_frozenCount; ++i)
+        {
+            if (m_frozen[i].identifier_len == identifierLen &&
+                !memcmp(m_frozen[i].identifier, identifier, identifierLen))
+            {
+                *value = m_frozen[i].value;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Index of the variable among the gradient variables, -1 if it isn't one.
+    int GetGradientIndex(const char* identifier, int identifierLen) const
+    {
+        for (int i = 0; i < m_gradientCount; ++i)
+        {
+            if (m_gradient[i].identifier_len == identifierLen &&
+                !memcmp(m_gradient[i].identifier, identifier, identifierLen))
+                return i;
+        }
+
+        return -1;
+    }
+
+    int GetGradientCount() const
+    {
+        return m_gradientCount;
+    }
+
+    const GradientVariable& GetGradientVariable(int index) const
+    {
+        return m_gradient[index];
+    }
+
+    bool HasFlag(uint32 flag) const
+    {
+        return (m_flags & flag) != 0;
+    }
+
+    // Whether the code may use the instructions of the feature (CpuFeatures enum).
+    bool HasCpuFeature(uint32 feature) const
+    {
+        return (m_cpuFeatures & feature) != 0;
+    }
+
+    // Relative error of a rounded operation of the code, bounds the ranges of the values.
+    double GetRoundingError() const
+    {
+        return HasFlag(COMPILE_FLOAT32) ? FLOAT32_ROUNDING_ERROR : ROUNDING_ERROR;
+    }
+
+    CompileStats& GetStats()
+    {
+        return m_stats;
+    }
+
+    // Counts a node against the node limit, checks the time limit.
+    int AddNode()
+    {
+        if (m_maxNodes > 0 && ++m_nodes > m_maxNodes)
+            return ERR_NODE_LIMIT_EXCEEDED;
+
+        return CheckTime();
+    }
+
+    // Checks the time limit, the clock is read every TIME_CHECK_INTERVAL calls.
+    int CheckTime()
+    {
+        if (!m_timed || (++m_ticks % TIME_CHECK_INTERVAL))
+            return 1;
+
+        return clock() > m_deadline ? ERR_TIME_LIMIT_EXCEEDED : 1;
+    }
+
+    // Keeps the polynomial of a node for the duration of the compilation, returns its index.
+    int AddPolynomial(const Polynomial& poly)
+    {
+        m_polynomials.append(poly);
+        return m_polynomials.size() - 1;
+    }
+
+    const Polynomial& GetPolynomial(int index) const
+    {
+        return m_polynomials[index];
+    }
+
+    // Sets the state of the node with the index (Expression::NumberNodes) to its defaults,
+    // before the node is folded or evaluated.
+    void InitNodeState(int index)
+    {
+        NodeState state;
+        memset(&state, 0, sizeof(state));
+        state.Info.Type = MARSHALLING_ST0;
+        state.Info.Range = Interval::Full();
+        state.TreeLength = 1;
+        state.PolynomialIndex = -1;
+        state.Chosen = -1;
+        state.ValueSlot = -1;
+
+        while (m_nodeStates.size() <= index)
+            m_nodeStates.append(state);
+
+        m_nodeStates[index] = state;
+    }
+
+    // State of the node with the index in this compilation.
+    NodeState& GetNodeState(int index)
+    {
+        return m_nodeStates[index];
+    }
+
+    const NodeState& GetNodeState(int index) const
+    {
+        return m_nodeStates[index];
+    }
+
+    // Number of the node states, the nodes numbered after the expression start here.
+    int GetNodeStateCount() const
+    {
+        return m_nodeStates.size();
+    }
+
+    // Records a variable load for RebindVariable.
+    void AddPatchSite(const char* identifier, int identifierLen, int opcodePos, int addressPos)
+    {
+        int index = m_stats.patch_sites++;
+        if (index >= m_maxPatchSites)
+            return;
+
+        VariablePatchSite& site = m_patchSites[index];
+        site.identifier = identifier;
+        site.identifier_len = identifierLen;
+        site.opcode_pos = opcodePos;
+        site.address_pos = addressPos;
+    }
+
+    // Number of values the enclosing nodes keep on the x87 stack
+    // while the current node is being emitted.
+    int GetFpuDepth() const
+    {
+        return m_fpuDepth;
+    }
+
+    void SetFpuDepth(int depth)
+    {
+        m_fpuDepth = depth;
+    }
+
+    // Reserves storage in the stack frame below ebp, for the values the code keeps while
+    // it runs. Storage is reserved before the code is emitted, the prologue sets the frame up.
+    // Returns the distance of the storage from ebp, it's addressed as [ebp-distance].
+    int AllocFrame(int size)
+    {
+        m_frameSize += (size + 3) & ~3;
+        return m_frameSize;
+    }
+
+    // Whether the code sets up a frame below ebp, in float32 mode or with storage in it.
+    bool HasFrame() const
+    {
+        return HasFlag(COMPILE_FLOAT32) || m_frameSize > FRAME_CONTROL_WORDS;
+    }
+
+    // Code before the expression.
+    // The frame holds the storage reserved by AllocFrame and in float32 mode the caller's
+    // control word at FRAME_SAVED_CW and the one with single precision at FRAME_SINGLE_CW.
+    bool EmitPrologue(ByteBuffer& buf)
+    {
+        if (!EmitCountEntry(buf))
+            return false;
+
+        if (!HasFrame())
+            return true;
+
+        if (!buf.append_8(0x55) ||              // push ebp
+#ifdef _EXPR_TARGET_X64
+            !buf.append_8(0x48) ||              // mov rbp, rsp
+#endif
+            !buf.append_8(0x89) ||              // mov ebp, esp
+            !buf.append_8(0xE5) ||
+            !EmitReserveFrame(buf, (m_frameSize + 15) & ~15))
+            return false;
+
+        if (!HasFlag(COMPILE_FLOAT32))
+            return true;
+
+        return buf.append_8(0xD9) &&            // fnstcw word ptr [ebp+FRAME_SAVED_CW]
+            buf.append_8(0x7D) &&
+            buf.append_8(FRAME_SAVED_CW) &&
+            buf.append_8(0x0F) &&               // movzx eax, word ptr [ebp+FRAME_SAVED_CW]
+            buf.append_8(0xB7) &&
+            buf.append_8(0x45) &&
+            buf.append_8(FRAME_SAVED_CW) &&
+            buf.append_8(0x80) &&               // and ah, 0FCh (precision control 00, 24 bits)
+            buf.append_8(0xE4) &&
+            buf.append_8(0xFC) &&
+            buf.append_8(0x66) &&               // mov word ptr [ebp+FRAME_SINGLE_CW], ax
+            buf.append_8(0x89) &&
+            buf.append_8(0x45) &&
+            buf.append_8(FRAME_SINGLE_CW) &&
+            EmitLoadControlWord(buf, false);
+    }
+
+    // Switches to the caller's control word around host calls and back, nothing outside float32 mode.
+    bool EmitLoadControlWord(ByteBuffer& buf, bool callers)
+    {
+        if (!HasFlag(COMPILE_FLOAT32))
+            return true;
+
+        return buf.append_8(0xD9) &&            // fldcw word ptr [ebp+disp]
+            buf.append_8(0x6D) &&
+            buf.append_8(callers ? FRAME_SAVED_CW : FRAME_SINGLE_CW);
+    }
+
+    // Returns the value in st0, as a double in xmm0 on x86-64 and in st0 on x86.
+    // In float32 mode the value is a float and the caller's control word is restored.
+    bool EmitEpilogue(ByteBuffer& buf)
+    {
+        if (HasFlag(COMPILE_COUNT_CYCLES) &&
+            (!buf.append_16(0x310F) ||          // rdtsc
+            !EmitLoadCounters(buf) ||
+            !EmitAddCycles(buf, true)))
+            return false;
+
+        if (HasFlag(COMPILE_FLOAT32))
+        {
+            if (!EmitLoadControlWord(buf, true) ||
+                !buf.append_8(0xD9) ||          // fstp dword ptr [ebp+FRAME_SAVED_CW]
+                !buf.append_8(0x5D) ||
+                !buf.append_8(FRAME_SAVED_CW))
+                return false;
+
+#ifdef _EXPR_TARGET_X64
+            if (!buf.append_8(0xF3) ||          // movss xmm0, dword ptr [rbp+FRAME_SAVED_CW]
+                !buf.append_8(0x0F) ||
+                !buf.append_8(0x10) ||
+                !buf.append_8(0x45) ||
+                !buf.append_8(FRAME_SAVED_CW))
+                return false;
+#else
+            if (!buf.append_8(0xD9) ||          // fld dword ptr [ebp+FRAME_SAVED_CW]
+                !buf.append_8(0x45) ||
+                !buf.append_8(FRAME_SAVED_CW))
+                return false;
+#endif
+
+            return EmitLeaveFrame(buf) &&
+                buf.append_8(0xC3);             // ret
+        }
+
+#ifdef _EXPR_TARGET_X64
+        // The result is returned in xmm0.
+        if (!buf.append_8(0x50) ||          // push rax
+            !buf.append_8(0xDD) ||          // fstp qword ptr [rsp]
+            !buf.append_8(0x1C) ||
+            !buf.append_8(0x24) ||
+            !buf.append_8(0xF2) ||          // movsd xmm0, qword ptr [rsp]
+            !buf.append_8(0x0F) ||
+            !buf.append_8(0x10) ||
+            !buf.append_8(0x04) ||
+            !buf.append_8(0x24) ||
+            !buf.append_8(0x58))            // pop rax
+            return false;
+#endif
+
+        if (HasFrame() && !EmitLeaveFrame(buf))
+            return false;
+
+        return buf.append_8(0xC3);          // ret
+    }
+
+    // Moves esp down by the size of the frame. Windows commits the stack a page at a time
+    // as its guard page is touched, so the pages of a larger frame are touched in order.
+    static bool EmitReserveFrame(ByteBuffer& buf, int size)
+    {
+        int pages = size / FRAME_PAGE_SIZE;
+        if (pages)
+        {
+            if (!buf.append_8(0xB9) ||          // mov ecx, pages
+                !buf.append_32(pages))
+                return false;
+
+            int loop = buf.pos();
+            if (!EmitSubStack(buf, FRAME_PAGE_SIZE) ||
+                !buf.append_8(0x83) ||          // or dword ptr [esp], 0
+                !buf.append_8(0x0C) ||
+                !buf.append_8(0x24) ||
+                !buf.append_8(0x00) ||
+                !buf.append_8(0xFF) ||          // dec ecx
+                !buf.append_8(0xC9) ||
+                !buf.append_8(0x75) ||          // jnz loop
+                !buf.append_8(uint8(loop - (buf.pos() + 1))))
+                return false;
+        }
+
+        return EmitSubStack(buf, size % FRAME_PAGE_SIZE);
+    }
+
+    // sub esp, size
+    static bool EmitSubStack(ByteBuffer& buf, int size)
+    {
+        if (!size)
+            return true;
+
+#ifdef _EXPR_TARGET_X64
+        if (!buf.append_8(0x48))                // REX.W
+            return false;
+#endif
+        if (size < 0x80)
+            return buf.append_8(0x83) && buf.append_8(0xEC) && buf.append_8(size);
+
+        return buf.append_8(0x81) && buf.append_8(0xEC) && buf.append_32(size);
+    }
+
+    // mov esp, ebp and pop ebp
+    static bool EmitLeaveFrame(ByteBuffer& buf)
+    {
+#ifdef _EXPR_TARGET_X64
+        if (!buf.append_8(0x48))
+            return false;
+#endif
+        return buf.append_8(0x89) &&
+            buf.append_8(0xEC) &&
+            buf.append_8(0x5D);
+    }
+
+    // Counts the run and subtracts the time stamp counter at the entry from the cycles,
+    // the epilogue adds the one at the return. The 64-bit counters are updated in halves
+    // with carries, so the code is the same on x86 and x86-64.
+    bool EmitCountEntry(ByteBuffer& buf)
+    {
+        if (!HasFlag(COMPILE_COUNT_CALLS | COMPILE_COUNT_CYCLES))
+            return true;
+
+        if (!EmitLoadCounters(buf) ||
+            !buf.append_8(0x83) ||              // add dword ptr [ecx], 1
+            !buf.append_8(0x01) ||
+            !buf.append_8(0x01) ||
+            !buf.append_8(0x83) ||              // adc dword ptr [ecx+4], 0
+            !buf.append_8(0x51) ||
+            !buf.append_8(0x04) ||
+            !buf.append_8(0x00))
+            return false;
+
+        return !HasFlag(COMPILE_COUNT_CYCLES) ||
+            (buf.append_16(0x310F) &&           // rdtsc
+            EmitAddCycles(buf, false));
+    }
+
+    // mov ecx, address of the application's ExecutionCounters
+    bool EmitLoadCounters(ByteBuffer& buf)
+    {
+#ifdef _EXPR_TARGET_X64
+        if (!buf.append_8(0x48))
+            return false;
+#endif
+        return buf.append_8(0xB9) &&
+            buf.append_ptr(m_counters);
+    }
+
+    // Adds edx:eax to the cycles at [ecx], or subtracts it.
+    static bool EmitAddCycles(ByteBuffer& buf, bool add)
+    {
+        return buf.append_8(add ? 0x01 : 0x29) &&  // add/sub dword ptr [ecx+8], eax
+            buf.append_8(0x41) &&
+            buf.append_8(0x08) &&
+            buf.append_8(add ? 0x11 : 0x19) &&  // adc/sbb dword ptr [ecx+12], edx
+            buf.append_8(0x51) &&
+            buf.append_8(0x0C);
+    }
+
+    // Reserves zeroed, 16 byte aligned storage in the data area that follows the code.
+    // Returns the offset of the storage in the data area.
+    int AllocData(int size)
+    {
+        int offset = m_dataSize;
+        m_dataSize += (size + 15) & ~15;
+        return offset;
+    }
+
+    // Reserves 16 byte aligned storage for a memo cache in CompileOptions::memo_storage.
+    // Returns the offset of the cache in the storage.
+    int AllocMemo(int size)
+    {
+        int offset = m_stats.memo_storage_size;
+        m_stats.memo_storage_size += (size + 15) & ~15;
+        return offset;
+    }
+
+    // Appends the absolute address of the memo cache at offset, NULL while the size is computed.
+    bool AppendMemoAddress(ByteBuffer& buf, int offset)
+    {
+        return buf.append_ptr(m_memoStorage ? m_memoStorage + offset : NULL);
+    }
+
+    // Reserves storage for the doubles in the data area, EmitDataArea fills it in.
+    // Returns the offset of the storage in the data area.
+    int AllocConstants(const double* values, int count)
+    {
+        int offset = AllocData(count * 8);
+        for (int i = 0; i < count; ++i)
+        {
+            DataConstant constant = { offset + i * 8, values[i] };
+            m_dataConstants.append(constant);
+        }
+
+        return offset;
+    }
+
+    // Appends the absolute address of the storage at offset,
+    // the address is filled in by EmitDataArea.
+    bool AppendDataAddress(ByteBuffer& buf, int offset)
+    {
+        DataFixup fixup = { buf.pos(), offset };
+        m_dataFixups.append(fixup);
+        return buf.append_ptr(NULL);
+    }
+
+    // Places the data area after the code and patches the addresses referring to it.
+    bool EmitDataArea(ByteBuffer& buf)
+    {
+        if (!m_dataSize)
+            return true;
+
+        while (buf.pos() & 15)
+            if (!buf.append_8(0xCC))    // int3
+                return false;
+
+        int start = buf.pos();
+        for (int i = 0; i < m_dataSize; i += 4)
+            if (!buf.append_32(0))
+                return false;
+
+        for (int i = 0; i < m_dataFixups.size(); ++i)
+            buf.patch_ptr(m_dataFixups[i].pos, buf.data() + start + m_dataFixups[i].offset);
+
+        for (int i = 0; i < m_dataConstants.size(); ++i)
+        {
+            uint64 bits;
+            memcpy(&bits, &m_dataConstants[i].value, sizeof(bits));
+            buf.patch_32(start + m_dataConstants[i].offset, uint32(bits));
+            buf.patch_32(start + m_dataConstants[i].offset + 4, uint32(bits >> 32));
+        }
+
+        return true;
+    }
+
+private:
+    static const int TIME_CHECK_INTERVAL = 256;
+
+    // A few units in the last place of a double and of a float.
+    static const double ROUNDING_ERROR;
+    static const double FLOAT32_ROUNDING_ERROR;
+
+    // Frame of the float32 mode, relative to ebp.
+    enum
+    {
+        FRAME_SAVED_CW  = 0xFC,     // -4
+        FRAME_SINGLE_CW = 0xFE,     // -2
+        FRAME_CONTROL_WORDS = 4,    // bytes of the frame the control words take
+        FRAME_PAGE_SIZE = 4096,     // frames of this size and more are probed
+    };
+
+    pIdentifierInfoCallback m_identifierInfoCallback;
+    uint32 m_flags;
+    uint32 m_cpuFeatures;
+    VariablePatchSite* m_patchSites;
+    int m_maxPatchSites;
+    const FrozenVariable* m_frozen;
+    int m_frozenCount;
+    const GradientVariable* m_gradient;
+    int m_gradientCount;
+    CompileStats m_stats;
+    int m_maxNodes;
+    int m_nodes;
+    bool m_timed;
+    clock_t m_deadline;
+    int m_ticks;
+    int m_fpuDepth;
+    int m_frameSize;            // bytes below ebp, the control words included
+    int m_dataSize;
+    ExecutionCounters* m_counters;  // outside the code, writes to the code's lines flush the pipeline
+    uint8* m_memoStorage;           // as well
+    PodArray<DataFixup> m_dataFixups;
+    PodArray<DataConstant> m_dataConstants;
+    PodArray<Polynomial> m_polynomials;
+    PodArray<NodeState> m_nodeStates;
+};
+
+const double CompileContext::ROUNDING_ERROR = 1.0 / (1ULL << 50);
+const double CompileContext::FLOAT32_ROUNDING_ERROR = 1.0 / (1 << 21);
+
+#endif
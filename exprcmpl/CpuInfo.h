@@ -0,0 +1,96 @@
+#ifndef _CPUINFO_H
+#define _CPUINFO_H
+
+#include "util.h"
+
+#ifdef _MSC_VER
+# include <intrin.h>        // __cpuidex, _xgetbv
+#else
+# include <cpuid.h>         // __cpuid_count
+#endif
+
+// Features of the processor the code runs on (CpuFeatures enum).
+class CpuInfo
+{
+public:
+    // The processor is probed once per process.
+    static uint32 GetFeatures()
+    {
+        static const uint32 features = Detect();
+        return features;
+    }
+
+private:
+    enum
+    {
+        CPUID1_ECX_SSE41    = 1 << 19,
+        CPUID1_ECX_FMA      = 1 << 12,
+        CPUID1_ECX_OSXSAVE  = 1 << 27,
+        CPUID1_ECX_AVX      = 1 << 28,
+        CPUID7_EBX_AVX2     = 1 << 5,
+        CPUID7_EBX_AVX512F  = 1 << 16,
+        XCR0_YMM            = 0x06,     // sse and avx state
+        XCR0_ZMM            = 0xE6,     // sse, avx, opmask and zmm state
+    };
+
+    // eax, ebx, ecx and edx of the leaf.
+    static void Cpuid(uint32 leaf, uint32 subleaf, uint32 regs[4])
+    {
+#ifdef _MSC_VER
+        __cpuidex((int*)regs, int(leaf), int(subleaf));
+#else
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    }
+
+    // XCR0, the register states the operating system saves. Requires OSXSAVE.
+    static uint64 GetXcr0()
+    {
+#ifdef _MSC_VER
+        return _xgetbv(0);
+#else
+        uint32 low, high;
+        __asm__ __volatile__(".byte 0x0F, 0x01, 0xD0"      // xgetbv
+            : "=a"(low), "=d"(high) : "c"(0));
+        return (uint64(high) << 32) | low;
+#endif
+    }
+
+    static uint32 Detect()
+    {
+        uint32 regs[4];
+        Cpuid(0, 0, regs);
+        uint32 maxLeaf = regs[0];
+        if (maxLeaf < 1)
+            return 0;
+
+        Cpuid(1, 0, regs);
+        uint32 ecx = regs[2];
+        uint32 features = 0;
+        if (ecx & CPUID1_ECX_SSE41)
+            features |= CPU_SSE41;
+
+        // The vex and evex forms fault unless the operating system saves their registers.
+        uint64 xcr0 = (ecx & CPUID1_ECX_OSXSAVE) ? GetXcr0() : 0;
+        if ((xcr0 & XCR0_YMM) == XCR0_YMM && (ecx & CPUID1_ECX_AVX))
+        {
+            features |= CPU_AVX;
+            if (ecx & CPUID1_ECX_FMA)
+                features |= CPU_FMA;
+        }
+
+        if (maxLeaf >= 7)
+        {
+            Cpuid(7, 0, regs);
+            if ((features & CPU_AVX) && (regs[1] & CPUID7_EBX_AVX2))
+                features |= CPU_AVX2;
+
+            if ((xcr0 & XCR0_ZMM) == XCR0_ZMM && (regs[1] & CPUID7_EBX_AVX512F))
+                features |= CPU_AVX512F;
+        }
+
+        return features;
+    }
+};
+
+#endif
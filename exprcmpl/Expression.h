@@ -1,40 +1,82 @@
 #ifndef _EXPRESSION_H
 #define _EXPRESSION_H
 
+#include <limits.h>         // INT_MAX
+
 #include "util.h"
 #include "exprcmpl.h"
+#include "CompileContext.h"
+#include "NodeState.h"
+#include "Interval.h"
+#include "PodArray.h"
+#include "TextBuffer.h"
 
 #ifdef _ENABLE_EXPR_EMIT
 # define EXIT_ON_ERR(...) { int tmp = __VA_ARGS__; if (tmp <= 0) return tmp; }
 #endif
 
-enum MarshallingType
+enum NativeRegister
 {
-    MARSHALLING_ST0 = 0,        // Floating point value ontop of the x87 stack.
-    MARSHALLING_IMM,            // Immediate double precision floating point value.
+    REG_EAX = 0,
+    REG_ECX = 1,
+    REG_EDX = 2,
+    REG_EBX = 3,
+    REG_ESP = 4,
+    REG_EBP = 5,
+    REG_ESI = 6,
+    REG_EDI = 7,
 };
 
-// Defines an additional way (with the default of MARSHALLING_ST0)
-// of marshalling of the return value of an expression.
-struct MarshallingInfo
+// Results of Expression::EmitStep besides the errors.
+enum EmitStepResult
 {
-    MarshallingType Type;
-    double Imm;                 // MARSHALLING_IMM
+    EMIT_STEP_DONE      = 1,        // the code of the node is complete
+    EMIT_STEP_CHILD     = 2,        // the child has to be emitted before the next step
 };
 
+// Second opcode byte of the near conditional jumps.
+enum JumpCondition
+{
+    JUMP_ALWAYS = 0,
+    JUMP_E      = 0x84,
+    JUMP_NE     = 0x85,
+    JUMP_BE     = 0x86,
+};
+
+class GradientBuilder;
+
 class Expression
 {
 protected:
     Expression()
-        : m_identifier(NULL), m_identifierLen(0),
+        : m_identifier(NULL), m_identifierLen(0), m_identifierOwned(false),
         m_op(0), m_value(0.0),
         m_args(NULL), m_argc(0),
-        m_lhs(NULL), m_rhs(NULL)
+        m_lhs(NULL), m_rhs(NULL),
+        m_index(-1)
     {
     }
 
     const char* m_identifier;
     int m_identifierLen;
+    bool m_identifierOwned;
+
+    // Sets the identifier to a copy of name, or to name itself
+    // if it outlives the expression.
+    void SetIdentifier(const char* name, int nameLen, bool copy)
+    {
+        if (copy)
+        {
+            char* ident = new char[nameLen+1];
+            memcpy(ident, name, nameLen);
+            ident[nameLen] = 0;
+            name = ident;
+        }
+
+        m_identifier = name;
+        m_identifierLen = nameLen;
+        m_identifierOwned = copy;
+    }
 
     char m_op;
 
@@ -46,38 +88,754 @@ protected:
     const Expression* m_lhs;
     const Expression* m_rhs;
 
-public:
-    virtual ~Expression()
+    // Index of the state of the node in a CompileContext, set by NumberNodes.
+    int m_index;
+
+    // Node being walked and the step to continue it with.
+    struct WalkFrame
     {
-        if (m_identifier)
-            delete[] m_identifier;
+        const Expression* node;
+        int step;
+    };
 
+private:
+    // Moves the children onto the stack, leaving the node without children.
+    void DetachChildren(PodArray<const Expression*>& pending)
+    {
         if (m_args)
         {
             for (int i = 0; i < m_argc; ++i)
-                delete m_args[i];
+                pending.append(m_args[i]);
 
             delete[] m_args;
+            m_args = NULL;
+            m_argc = 0;
         }
 
         if (m_lhs)
-            delete m_lhs;
+            pending.append(m_lhs);
 
         if (m_rhs)
-            delete m_rhs;
+            pending.append(m_rhs);
+
+        m_lhs = NULL;
+        m_rhs = NULL;
+    }
+
+public:
+    virtual ~Expression()
+    {
+        if (m_identifierOwned)
+            delete[] m_identifier;
+
+        // The tree is released through an explicit stack,
+        // by the time a node is deleted it has no children left.
+        PodArray<const Expression*> pending;
+        DetachChildren(pending);
+
+        while (pending.size())
+        {
+            Expression* node = const_cast<Expression*>(pending.pop());
+            node->DetachChildren(pending);
+            delete node;
+        }
+    }
+
+    int GetChildCount() const
+    {
+        if (m_args)
+            return m_argc;
+
+        return (m_lhs ? 1 : 0) + (m_rhs ? 1 : 0);
+    }
+
+    const Expression* GetChild(int index) const
+    {
+        if (m_args)
+            return m_args[index];
+
+        return index == 0 && m_lhs ? m_lhs : m_rhs;
+    }
+
+    // Numbers the nodes of the tree from first on, once the tree is built.
+    // Returns the number after the last one.
+    int NumberNodes(int first)
+    {
+        PodArray<const Expression*> pending;
+        pending.append(this);
+
+        while (pending.size())
+        {
+            Expression* node = const_cast<Expression*>(pending.pop());
+            node->m_index = first++;
+            for (int i = 0; i < node->GetChildCount(); ++i)
+                pending.append(node->GetChild(i));
+        }
+
+        return first;
     }
 
 public:
 #ifdef _ENABLE_EXPR_TOSTRING
-    virtual int ToString(char* str, int len) const = 0;
+    // Prints the expression followed by a NUL, with the parentheses the parser needs.
+    // Returns the number of characters stored before the NUL, 0 if out of space.
+    // With NULL str only the number of characters is computed.
+    int ToString(char* str, int len) const
+    {
+        if (str && len <= 0)
+            return 0;
+
+        // room for the NUL
+        TextBuffer text(str, str ? len - 1 : INT_MAX);
+
+        PodArray<WalkFrame> stack;
+        const Expression* node = this;
+        int step = 0;
+
+        while (true)
+        {
+            const Expression* child = NULL;
+            if (!node->ToStringStep(text, step, &child))
+                return 0;
+
+            if (child)
+            {
+                WalkFrame frame = { node, step + 1 };
+                stack.append(frame);
+                node = child;
+                step = 0;
+                continue;
+            }
+
+            if (!stack.size())
+                break;
+
+            WalkFrame frame = stack.pop();
+            node = frame.node;
+            step = frame.step;
+        }
+
+        if (str)
+            str[text.pos()] = 0;
+
+        return text.pos();
+    }
+
+    // Binding strength of the printed node, operands of weaker ones are parenthesized.
+    virtual int GetPrintPrecedence() const
+    {
+        return PRECEDENCE_ATOM;
+    }
+
+protected:
+    // Prints the part of the node for the given step.
+    // Sets child if the child is printed before the next step.
+    // Returns false if out of space.
+    virtual bool ToStringStep(TextBuffer& text, int step, const Expression** child) const = 0;
+
+    static const int PRECEDENCE_ATOM = 1000;
+
+public:
 #endif
 
 #ifdef _ENABLE_EXPR_EMIT
-    virtual int Emit(ByteBuffer& buf, pIdentifierInfoCallback identifierInfoCallback) const = 0;
+    // Computes the marshalling info of the children and then of the node.
+    int Fold(CompileContext& ctx) const
+    {
+        PodArray<WalkFrame> stack;
+        WalkFrame root = { this, 0 };
+        stack.append(root);
+
+        while (stack.size())
+        {
+            WalkFrame& top = stack.back();
+            if (top.step == 0)
+            {
+                EXIT_ON_ERR(ctx.AddNode());
+                ctx.InitNodeState(top.node->m_index);
+            }
+
+            if (top.step < top.node->GetChildCount())
+            {
+                WalkFrame frame = { top.node->GetChild(top.step++), 0 };
+                stack.append(frame);
+                continue;
+            }
+
+            // The nodes compute the ranges of the values they don't fold.
+            const Expression* node = top.node;
+            MarshallingInfo& info = node->GetState(ctx).Info;
+            for (int i = 0; i < node->GetChildCount(); ++i)
+            {
+                const MarshallingInfo& child = node->GetChild(i)->GetState(ctx).Info;
+                info.Effects = info.Effects || child.Effects;
+                info.Expensive = info.Expensive || child.Expensive;
+            }
+
+            EXIT_ON_ERR(node->FoldNode(ctx));
+            if (info.Type == MARSHALLING_IMM)
+            {
+                info.Range = GetImmRange(ctx, info.Imm);
+                info.Expensive = false;
+            }
+
+            stack.pop();
+        }
+
+        return 1;
+    }
+
+#ifdef _ENABLE_EXPR_FOLDING
+    // Computes the value of the expression with the current values of the variables
+    // and the folders of the nodes, in double precision, without compiling it.
+    // The values are kept in the marshalling info of the node states.
+    int Evaluate(CompileContext& ctx, double* result) const
+    {
+        PodArray<WalkFrame> stack;
+        WalkFrame root = { this, 0 };
+        stack.append(root);
+
+        while (stack.size())
+        {
+            WalkFrame& top = stack.back();
+            if (top.step == 0)
+                ctx.InitNodeState(top.node->m_index);
+
+            if (top.step < top.node->GetChildCount())
+            {
+                WalkFrame frame = { top.node->GetChild(top.step++), 0 };
+                stack.append(frame);
+                continue;
+            }
+
+            const Expression* node = top.node;
+            EXIT_ON_ERR(node->EvaluateNode(ctx));
+            MarshallingInfo& info = node->GetState(ctx).Info;
+            info.Type = MARSHALLING_IMM;
+            info.Int32 = false;
+
+            stack.pop();
+        }
+
+        *result = GetState(ctx).Info.Imm;
+        return 1;
+    }
+#endif
+
+    // Emits the code that pushes the value of the expression onto the fpu stack.
+    int Emit(ByteBuffer& buf, CompileContext& ctx) const
+    {
+        PodArray<WalkFrame> stack;
+        const Expression* node = this;
+        int step = 0;
+
+        while (true)
+        {
+            EXIT_ON_ERR(ctx.CheckTime());
+
+            const Expression* child = NULL;
+            int res = node->EmitStep(buf, ctx, step, &child);
+            if (res <= 0)
+                return res;
+
+            if (res == EMIT_STEP_CHILD)
+            {
+                WalkFrame frame = { node, step + 1 };
+                stack.append(frame);
+                node = child;
+                step = 0;
+                continue;
+            }
+
+            // Values the derivatives use are copied to the stack frame.
+            const NodeState& state = node->GetState(ctx);
+            if (state.ValueSlot >= 0 && !EmitCopyValue(buf, state.ValueSlot))
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+            if (!stack.size())
+                break;
+
+            WalkFrame frame = stack.pop();
+
+            // Integers are converted where a floating point operation takes them.
+            if (state.Info.Type == MARSHALLING_EAX && !frame.node->TakesInt32Operands(ctx) &&
+                !EmitInt32ToSt0(buf))
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+            node = frame.node;
+            step = frame.step;
+        }
+
+        if (GetState(ctx).Info.Type == MARSHALLING_EAX && !EmitInt32ToSt0(buf))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return buf.pos();
+    }
+
+    // Marshalling info of the node as of the last Fold in the context.
+    MarshallingInfo GetMarshallingInfo(const CompileContext& ctx) const
+    {
+        return GetState(ctx).Info;
+    }
+
+    // Size of the tree as of the last Fold in the context.
+    int GetExpressionTreeLength(const CompileContext& ctx) const
+    {
+        return GetState(ctx).TreeLength;
+    }
+
+    // Polynomial the node computes as of the last Fold, constants are ones of degree 0.
+    bool GetPolynomial(const CompileContext& ctx, Polynomial& poly) const
+    {
+        const NodeState& state = GetState(ctx);
+        if (state.Info.Type == MARSHALLING_IMM)
+        {
+            // fldz and fld1, the other constants go through the native stack
+            double imm = state.Info.Imm;
+            poly = Polynomial::Constant(imm, imm == 0.0 || imm == 1.0 ? 1 : 4);
+            return true;
+        }
+
+        if (state.PolynomialIndex < 0)
+            return false;
+
+        poly = ctx.GetPolynomial(state.PolynomialIndex);
+        return true;
+    }
+
+protected:
+    // State of the node in the compilation of the context.
+    NodeState& GetState(CompileContext& ctx) const
+    {
+        return ctx.GetNodeState(m_index);
+    }
+
+    const NodeState& GetState(const CompileContext& ctx) const
+    {
+        return ctx.GetNodeState(m_index);
+    }
+
+    // Computes the marshalling info of the node, the children are already folded.
+    virtual int FoldNode(CompileContext& ctx) const = 0;
+
+#ifdef _ENABLE_EXPR_FOLDING
+    // Sets the Imm of the marshalling info to the value of the node, the children are already evaluated.
+    virtual int EvaluateNode(CompileContext& ctx) const = 0;
+#endif
+
+    // Emits the part of the code of the node for the given step.
+    // Returns EMIT_STEP_CHILD with child set if the child has to be emitted before the next step.
+    virtual int EmitStep(ByteBuffer& buf, CompileContext& ctx, int step, const Expression** child) const = 0;
+
+    friend class GradientBuilder;
+
+    // Passes the adjoint of the node on to the children that depend on the
+    // variables of the gradient, see GradientBuilder.
+    virtual int DifferentiateNode(GradientBuilder& grad) const
+    {
+        return ERR_NOT_DIFFERENTIABLE;
+    }
+
+    // Index of the node among the variables of the gradient, -1 if it isn't one of them.
+    virtual int GetGradientIndex(const CompileContext& ctx) const
+    {
+        return -1;
+    }
+
+    // Whether the children computed in eax are left there for the node.
+    virtual bool TakesInt32Operands(const CompileContext& ctx) const
+    {
+        return GetState(ctx).Info.Type == MARSHALLING_EAX;
+    }
+
+    // Whether the polynomials can be combined, they are in the same variable or one is a constant.
+    static bool IsSameVariable(const Polynomial& one, const Polynomial& two)
+    {
+        if (!one.Variable || !two.Variable)
+            return true;
+
+        return one.Variable->m_identifierLen == two.Variable->m_identifierLen &&
+            !memcmp(one.Variable->m_identifier, two.Variable->m_identifier, one.Variable->m_identifierLen);
+    }
+
+    // Records the polynomial of the node unless a coefficient overflowed.
+    void SetPolynomial(CompileContext& ctx, const Polynomial& poly) const
+    {
+        for (int k = 0; k <= poly.Degree; ++k)
+            if (!(poly.Coeffs[k] > -HUGE_VAL && poly.Coeffs[k] < HUGE_VAL))
+                return;
+
+        GetState(ctx).PolynomialIndex = ctx.AddPolynomial(poly);
+    }
+
+    // Whether the node computes its polynomial in Horner form. The nodes below it aren't emitted.
+    bool UsesHorner(const CompileContext& ctx) const
+    {
+        int index = GetState(ctx).PolynomialIndex;
+        if (index < 0)
+            return false;
+
+        const Polynomial& poly = ctx.GetPolynomial(index);
+        return poly.Variable && poly.GetHornerCost() < poly.Cost;
+    }
 
-    virtual MarshallingInfo GetMarshallingInfo() const = 0;
+    // Loads the variable, then computes the polynomial with the variable kept in st1.
+    // The coefficients are in the data area.
+    int EmitHornerStep(ByteBuffer& buf, CompileContext& ctx, int step, const Expression** child) const
+    {
+        const Polynomial& poly = ctx.GetPolynomial(GetState(ctx).PolynomialIndex);
+        if (step == 0)
+        {
+            *child = poly.Variable;
+            return EMIT_STEP_CHILD;
+        }
+
+        // Constants are single precision in float32 mode.
+        double coeffs[Polynomial::MAX_DEGREE + 1];
+        bool constants = false;
+        for (int k = 0; k <= poly.Degree; ++k)
+        {
+            coeffs[k] = ctx.HasFlag(COMPILE_FLOAT32) ? double(float(poly.Coeffs[k])) : poly.Coeffs[k];
+            if (k < poly.Degree ? coeffs[k] != 0.0 : coeffs[k] != 1.0)
+                constants = true;
+        }
+
+        int n = poly.Degree;
+        bool monic = coeffs[n] == 1.0;
+        if (constants && !EmitLoadDataAddress(buf, ctx, ctx.AllocConstants(coeffs, n + 1)))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        if (ctx.HasCpuFeature(CPU_FMA) && !ctx.HasFlag(COMPILE_FLOAT32))
+        {
+            if (!EmitFmaHorner(buf, coeffs, n))
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+            ++ctx.GetStats().horner_polynomials;
+            return EMIT_STEP_DONE;
+        }
+
+        if (monic)
+        {
+            if (!buf.append_16(0xC0D9))         // fld st0
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+        }
+        else if (!buf.append_8(0xDD) ||         // fld qword ptr [ecx+8n]
+            !EmitModRM(buf, 0, REG_ECX, 8 * n))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        for (int k = n - 1; k >= 0; --k)
+        {
+            // The copy of the variable is the first product.
+            if (!(monic && k == n - 1) && !buf.append_16(0xC9D8))   // fmul st0, st1
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+            if (coeffs[k] != 0.0 &&
+                (!buf.append_8(0xDC) ||         // fadd qword ptr [ecx+8k]
+                !EmitModRM(buf, 0, REG_ECX, 8 * k)))
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+        }
+
+        if (!buf.append_16(0xD9DD))             // fstp st1
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        ++ctx.GetStats().horner_polynomials;
+        return EMIT_STEP_DONE;
+    }
+
+    // Horner scheme with fused multiply-adds, replaces the variable in st0 with the polynomial.
+    // The variable is a double, it moves to xmm1 exactly, the sum is kept in xmm0.
+    static bool EmitFmaHorner(ByteBuffer& buf, const double* coeffs, int n)
+    {
+        if (!EmitAdjustStack(buf, -8) ||
+            !buf.append_8(0xDD) ||              // fstp qword ptr [esp]
+            !buf.append_8(0x1C) ||
+            !buf.append_8(0x24) ||
+            !buf.append_8(0xC5) ||              // vmovsd xmm1, qword ptr [esp]
+            !buf.append_8(0xFB) ||
+            !buf.append_8(0x10) ||
+            !buf.append_8(0x0C) ||
+            !buf.append_8(0x24))
+            return false;
+
+        // The sum of a monic polynomial starts as the variable, its first step is an addition.
+        int k = n - 1;
+        if (coeffs[n] == 1.0)
+        {
+            if (coeffs[k] == 0.0)
+            {
+                if (!buf.append_8(0xC5) ||      // vmovapd xmm0, xmm1
+                    !buf.append_8(0xF9) ||
+                    !buf.append_8(0x28) ||
+                    !buf.append_8(0xC1))
+                    return false;
+            }
+            else if (!buf.append_8(0xC5) ||     // vaddsd xmm0, xmm1, qword ptr [ecx+8k]
+                !buf.append_8(0xF3) ||
+                !buf.append_8(0x58) ||
+                !EmitModRM(buf, 0, REG_ECX, 8 * k))
+                return false;
+
+            --k;
+        }
+        else if (!buf.append_8(0xC5) ||         // vmovsd xmm0, qword ptr [ecx+8n]
+            !buf.append_8(0xFB) ||
+            !buf.append_8(0x10) ||
+            !EmitModRM(buf, 0, REG_ECX, 8 * n))
+            return false;
+
+        for (; k >= 0; --k)
+        {
+            if (coeffs[k] == 0.0)
+            {
+                if (!buf.append_8(0xC5) ||      // vmulsd xmm0, xmm0, xmm1
+                    !buf.append_8(0xFB) ||
+                    !buf.append_8(0x59) ||
+                    !buf.append_8(0xC1))
+                    return false;
+            }
+            else if (!buf.append_8(0xC4) ||     // vfmadd213sd xmm0, xmm1, qword ptr [ecx+8k]
+                !buf.append_8(0xE2) ||
+                !buf.append_8(0xF1) ||
+                !buf.append_8(0xA9) ||
+                !EmitModRM(buf, 0, REG_ECX, 8 * k))
+                return false;
+        }
+
+        return buf.append_8(0xC5) &&            // vmovsd qword ptr [esp], xmm0
+            buf.append_8(0xFB) &&
+            buf.append_8(0x11) &&
+            buf.append_8(0x04) &&
+            buf.append_8(0x24) &&
+            buf.append_8(0xDD) &&               // fld qword ptr [esp]
+            buf.append_8(0x04) &&
+            buf.append_8(0x24) &&
+            EmitAdjustStack(buf, 8);
+    }
+
+    // Narrows the range to the one the identifier declares (IDENTIFIER_FLAG_RANGE),
+    // to the integers in it for an integer. Fails if the range is empty.
+    static int ApplyDeclaredRange(const Identifier& ident, bool integer, Interval& range)
+    {
+        if (!(ident.flags & IDENTIFIER_FLAG_RANGE))
+            return 1;
+
+        if (!(ident.range_min <= ident.range_max))
+            return ERR_INVALID_INPUT;
+
+        if (ident.range_min > range.Min)
+            range.Min = ident.range_min;
+        if (ident.range_max < range.Max)
+            range.Max = ident.range_max;
+
+        if (integer)
+            range = Interval::Make(ceil(range.Min), floor(range.Max), false);
+
+        // no integer in the range
+        if (range.Min > range.Max)
+            return ERR_INVALID_INPUT;
+
+        range.MayBeNaN = false;
+        return 1;
+    }
+
+    // Range of a constant as the code loads it, rounded to float32 in float32 mode.
+    static Interval GetImmRange(const CompileContext& ctx, double value)
+    {
+        Interval range = Interval::Point(value);
+        if (ctx.HasFlag(COMPILE_FLOAT32))
+            range = Interval::Hull(range, Interval::Point(float(value)));
+
+        return range;
+    }
+
+    // Range of an integer result, which wraps modulo 2^32.
+    static Interval WrapInt32Range(const Interval& range)
+    {
+        Interval int32 = Interval::Int32();
+        if (range.MayBeNaN || range.Min < int32.Min || range.Max > int32.Max)
+            return int32;
+
+        return range;
+    }
 
-    virtual int GetExpressionTreeLength() const = 0;
+    // Whether the value is an integer in the int32 range.
+    static bool IsInt32Value(double value)
+    {
+        return value >= -2147483648.0 && value <= 2147483647.0 && value == double(int32(value));
+    }
+
+    // Converts the value to an int32 argument like fistp does with the default rounding:
+    // to the nearest integer, ties to even, NaN and values out of the range to 0x80000000.
+    static int32 ToInt32Arg(double value)
+    {
+        if (!(value >= -2147483648.5 && value < 2147483647.5))
+            return int32(0x80000000U);
+
+        double rounded = floor(value);
+        double fraction = value - rounded;
+        if (fraction > 0.5 || (fraction == 0.5 && fmod(rounded, 2.0) != 0.0))
+            rounded += 1.0;
+
+        return int32(rounded);
+    }
+
+    // Reduces the value modulo 2^32 like the integer instructions do.
+    static int32 WrapInt32(int64 value)
+    {
+        return int32(uint32(uint64(value)));
+    }
+
+    // Moves the integer in eax onto the x87 stack.
+    static bool EmitInt32ToSt0(ByteBuffer& buf)
+    {
+        return buf.append_8(0x50) &&        // push eax
+            buf.append_8(0xDB) &&           // fild dword ptr [esp]
+            buf.append_8(0x04) &&
+            buf.append_8(0x24) &&
+            buf.append_8(0x58);             // pop eax
+    }
+
+    // Values kept on the x87 stack beyond which an operand is spilled to the native stack,
+    // leaving room for the temporaries of the nodes.
+    static const int MAX_FPU_DEPTH = 5;
+
+    // add esp, delta (sub esp, -delta for negative values)
+    static bool EmitAdjustStack(ByteBuffer& buf, int delta)
+    {
+        if (!delta)
+            return true;
+
+#ifdef _EXPR_TARGET_X64
+        if (!buf.append_8(0x48))            // REX.W
+            return false;
+#endif
+
+        int modrm = delta > 0 ? 0xC4 : 0xEC;
+        if (delta < 0)
+            delta = -delta;
+
+        if (delta < 0x80)
+            return buf.append_8(0x83) && buf.append_8(modrm) && buf.append_8(delta);
+
+        return buf.append_8(0x81) && buf.append_8(modrm) && buf.append_32(delta);
+    }
+
+    // REX.W prefix for the native word sized forms on x86-64, nothing on x86.
+    static bool EmitRexW(ByteBuffer& buf)
+    {
+#ifdef _EXPR_TARGET_X64
+        return buf.append_8(0x48);
+#else
+        return true;
+#endif
+    }
+
+    // ModRM (and SIB) bytes of a [base + disp] operand.
+    static bool EmitModRM(ByteBuffer& buf, int reg, int base, int disp)
+    {
+        int mod = 0x80;
+        if (disp == 0 && base != REG_EBP)
+            mod = 0x00;
+        else if (disp >= -0x80 && disp < 0x80)
+            mod = 0x40;
+
+        if (!buf.append_8(mod | (reg << 3) | base))
+            return false;
+
+        if (base == REG_ESP && !buf.append_8(0x24))
+            return false;
+
+        if (mod == 0x40)
+            return buf.append_8(disp);
+        else if (mod == 0x80)
+            return buf.append_32(uint32(disp));
+
+        return true;
+    }
+
+    // Emits a jump with a 32-bit displacement to be set by PatchJump.
+    // Returns the position of the displacement, 0 if out of space.
+    static int EmitJump(ByteBuffer& buf, JumpCondition cond)
+    {
+        if (cond == JUMP_ALWAYS)
+        {
+            if (!buf.append_8(0xE9))
+                return 0;
+        }
+        else if (!buf.append_8(0x0F) || !buf.append_8(cond))
+            return 0;
+
+        int pos = buf.pos();
+        return buf.append_32(0) ? pos : 0;
+    }
+
+    // Points the jump at the current position.
+    static void PatchJump(ByteBuffer& buf, int pos)
+    {
+        buf.patch_32(pos, uint32(buf.pos() - (pos + 4)));
+    }
+
+    // Moves st0 onto the native stack without losing precision.
+    static bool EmitSpill(ByteBuffer& buf)
+    {
+        return EmitAdjustStack(buf, -SPILL_SLOT_SIZE) &&
+            buf.append_8(0xDB) &&           // fstp tbyte ptr [esp]
+            buf.append_8(0x3C) &&
+            buf.append_8(0x24);
+    }
+
+    // mov ecx, address of the storage at offset in the data area
+    static bool EmitLoadDataAddress(ByteBuffer& buf, CompileContext& ctx, int offset)
+    {
+        return EmitRexW(buf) &&
+            buf.append_8(0xB9) &&
+            ctx.AppendDataAddress(buf, offset);
+    }
+
+    // fld tbyte ptr [ebp-slot], the value kept in the frame slot (CompileContext::AllocFrame)
+    static bool EmitLoadSlot(ByteBuffer& buf, int slot)
+    {
+        return buf.append_8(0xDB) &&
+            EmitModRM(buf, 5, REG_EBP, -slot);
+    }
+
+    // fstp tbyte ptr [ebp-slot]
+    static bool EmitStoreSlot(ByteBuffer& buf, int slot)
+    {
+        return buf.append_8(0xDB) &&
+            EmitModRM(buf, 7, REG_EBP, -slot);
+    }
+
+    // Copies st0 to the frame slot, st0 is kept.
+    static bool EmitCopyValue(ByteBuffer& buf, int slot)
+    {
+        return EmitStoreSlot(buf, slot) &&
+            EmitLoadSlot(buf, slot);
+    }
+
+    // Size of a value kept in a frame slot.
+    static const int VALUE_SLOT_SIZE = 10;
+
+    // Loads a spilled value back below st0, or on top if the result is in eax.
+    static bool EmitReload(ByteBuffer& buf, bool belowSt0 = true)
+    {
+        if (!buf.append_8(0xDB) ||          // fld tbyte ptr [esp]
+            !buf.append_8(0x2C) ||
+            !buf.append_8(0x24) ||
+            !EmitAdjustStack(buf, SPILL_SLOT_SIZE))
+            return false;
+
+        return !belowSt0 ||
+            (buf.append_8(0xD9) &&          // fxch st(1)
+            buf.append_8(0xC9));
+    }
+
+private:
+#ifdef _EXPR_TARGET_X64
+    static const int SPILL_SLOT_SIZE = 16;
+#else
+    static const int SPILL_SLOT_SIZE = 12;
+#endif
 #endif
 };
 
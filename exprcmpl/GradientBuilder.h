@@ -0,0 +1,360 @@
+#ifndef _GRADIENTBUILDER_H
+#define _GRADIENTBUILDER_H
+
+#include "util.h"
+#include "exprcmpl.h"
+#include "Expression.h"
+#include "NumberExpression.h"
+#include "SlotExpression.h"
+#include "CompileContext.h"
+#include "PodArray.h"
+
+// Builds the code of the partial derivatives of a folded expression by the variables
+// of the gradient, in reverse mode.
+// The adjoint of a node is the derivative of the result by the value of the node,
+// the adjoint of the root is 1. The adjoints are passed down the tree: each node computes
+// the adjoints of its children from its own one and the values of the expression
+// (DifferentiateNode), the adjoints of a variable add up to its derivative.
+// Each adjoint is computed once by a statement that stores it in a slot of the stack frame,
+// the values the statements use are copied to slots while the expression is computed.
+// Only the derivatives are stored to memory, so the code stays reentrant.
+// The statements of the arguments a function may not choose (if, min, max, clamp) are
+// skipped while their adjoint is 0, the derivatives of the other argument may be NaN.
+class GradientBuilder
+{
+    enum StatementType
+    {
+        STATEMENT_STORE,            // stores the result of expr in the slot
+        STATEMENT_ADD,              // adds the result of expr to the slot
+        STATEMENT_GUARD,            // skips to the statement end if the slot holds 0
+    };
+
+    // Code emitted after the expression.
+    struct Statement
+    {
+        StatementType type;
+        Expression* expr;
+        int slot;
+        int end;
+    };
+
+    // Node whose adjoint is known and whose children's aren't yet.
+    struct PendingNode
+    {
+        const Expression* node;
+        int adjoint;                // slot of the adjoint, -1 for the adjoint of the root
+        bool guarded;               // the statements of the subtree are skipped while the adjoint is 0
+    };
+
+    // Guard whose subtree is being differentiated.
+    struct OpenGuard
+    {
+        int statement;
+        int pending;                // size of m_pending without the subtree
+    };
+
+    // Jump of a guard to be pointed at the statement end.
+    struct GuardJump
+    {
+        int end;
+        int pos;
+    };
+
+    struct Derivative
+    {
+        int slot;                   // slot the adjoints of the variable are added up in, -1 until the first
+        bool cleared;               // the slot is set to 0 before the statements
+    };
+
+public:
+    GradientBuilder(CompileContext& ctx)
+        : m_ctx(ctx), m_adjoint(-1)
+    {
+    }
+
+    ~GradientBuilder()
+    {
+        for (int i = 0; i < m_statements.size(); ++i)
+            delete m_statements[i].expr;
+    }
+
+    // Builds the statements for the folded expression, before it's emitted.
+    int Build(const Expression* root)
+    {
+        int count = m_ctx.GetGradientCount();
+        if (!count)
+            return 1;
+
+        for (int i = 0; i < count; ++i)
+        {
+            Derivative derivative = { -1, false };
+            m_derivatives.append(derivative);
+        }
+
+        MarkVarying(root);
+
+        if (IsVarying(root))
+        {
+            PendingNode pending = { root, -1, false };
+            m_pending.append(pending);
+        }
+
+        while (m_pending.size())
+        {
+            CloseGuards();
+
+            PendingNode pending = m_pending.pop();
+            m_adjoint = pending.adjoint;
+
+            if (pending.guarded && pending.adjoint >= 0)
+            {
+                OpenGuard guard = { m_statements.size(), m_pending.size() };
+                m_guards.append(guard);
+
+                Statement statement = { STATEMENT_GUARD, NULL, pending.adjoint, 0 };
+                m_statements.append(statement);
+            }
+
+            int index = pending.node->GetGradientIndex(m_ctx);
+            if (index >= 0)
+                AddStatement(Adjoint(), index);
+            else
+                EXIT_ON_ERR(pending.node->DifferentiateNode(*this));
+        }
+
+        CloseGuards();
+
+        // The nodes of the statements are numbered after the ones of the expression.
+        int next = m_ctx.GetNodeStateCount();
+        for (int i = 0; i < m_statements.size(); ++i)
+            if (m_statements[i].expr)
+                next = m_statements[i].expr->NumberNodes(next);
+
+        for (int i = 0; i < m_statements.size(); ++i)
+            if (m_statements[i].expr)
+                EXIT_ON_ERR(m_statements[i].expr->Fold(m_ctx));
+
+        return 1;
+    }
+
+    // Emits the statements and the stores of the derivatives.
+    // The value of the expression is in st0 and stays there.
+    int Emit(ByteBuffer& buf)
+    {
+        int count = m_ctx.GetGradientCount();
+        if (!count)
+            return 1;
+
+        m_ctx.SetFpuDepth(1);
+
+        for (int i = 0; i < count; ++i)
+        {
+            if (m_derivatives[i].cleared &&
+                (!buf.append_16(0xEED9) ||      // fldz
+                !Expression::EmitStoreSlot(buf, m_derivatives[i].slot)))
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+        }
+
+        // The guards are nested, the innermost jump is the last one.
+        PodArray<GuardJump> jumps;
+        for (int i = 0; i <= m_statements.size(); ++i)
+        {
+            while (jumps.size() && jumps.back().end == i)
+                Expression::PatchJump(buf, jumps.pop().pos);
+
+            if (i == m_statements.size())
+                break;
+
+            const Statement& statement = m_statements[i];
+            if (statement.type == STATEMENT_GUARD)
+            {
+                GuardJump jump = { statement.end, EmitGuard(buf, statement.slot) };
+                if (!jump.pos)
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+                jumps.append(jump);
+                continue;
+            }
+
+            EXIT_ON_ERR(statement.expr->Emit(buf, m_ctx));
+
+            if (statement.type == STATEMENT_ADD &&
+                (!Expression::EmitLoadSlot(buf, statement.slot) ||
+                !buf.append_16(0xC1DE)))        // faddp
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+            if (!Expression::EmitStoreSlot(buf, statement.slot))
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+        }
+
+        // Variables the result doesn't depend on have the derivative 0.
+        for (int i = 0; i < count; ++i)
+        {
+            if (m_derivatives[i].slot < 0)
+            {
+                if (!buf.append_16(0xEED9))     // fldz
+                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
+            }
+            else if (!Expression::EmitLoadSlot(buf, m_derivatives[i].slot))
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+            if (!Expression::EmitRexW(buf) ||   // mov ecx, derivative
+                !buf.append_8(0xB9) ||
+                !buf.append_ptr(m_ctx.GetGradientVariable(i).derivative) ||
+                !buf.append_16(0x19DD))         // fstp qword ptr [ecx]
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+        }
+
+        m_ctx.SetFpuDepth(0);
+
+        return 1;
+    }
+
+    // The derivative rules of the nodes build their statements with these.
+
+    const CompileContext& GetContext() const
+    {
+        return m_ctx;
+    }
+
+    // Whether the node depends on a variable of the gradient.
+    bool IsVarying(const Expression* node) const
+    {
+        return node->GetState(m_ctx).Varying;
+    }
+
+    // New leaf with the adjoint of the node being differentiated.
+    Expression* Adjoint() const
+    {
+        if (m_adjoint < 0)
+            return new NumberExpression(1.0);
+
+        return new SlotExpression(m_adjoint);
+    }
+
+    // New leaf with the value of the node in the expression.
+    Expression* Value(const Expression* node)
+    {
+        NodeState& state = node->GetState(m_ctx);
+        if (state.Info.Type == MARSHALLING_IMM)
+            return new NumberExpression(state.Info.Imm);
+
+        if (state.ValueSlot < 0)
+            state.ValueSlot = m_ctx.AllocFrame(Expression::VALUE_SLOT_SIZE);
+
+        return new SlotExpression(state.ValueSlot);
+    }
+
+    // Sets the adjoint of the child, NULL passes on the adjoint of the node being differentiated.
+    // Takes the ownership of adjoint.
+    int Propagate(const Expression* child, Expression* adjoint)
+    {
+        return AddPending(child, adjoint, false);
+    }
+
+    // Sets the adjoint of an argument the function may not choose, which is 0 then.
+    int PropagateChoice(const Expression* child, Expression* adjoint)
+    {
+        return AddPending(child, adjoint, true);
+    }
+
+private:
+    GradientBuilder(const GradientBuilder&);
+    GradientBuilder& operator=(const GradientBuilder&);
+
+    // Sets Varying in the states of the nodes, the children before the parents.
+    void MarkVarying(const Expression* root)
+    {
+        PodArray<Expression::WalkFrame> stack;
+        Expression::WalkFrame frame = { root, 0 };
+        stack.append(frame);
+
+        while (stack.size())
+        {
+            Expression::WalkFrame& top = stack.back();
+            if (top.step < top.node->GetChildCount())
+            {
+                Expression::WalkFrame child = { top.node->GetChild(top.step++), 0 };
+                stack.append(child);
+                continue;
+            }
+
+            const Expression* node = stack.pop().node;
+            bool varying = node->GetGradientIndex(m_ctx) >= 0;
+            for (int i = 0; i < node->GetChildCount() && !varying; ++i)
+                varying = IsVarying(node->GetChild(i));
+
+            // Constants include the frozen variables.
+            NodeState& state = node->GetState(m_ctx);
+            state.Varying = varying && state.Info.Type != MARSHALLING_IMM;
+        }
+    }
+
+    int AddPending(const Expression* child, Expression* adjoint, bool guarded)
+    {
+        if (!IsVarying(child))
+        {
+            delete adjoint;
+            return 1;
+        }
+
+        PendingNode pending = { child, m_adjoint, guarded };
+        if (adjoint)
+        {
+            pending.adjoint = m_ctx.AllocFrame(Expression::VALUE_SLOT_SIZE);
+
+            Statement statement = { STATEMENT_STORE, adjoint, pending.adjoint, 0 };
+            m_statements.append(statement);
+        }
+
+        m_pending.append(pending);
+        return 1;
+    }
+
+    // Ends the guards whose subtrees are done.
+    void CloseGuards()
+    {
+        while (m_guards.size() && m_guards.back().pending >= m_pending.size())
+            m_statements[m_guards.pop().statement].end = m_statements.size();
+    }
+
+    // Adds the expression to the derivative by the variable.
+    // The first one is stored unless it may be skipped.
+    void AddStatement(Expression* expr, int index)
+    {
+        Derivative& derivative = m_derivatives[index];
+        Statement statement = { STATEMENT_ADD, expr, derivative.slot, 0 };
+        if (statement.slot < 0)
+        {
+            statement.slot = derivative.slot = m_ctx.AllocFrame(Expression::VALUE_SLOT_SIZE);
+            derivative.cleared = m_guards.size() != 0;
+            if (!derivative.cleared)
+                statement.type = STATEMENT_STORE;
+        }
+
+        m_statements.append(statement);
+    }
+
+    // Jumps if the adjoint in the slot is 0, not if it's NaN.
+    // Returns the position of the displacement, 0 if out of space.
+    int EmitGuard(ByteBuffer& buf, int slot)
+    {
+        if (!Expression::EmitLoadSlot(buf, slot) ||
+            !buf.append_16(0xEED9) ||           // fldz
+            !buf.append_16(0xE9DF) ||           // fucomip st0, st1
+            !buf.append_16(0xD8DD) ||           // fstp st0
+            !buf.append_16(0x067A))             // jp past the je
+            return 0;
+
+        return Expression::EmitJump(buf, JUMP_E);
+    }
+
+    CompileContext& m_ctx;
+    PodArray<Statement> m_statements;
+    PodArray<PendingNode> m_pending;
+    PodArray<OpenGuard> m_guards;
+    int m_adjoint;                  // slot of the adjoint of the node being differentiated
+    PodArray<Derivative> m_derivatives;
+};
+
+#endif
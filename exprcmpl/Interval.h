@@ -0,0 +1,158 @@
+#ifndef _INTERVAL_H
+#define _INTERVAL_H
+
+#include <float.h>          // DBL_MIN
+#include <string.h>         // memcpy
+
+#include "util.h"
+
+// Range of the values of a node, [Min, Max] and possibly NaN.
+// The bounds of rounded operations are widened by a relative error that covers
+// the rounding of the code, in extended and in single precision, so the ranges hold
+// for the values the code computes and not only for the exact ones.
+struct Interval
+{
+    double Min;
+    double Max;
+    bool MayBeNaN;
+
+    static Interval Make(double min, double max, bool nan)
+    {
+        Interval range = { min, max, nan };
+        return range;
+    }
+
+    static Interval Full()
+    {
+        return Make(-HUGE_VAL, HUGE_VAL, true);
+    }
+
+    static Interval Point(double value)
+    {
+        if (value != value)
+            return Full();
+
+        return Make(value, value, false);
+    }
+
+    static Interval Int32()
+    {
+        return Make(-2147483648.0, 2147483647.0, false);
+    }
+
+    bool Contains(double value) const
+    {
+        return Min <= value && value <= Max;
+    }
+
+    bool IsFinite() const
+    {
+        return Min > -HUGE_VAL && Max < HUGE_VAL;
+    }
+
+    // The range holds a single number, the sign of a zero isn't tracked.
+    bool IsPoint() const
+    {
+        return !MayBeNaN && Min == Max;
+    }
+
+    bool IsPositive() const
+    {
+        return !MayBeNaN && Min > 0.0;
+    }
+
+    static Interval Hull(const Interval& one, const Interval& two)
+    {
+        return Make(one.Min < two.Min ? one.Min : two.Min,
+            one.Max > two.Max ? one.Max : two.Max,
+            one.MayBeNaN || two.MayBeNaN);
+    }
+
+    // Range of a monotone function of the bounds. A NaN bound,
+    // like inf - inf, leaves the range unknown.
+    static Interval Bounds(double min, double max, bool nan, double error)
+    {
+        if (min != min || max != max)
+            return Full();
+
+        return Make(Below(min, error), Above(max, error), nan);
+    }
+
+    // The sign of a rounded result is exact. An underflow to 0
+    // is below the bound for a zero of the other sign.
+    static double Below(double value, double error)
+    {
+        if (value > 0.0)
+            return value >= DBL_MIN ? value * (1.0 - error) : 0.0;
+        else if (value < 0.0)
+            return value > -DBL_MIN ? value - DBL_MIN : value * (1.0 + error);
+
+        return IsNegative(value) ? -DBL_MIN : value;
+    }
+
+    static double Above(double value, double error)
+    {
+        return -Below(-value, error);
+    }
+
+    static bool IsNegative(double value)
+    {
+        uint64 bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return (bits >> 63) != 0;
+    }
+
+    static Interval Add(const Interval& one, const Interval& two, double error)
+    {
+        bool nan = one.MayBeNaN || two.MayBeNaN ||
+            (one.Max == HUGE_VAL && two.Min == -HUGE_VAL) ||
+            (one.Min == -HUGE_VAL && two.Max == HUGE_VAL);
+        return Bounds(one.Min + two.Min, one.Max + two.Max, nan, error);
+    }
+
+    static Interval Negate(const Interval& range)
+    {
+        return Make(-range.Max, -range.Min, range.MayBeNaN);
+    }
+
+    // 0 * inf is NaN, the 0 may lie inside a range that isn't a corner.
+    static Interval Mul(const Interval& one, const Interval& two, double error)
+    {
+        bool nan = one.MayBeNaN || two.MayBeNaN ||
+            (one.Contains(0.0) && !two.IsFinite()) ||
+            (two.Contains(0.0) && !one.IsFinite());
+        double products[] = { one.Min * two.Min, one.Min * two.Max, one.Max * two.Min, one.Max * two.Max };
+        return Extremes(products, nan, error);
+    }
+
+    // A divisor that may be 0 gives any result.
+    static Interval Div(const Interval& one, const Interval& two, double error)
+    {
+        if (two.MayBeNaN || two.Contains(0.0))
+            return Full();
+
+        double quotients[] = { one.Min / two.Min, one.Min / two.Max, one.Max / two.Min, one.Max / two.Max };
+        return Extremes(quotients, one.MayBeNaN, error);
+    }
+
+    // Range of four corner values, 0 * inf and inf / inf leave it unknown.
+    static Interval Extremes(const double* values, bool nan, double error)
+    {
+        double min = values[0];
+        double max = values[0];
+        for (int i = 0; i < 4; ++i)
+        {
+            if (values[i] != values[i])
+                return Full();
+
+            if (values[i] < min)
+                min = values[i];
+            if (values[i] > max)
+                max = values[i];
+        }
+
+        return Bounds(min, max, nan, error);
+    }
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef _NODESTATE_H
+#define _NODESTATE_H
+
+#include "util.h"
+#include "exprcmpl.h"
+#include "Interval.h"
+
+enum MarshallingType
+{
+    MARSHALLING_ST0 = 0,        // Floating point value ontop of the x87 stack.
+    MARSHALLING_IMM,            // Immediate double precision floating point value.
+    MARSHALLING_EAX,            // Integer value in eax (COMPILE_INT32_ARITHMETIC).
+};
+
+// Defines an additional way (with the default of MARSHALLING_ST0)
+// of marshalling of the return value of an expression.
+struct MarshallingInfo
+{
+    MarshallingType Type;
+    double Imm;                 // MARSHALLING_IMM
+    bool Int32;                 // the value is an integer, always set for MARSHALLING_EAX
+    Interval Range;             // values the node may take
+    bool Effects;               // the subtree calls a host function that isn't pure
+    bool Expensive;             // the subtree calls an IDENTIFIER_FLAG_EXPENSIVE function
+};
+
+// State of a node in a compilation. CompileContext keeps it for each node by the index
+// of the node, the tree itself is never written, so it may be compiled on several threads.
+struct NodeState
+{
+    // Set by Fold.
+    MarshallingInfo Info;
+    int TreeLength;
+    int PolynomialIndex;        // polynomial of the node in the context, -1 if it isn't one (COMPILE_HORNER)
+    int Chosen;                 // argument of a call that is the result by the ranges of the arguments, -1 if there is none
+
+    // Set by Fold and GradientBuilder.
+    int ValueSlot;              // frame slot the value is copied to, -1 if it isn't
+    bool Varying;               // the value depends on a variable of the gradient
+
+    // State of the emission in progress, kept between the steps.
+    bool Swapped;               // the right operand is evaluated first
+    int Spilled;                // values moved from the x87 stack to the native stack
+    int SkipJump;               // jump past the second operand (COMPILE_LAZY_CALLS)
+    Identifier Ident;           // host function being called
+    int Conv;
+    int BaseDepth;
+    int ArgIndex;               // number of arguments staged
+    int ArgBytes;
+    int ElseJump;               // jumps of an if with a branch per argument (COMPILE_LAZY_CALLS)
+    int DoneJump;
+};
+
+#endif
@@ -1,8 +1,11 @@
 ﻿#ifndef _NUMBEREXPRESSION_H
 #define _NUMBEREXPRESSION_H
 
+#include <float.h>          // DBL_MAX
+
 #include "util.h"
 #include "Expression.h"
+#include "NumberParser.h"
 
 class NumberExpression : public Expression
 {
@@ -14,54 +17,152 @@ public:
     }
 
 #ifdef _ENABLE_EXPR_TOSTRING
-    virtual int ToString(char* str, int len) const
+    virtual bool ToStringStep(TextBuffer& text, int step, const Expression** child) const
+    {
+        char str[32];
+        int len = Format(str, m_value);
+        return text.append(str, len);
+    }
+
+    // Prints the shortest text NumberParser reads back as the same value,
+    // returns its length. str must hold 32 characters.
+    static int Format(char* str, double value)
     {
-        return sprintf_s(str, len, "%.3f", m_value);
+        // Integers are printed without going through printf, -0.0 is not one of them.
+        uint64 bits;
+        memcpy(&bits, &value, sizeof(bits));
+        if (!(bits >> 63) && value == floor(value) && value < 1e15)
+        {
+            char digits[16];
+            uint64 n = uint64(value);
+            int count = 0;
+            do
+            {
+                digits[count++] = char('0' + n % 10);
+                n /= 10;
+            }
+            while (n);
+
+            for (int i = 0; i < count; ++i)
+                str[i] = digits[count - 1 - i];
+
+            return count;
+        }
+
+        // Literals that overflow are infinite.
+        if (value > DBL_MAX)
+        {
+            memcpy(str, "1e999", 5);
+            return 5;
+        }
+
+        // 17 significant digits always suffice.
+        int len = 0;
+        for (int precision = 15; precision <= 17; ++precision)
+        {
+            len = sprintf_s(str, 32, "%.*g", precision, value);
+
+            double parsed;
+            if (NumberParser::Parse(str, str + len, &parsed) == len && parsed == value)
+                break;
+        }
+
+        return len;
     }
 #endif
 
 #ifdef _ENABLE_EXPR_EMIT
-    virtual int Emit(ByteBuffer& buf, pIdentifierInfoCallback callback) const
+    virtual int FoldNode(CompileContext& ctx) const
     {
-        // Emitting the NumberExpression pushes the value onto the fpu stack
+        MarshallingInfo& info = GetState(ctx).Info;
+#ifdef _ENABLE_EXPR_FOLDING
+        info.Type = MARSHALLING_IMM;
+        info.Imm = m_value;
+        info.Int32 = ctx.HasFlag(COMPILE_INT32_ARITHMETIC) && IsInt32Value(m_value);
+#else
+        info.Type = MARSHALLING_ST0;
+        info.Int32 = false;
+#endif
+        return 1;
+    }
 
+#ifdef _ENABLE_EXPR_FOLDING
+    virtual int EvaluateNode(CompileContext& ctx) const
+    {
+        GetState(ctx).Info.Imm = m_value;
+        return 1;
+    }
+#endif
+
+    virtual int EmitStep(ByteBuffer& buf, CompileContext& ctx, int step, const Expression** child) const
+    {
+        return EmitValue(buf, ctx, m_value);
+    }
+
+    // Pushes the value onto the fpu stack, for the constants the other nodes fold as well.
+    static int EmitValue(ByteBuffer& buf, CompileContext& ctx, double value)
+    {
         // Simple Cases
-        static const double values[] =
+        // Only constants that are exact doubles are loaded with the fld constant instructions,
+        // the others (fldpi, fldl2e, ...) carry more precision than the literal
+        // and would make the result differ from the folded one.
+        static const uint64 values[] =
         {
-            +1.0000000000000000,
-            +3.3219280948873626,    // log2(10)
-            M_LOG2E,                // log2(e)
-            M_PI,
-            +0.30102999566398114,   // log10(2)
-            M_LN2,                  // ln(2)
-            +0.0000000000000000,
+            0x3FF0000000000000ULL,  // +1.0
+            0x0000000000000000ULL,  // +0.0
         };
 
         static const uint16 opcodes[] =
         {
-            0xE8D9,
-            0xE9D9,
-            0xEAD9,
-            0xEBD9,
-            0xECD9,
-            0xEDD9,
-            0xEED9,
+            0xE8D9,                 // fld1
+            0xEED9,                 // fldz
         };
 
         STATIC_ASSERT(sizeof(values)/sizeof(values[0]) == sizeof(opcodes)/sizeof(opcodes[0]), "values count differs from opcodes count");
 
-        for (int i = 0; i < sizeof(values)/sizeof(values[0]); ++i)
+        uint64 bits;
+        memcpy(&bits, &value, sizeof(bits));
+
+        for (int i = 0; i < int(sizeof(values)/sizeof(values[0])); ++i)
         {
-            if (eqdbl(m_value, values[i]))
+            if (bits == values[i])
             {
                 if (!buf.append_16(opcodes[i]))
                     return ERR_OUTPUT_BUFFER_TOO_SMALL;
 
-                return buf.pos();
+                return EMIT_STEP_DONE;
             }
         }
 
-        uint32* value_parts = (uint32*)&m_value;
+        // Constants are single precision in float32 mode.
+        if (ctx.HasFlag(COMPILE_FLOAT32))
+        {
+            float single = float(value);
+            uint32 singleBits;
+            memcpy(&singleBits, &single, sizeof(singleBits));
+            if (!buf.append_8(0x68) ||              // push imm32
+                !buf.append_32(singleBits) ||
+                !buf.append_8(0xD9) ||              // fld dword ptr [esp]
+                !buf.append_8(0x04) ||
+                !buf.append_8(0x24) ||
+                !buf.append_8(0x58))                // pop eax
+                return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+            return EMIT_STEP_DONE;
+        }
+
+#ifdef _EXPR_TARGET_X64
+        if (!buf.append_8(0x48) ||                  // mov rax, imm64
+            !buf.append_8(0xB8) ||
+            !buf.append_64(bits) ||
+            !buf.append_8(0x50) ||                  // push rax
+            !buf.append_8(0xDD) ||                  // fld qword ptr [rsp]
+            !buf.append_8(0x04) ||
+            !buf.append_8(0x24) ||
+            !buf.append_8(0x58))                    // pop rax
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+#else
+        uint32* value_parts = (uint32*)&value;
 
         if (!buf.append_8(0x68) ||                  // push imm32 (higher bits)
             !buf.append_32(value_parts[1]) ||
@@ -74,25 +175,9 @@ public:
             !buf.append_8(0xC4) ||
             !buf.append_8(0x08))
             return ERR_OUTPUT_BUFFER_TOO_SMALL;
-
-        return buf.pos();
-    }
-
-    virtual MarshallingInfo GetMarshallingInfo() const
-    {
-        MarshallingInfo ret;
-#ifdef _ENABLE_EXPR_FOLDING
-        ret.Type = MARSHALLING_IMM;
-        ret.Imm = m_value;
-#else
-        ret.Type = MARSHALLING_ST0;
 #endif
-        return ret;
-    }
 
-    virtual int GetExpressionTreeLength() const
-    {
-        return 1;
+        return EMIT_STEP_DONE;
     }
 #endif
 };
@@ -0,0 +1,82 @@
+#ifndef _PODARRAY_H
+#define _PODARRAY_H
+
+#include <string.h>         // memcpy
+
+#include "util.h"
+
+// Growable array of plain structures.
+template <typename T>
+class PodArray
+{
+public:
+    inline PodArray()
+        : m_data(NULL), m_size(0), m_capacity(0)
+    {
+    }
+
+    inline int size() const
+    {
+        return m_size;
+    }
+
+    inline T& operator[](int index)
+    {
+        return m_data[index];
+    }
+
+    inline const T& operator[](int index) const
+    {
+        return m_data[index];
+    }
+
+    inline void append(const T& item)
+    {
+        if (m_size == m_capacity)
+        {
+            int capacity = m_capacity ? m_capacity * 2 : 16;
+            T* data = new T[capacity];
+            if (m_data)
+            {
+                memcpy(data, m_data, m_size * sizeof(T));
+                delete[] m_data;
+            }
+
+            m_data = data;
+            m_capacity = capacity;
+        }
+
+        m_data[m_size++] = item;
+    }
+
+    inline T& back()
+    {
+        return m_data[m_size - 1];
+    }
+
+    inline T pop()
+    {
+        return m_data[--m_size];
+    }
+
+    inline void clear()
+    {
+        m_size = 0;
+    }
+
+    inline ~PodArray()
+    {
+        if (m_data)
+            delete[] m_data;
+    }
+
+private:
+    PodArray(const PodArray&);
+    PodArray& operator=(const PodArray&);
+
+    T* m_data;
+    int m_size;
+    int m_capacity;
+};
+
+#endif
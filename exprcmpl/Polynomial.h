@@ -0,0 +1,125 @@
+#ifndef _POLYNOMIAL_H
+#define _POLYNOMIAL_H
+
+#include "util.h"
+
+class Expression;
+
+// Polynomial in one variable a subtree computes (COMPILE_HORNER).
+// Cost estimates the code of the subtree as it is, in instructions.
+struct Polynomial
+{
+    static const int MAX_DEGREE = 8;
+
+    const Expression* Variable;     // first load of the variable, NULL for a constant
+    int Degree;
+    int Cost;
+    double Coeffs[MAX_DEGREE + 1];  // Coeffs[k] is the coefficient of x^k
+
+    static Polynomial Constant(double value, int cost)
+    {
+        Polynomial poly;
+        poly.Variable = NULL;
+        poly.Degree = 0;
+        poly.Cost = cost;
+        poly.Coeffs[0] = value;
+        return poly;
+    }
+
+    static Polynomial Linear(const Expression* variable, int cost)
+    {
+        Polynomial poly;
+        poly.Variable = variable;
+        poly.Degree = 1;
+        poly.Cost = cost;
+        poly.Coeffs[0] = 0.0;
+        poly.Coeffs[1] = 1.0;
+        return poly;
+    }
+
+    // one + sign * two, the variables are the same or one of them is a constant.
+    static Polynomial Add(const Polynomial& one, const Polynomial& two, double sign)
+    {
+        Polynomial sum = one.Degree >= two.Degree ? one : two;
+        sum.Variable = one.Variable ? one.Variable : two.Variable;
+        sum.Cost = one.Cost + two.Cost + 1;
+        for (int k = 0; k <= sum.Degree; ++k)
+        {
+            double a = k <= one.Degree ? one.Coeffs[k] : 0.0;
+            double b = k <= two.Degree ? two.Coeffs[k] : 0.0;
+            sum.Coeffs[k] = a + sign * b;
+        }
+
+        return sum;
+    }
+
+    // Fails if the degree of the product exceeds MAX_DEGREE.
+    static bool Mul(const Polynomial& one, const Polynomial& two, Polynomial& product)
+    {
+        if (one.Degree + two.Degree > MAX_DEGREE)
+            return false;
+
+        product.Variable = one.Variable ? one.Variable : two.Variable;
+        product.Degree = one.Degree + two.Degree;
+        product.Cost = one.Cost + two.Cost + 1;
+        for (int k = 0; k <= product.Degree; ++k)
+            product.Coeffs[k] = 0.0;
+
+        for (int i = 0; i <= one.Degree; ++i)
+            for (int j = 0; j <= two.Degree; ++j)
+                product.Coeffs[i + j] += one.Coeffs[i] * two.Coeffs[j];
+
+        return true;
+    }
+
+    static Polynomial Div(const Polynomial& one, double divisor)
+    {
+        Polynomial quotient = one;
+        quotient.Cost = one.Cost + 5;
+        for (int k = 0; k <= quotient.Degree; ++k)
+            quotient.Coeffs[k] /= divisor;
+
+        return quotient;
+    }
+
+    // x^n by multiplying, n >= 0.
+    static bool Pow(const Polynomial& base, int n, Polynomial& power)
+    {
+        if (base.Degree * n > MAX_DEGREE)
+            return false;
+
+        power = Constant(1.0, 0);
+        for (int i = 0; i < n; ++i)
+        {
+            Polynomial product;
+            Mul(power, base, product);
+            power = product;
+        }
+
+        power.Variable = base.Variable;
+        power.Cost = base.Cost + n + 1;
+        return true;
+    }
+
+    // Instructions of the Horner scheme: the load of the variable, the first coefficient
+    // (a copy of the variable if it is 1), a fmul and a fadd of the next ones, the constants
+    // go through ecx, and the final fstp of the variable.
+    int GetHornerCost() const
+    {
+        bool monic = Coeffs[Degree] == 1.0;
+        int cost = 2 + 1 + Degree - (monic ? 1 : 0) + 1;
+        bool constants = !monic;
+        for (int k = 0; k < Degree; ++k)
+        {
+            if (Coeffs[k] != 0.0)
+            {
+                ++cost;
+                constants = true;
+            }
+        }
+
+        return constants ? cost + 1 : cost;
+    }
+};
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef _SLOTEXPRESSION_H
+#define _SLOTEXPRESSION_H
+
+#include "util.h"
+#include "Expression.h"
+#include "NumberExpression.h"
+
+// Value the code keeps in a slot of its stack frame, stored by an earlier part of the code.
+// The nodes are built by GradientBuilder, the parser never creates them.
+class SlotExpression : public Expression
+{
+    int m_slot;
+
+public:
+    SlotExpression(int slot)
+        : Expression(), m_slot(slot)
+    {
+    }
+
+#ifdef _ENABLE_EXPR_TOSTRING
+    // Printed as $offset, for debugging only.
+    virtual bool ToStringStep(TextBuffer& text, int step, const Expression** child) const
+    {
+        char str[32];
+        int len = NumberExpression::Format(str, m_slot);
+        return text.append_char('$') && text.append(str, len);
+    }
+#endif
+
+#ifdef _ENABLE_EXPR_EMIT
+    virtual int FoldNode(CompileContext& ctx) const
+    {
+        MarshallingInfo& info = GetState(ctx).Info;
+        info.Type = MARSHALLING_ST0;
+        info.Int32 = false;
+        return 1;
+    }
+
+#ifdef _ENABLE_EXPR_FOLDING
+    // The slots only hold values while the code runs.
+    virtual int EvaluateNode(CompileContext& ctx) const
+    {
+        return ERR_INVALID_INPUT;
+    }
+#endif
+
+    virtual int EmitStep(ByteBuffer& buf, CompileContext& ctx, int step, const Expression** child) const
+    {
+        if (!EmitLoadSlot(buf, m_slot))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        return EMIT_STEP_DONE;
+    }
+#endif
+};
+
+#endif
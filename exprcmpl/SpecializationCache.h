@@ -0,0 +1,177 @@
+#ifndef _SPECIALIZATIONCACHE_H
+#define _SPECIALIZATIONCACHE_H
+
+#include <string.h>         // memcpy, memcmp, strlen
+
+#include "util.h"
+#include "exprcmpl.h"
+#include "ByteBuffer.h"
+#include "PodArray.h"
+#include "CodeSymbol.h"
+
+// Code of a parsed expression compiled for tuples of values of the frozen variables.
+class SpecializationCache
+{
+    struct Entry
+    {
+        double* values;
+        uint8* code;
+        int size;
+        CodeSymbol* symbol;     // NULL without symbol_flags
+        ExecutionCounters* counters;    // NULL without COMPILE_COUNT_CALLS/CYCLES
+        uint8* memo;                    // memo caches, NULL without memoized calls
+        int memoSize;
+    };
+
+public:
+    SpecializationCache(const void* exprPtr, const SpecializationInfo& info)
+        : m_exprPtr(exprPtr), m_info(info), m_frozen(NULL)
+    {
+        if (m_info.frozen_count)
+            m_frozen = new FrozenVariable[m_info.frozen_count];
+
+        for (int i = 0; i < m_info.frozen_count; ++i)
+        {
+            int len = int(strlen(info.frozen[i]));
+            char* name = new char[len + 1];
+            memcpy(name, info.frozen[i], len + 1);
+
+            m_frozen[i].identifier = name;
+            m_frozen[i].identifier_len = len;
+            m_frozen[i].value = 0.0;
+        }
+
+        m_info.frozen = NULL;
+    }
+
+    int Specialize(const double* values, uint8** code)
+    {
+        if (!values && m_info.frozen_count)
+            return ERR_INVALID_INPUT;
+
+        int valuesSize = m_info.frozen_count * int(sizeof(double));
+
+        for (int i = 0; i < m_entries.size(); ++i)
+        {
+            // Values are matched bitwise, so -0.0 and 0.0 get separate code.
+            if (!memcmp(m_entries[i].values, values, valuesSize))
+            {
+                *code = m_entries[i].code;
+                return m_entries[i].size;
+            }
+        }
+
+        // The data area holds absolute addresses, so the code can't be moved
+        // after it's compiled. The size is computed first.
+        Entry entry;
+        entry.counters = NULL;
+        entry.memo = NULL;
+        entry.memoSize = 0;
+        if (m_info.flags & (COMPILE_COUNT_CALLS | COMPILE_COUNT_CYCLES))
+            entry.counters = new ExecutionCounters;
+
+        CompileStats stats;
+        int size = Compile(values, entry, NULL, 0, &stats);
+        if (size <= 0)
+        {
+            ReleaseStorage(entry);
+            return size;
+        }
+
+        if (stats.memo_storage_size)
+        {
+            entry.memo = new uint8[stats.memo_storage_size];
+            entry.memoSize = stats.memo_storage_size;
+        }
+
+        entry.code = m_info.alloc_code(size);
+        if (!entry.code)
+        {
+            ReleaseStorage(entry);
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+        }
+
+        entry.size = Compile(values, entry, entry.code, size, NULL);
+        if (entry.size <= 0)
+        {
+            m_info.free_code(entry.code, size);
+            ReleaseStorage(entry);
+            return entry.size;
+        }
+
+        // All specializations of the expression get its name.
+        entry.symbol = NULL;
+        if (m_info.symbol_flags)
+        {
+            entry.symbol = new CodeSymbol(entry.code, entry.size);
+            int res = entry.symbol->Register((const Expression*)m_exprPtr, NULL, m_info.symbol_flags);
+            if (res <= 0)
+            {
+                delete entry.symbol;
+                m_info.free_code(entry.code, size);
+                ReleaseStorage(entry);
+                return res;
+            }
+        }
+
+        entry.values = new double[m_info.frozen_count + 1];
+        memcpy(entry.values, values, valuesSize);
+        m_entries.append(entry);
+
+        *code = entry.code;
+        return entry.size;
+    }
+
+    ~SpecializationCache()
+    {
+        for (int i = 0; i < m_entries.size(); ++i)
+        {
+            if (m_entries[i].symbol)
+                delete m_entries[i].symbol;
+            m_info.free_code(m_entries[i].code, m_entries[i].size);
+            ReleaseStorage(m_entries[i]);
+            delete[] m_entries[i].values;
+        }
+
+        for (int i = 0; i < m_info.frozen_count; ++i)
+            delete[] m_frozen[i].identifier;
+
+        if (m_frozen)
+            delete[] m_frozen;
+    }
+
+private:
+    SpecializationCache(const SpecializationCache&);
+    SpecializationCache& operator=(const SpecializationCache&);
+
+    // Releases the counters and the memo caches of the code.
+    static void ReleaseStorage(const Entry& entry)
+    {
+        delete entry.counters;
+        delete[] entry.memo;
+    }
+
+    int Compile(const double* values, const Entry& entry, uint8* output, int outputLen, CompileStats* stats)
+    {
+        for (int i = 0; i < m_info.frozen_count; ++i)
+            m_frozen[i].value = values[i];
+
+        CompileOptions options;
+        memset(&options, 0, sizeof(options));
+        options.flags = m_info.flags;
+        options.frozen_variables = m_frozen;
+        options.frozen_count = m_info.frozen_count;
+        options.counters = entry.counters;
+        options.memo_storage = entry.memo;
+        options.memo_storage_size = entry.memoSize;
+
+        return CompileExpressionEx(m_exprPtr, output, outputLen, m_info.identifierInfoCallback, &options, stats);
+    }
+
+    const void* m_exprPtr;
+    SpecializationInfo m_info;
+    FrozenVariable* m_frozen;
+    PodArray<Entry> m_entries;
+};
+
+#endif
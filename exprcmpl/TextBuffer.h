@@ -0,0 +1,45 @@
+#ifndef _TEXTBUFFER_H
+#define _TEXTBUFFER_H
+
+#include <string.h>         // memcpy
+
+#include "util.h"
+
+// Appends text to a fixed size array. With NULL data nothing is written,
+// the buffer only counts the characters (counting mode).
+class TextBuffer
+{
+public:
+    inline TextBuffer(char* data, int length)
+        : m_data(data), m_length(length), m_pos(0)
+    {
+    }
+
+    inline int pos()
+    {
+        return m_pos;
+    }
+
+    inline bool append(const char* text, int len)
+    {
+        if (m_length - m_pos < len)
+            return false;
+
+        if (m_data)
+            memcpy(m_data + m_pos, text, len);
+        m_pos += len;
+        return true;
+    }
+
+    inline bool append_char(char c)
+    {
+        return append(&c, 1);
+    }
+
+private:
+    char* m_data;
+    int m_length;
+    int m_pos;
+};
+
+#endif
@@ -3,81 +3,181 @@
 
 #include "util.h"
 #include "Expression.h"
+#include "NumberExpression.h"
 
 class VariableExpression : public Expression
 {
 public:
-    VariableExpression(const char* name, int nameLen)
+    VariableExpression(const char* name, int nameLen, bool copyName = true)
         : Expression()
     {
-        char* ident = new char[nameLen+1];
-        memcpy(ident, name, nameLen);
-        ident[nameLen] = 0;
-        m_identifier = ident;
-        m_identifierLen = nameLen;
+        SetIdentifier(name, nameLen, copyName);
     }
 
 #ifdef _ENABLE_EXPR_TOSTRING
-    virtual int ToString(char* str, int len) const
+    virtual bool ToStringStep(TextBuffer& text, int step, const Expression** child) const
     {
-        if (len < m_identifierLen)
-            return 0;
-
-        memcpy_s(str, len, m_identifier, m_identifierLen);
-
-        return m_identifierLen;
+        return text.append(m_identifier, m_identifierLen);
     }
 #endif
 
 #ifdef _ENABLE_EXPR_EMIT
-    virtual int Emit(ByteBuffer& buf, pIdentifierInfoCallback identifierInfoCallback) const
+    virtual int FoldNode(CompileContext& ctx) const
     {
+        MarshallingInfo& info = GetState(ctx).Info;
+        info.Type = MARSHALLING_ST0;
+        info.Int32 = false;
+
+        // Errors in the use of the identifier are reported by Emit.
         Identifier ident;
-        if (!identifierInfoCallback(m_identifier, m_identifierLen, &ident))
+        bool known = ctx.GetIdentifierInfo(m_identifier, m_identifierLen, &ident);
+        bool int32 = ctx.HasFlag(COMPILE_INT32_ARITHMETIC) && known && ident.Type == IDENTIFIER_INT32;
+
+        if (known && ident.Type == IDENTIFIER_INT32)
+            info.Range = Interval::Int32();
+
+        if (known)
+            EXIT_ON_ERR(ApplyDeclaredRange(ident, ident.Type == IDENTIFIER_INT32, info.Range));
+
+#ifdef _ENABLE_EXPR_FOLDING
+        if (ctx.GetFrozenValue(m_identifier, m_identifierLen, &info.Imm))
+        {
+            info.Type = MARSHALLING_IMM;
+            info.Int32 = int32 && IsInt32Value(info.Imm);
+            return 1;
+        }
+#endif
+
+        if (int32)
+        {
+            info.Type = MARSHALLING_EAX;
+            info.Int32 = true;
+            ++ctx.GetStats().int32_nodes;
+        }
+        else if (ctx.HasFlag(COMPILE_HORNER) && known && GetLoadOpcode(ident.Type) > 0)
+            SetPolynomial(ctx, Polynomial::Linear(this, 2));
+
+        return 1;
+    }
+
+#ifdef _ENABLE_EXPR_FOLDING
+    virtual int EvaluateNode(CompileContext& ctx) const
+    {
+        MarshallingInfo& info = GetState(ctx).Info;
+        Identifier ident;
+        if (!ctx.GetIdentifierInfo(m_identifier, m_identifierLen, &ident))
             return ERR_UNKNOWN_IDENTIFIER;
 
         switch (ident.Type)
         {
             case IDENTIFIER_INT32:
-                // fild dword ptr [addr]
-                if (!buf.append_8(0xDB) ||
-                    !buf.append_8(0x05) ||
-                    !buf.append_32(uint32(ident.ptr)))
-                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                break;
+                info.Imm = *(const int32*)ident.ptr;
+                return 1;
             case IDENTIFIER_FLOAT32:
-                // fld dword ptr [addr]
-                if (!buf.append_8(0xD9) ||
-                    !buf.append_8(0x05) ||
-                    !buf.append_32(uint32(ident.ptr)))
-                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                break;
+                info.Imm = *(const float*)ident.ptr;
+                return 1;
             case IDENTIFIER_FLOAT64:
-                // fld qword ptr [addr]
-                if (!buf.append_8(0xDD) ||
-                    !buf.append_8(0x05) ||
-                    !buf.append_32(uint32(ident.ptr)))
-                    return ERR_OUTPUT_BUFFER_TOO_SMALL;
-                break;
+                info.Imm = *(const double*)ident.ptr;
+                return 1;
             default:
                 return ERR_IDENTIFIER_MISUSE;
         }
+    }
+#endif
 
-        return buf.pos();
+    virtual int GetGradientIndex(const CompileContext& ctx) const
+    {
+        return ctx.GetGradientIndex(m_identifier, m_identifierLen);
     }
 
-    virtual MarshallingInfo GetMarshallingInfo() const
+    // Opcode of the x87 load of a variable of the given type.
+    static int GetLoadOpcode(int type)
     {
-        // Actually we can support pointer to the variable.
-        MarshallingInfo info;
-        info.Type = MARSHALLING_ST0;
-        return info;
+        switch (type)
+        {
+            case IDENTIFIER_INT32:
+                return 0xDB;                    // fild dword ptr [addr]
+            case IDENTIFIER_FLOAT32:
+                return 0xD9;                    // fld dword ptr [addr]
+            case IDENTIFIER_FLOAT64:
+                return 0xDD;                    // fld qword ptr [addr]
+            default:
+                return ERR_IDENTIFIER_MISUSE;
+        }
     }
 
-    virtual int GetExpressionTreeLength() const
+    // Opcode of the integer load, mov eax, dword ptr [addr].
+    static const int INT32_LOAD_OPCODE = 0x8B;
+
+    // Rewrites a load emitted by Emit. All of the load forms have the same length,
+    // integer loads keep the opcode.
+    static int Rebind(uint8* code, const VariablePatchSite& site, const Identifier& ident)
     {
+        int opcode = GetLoadOpcode(ident.Type);
+        if (opcode < 0)
+            return opcode;
+
+        if (code[site.opcode_pos] == INT32_LOAD_OPCODE)
+        {
+            if (ident.Type != IDENTIFIER_INT32)
+                return ERR_IDENTIFIER_MISUSE;
+
+            opcode = INT32_LOAD_OPCODE;
+        }
+
+        ByteBuffer buf(code, site.address_pos + int(sizeof(void*)));
+        buf.patch_8(site.opcode_pos, opcode);
+        buf.patch_ptr(site.address_pos, ident.ptr);
+
         return 1;
     }
+
+    virtual int EmitStep(ByteBuffer& buf, CompileContext& ctx, int step, const Expression** child) const
+    {
+        const MarshallingInfo& info = GetState(ctx).Info;
+
+#ifdef _ENABLE_EXPR_FOLDING
+        // frozen variable
+        if (info.Type == MARSHALLING_IMM)
+            return NumberExpression::EmitValue(buf, ctx, info.Imm);
+#endif
+
+        Identifier ident;
+        if (!ctx.GetIdentifierInfo(m_identifier, m_identifierLen, &ident))
+            return ERR_UNKNOWN_IDENTIFIER;
+
+        int opcode = GetLoadOpcode(ident.Type);
+        if (opcode < 0)
+            return opcode;
+
+        if (info.Type == MARSHALLING_EAX)
+            opcode = INT32_LOAD_OPCODE;
+
+#ifdef _EXPR_TARGET_X64
+        // There is no absolute addressing in 64-bit mode, the address goes through rax.
+        int addressPos = buf.pos() + 2;
+        if (!buf.append_8(0x48) ||              // mov rax, imm64
+            !buf.append_8(0xB8) ||
+            !buf.append_ptr(ident.ptr))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+        int opcodePos = buf.pos();
+        if (!buf.append_8(opcode) ||            // op [rax]
+            !buf.append_8(0x00))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+#else
+        int opcodePos = buf.pos();
+        int addressPos = opcodePos + 2;
+        if (!buf.append_8(opcode) ||            // op [addr]
+            !buf.append_8(0x05) ||
+            !buf.append_ptr(ident.ptr))
+            return ERR_OUTPUT_BUFFER_TOO_SMALL;
+#endif
+
+        ctx.AddPatchSite(m_identifier, m_identifierLen, opcodePos, addressPos);
+
+        return EMIT_STEP_DONE;
+    }
 #endif
 };
 
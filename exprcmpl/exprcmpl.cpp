@@ -1,7 +1,29 @@
 
+#include <string.h>         // memset, memcmp
+#include <limits.h>         // INT_MAX
+
 #include "exprcmpl.h"
 #include "util.h"
 #include "AstParser.h"
+#include "VariableExpression.h"
+#include "GradientBuilder.h"
+#include "SpecializationCache.h"
+#include "CodeSymbol.h"
+#include "CpuInfo.h"
+
+#ifdef _EXPR_GDB_JIT
+extern "C"
+{
+    // GDB puts a breakpoint here, the function must not be inlined or removed.
+    // GDB looks both up by name, so they stay visible in a stripped shared library.
+    void __attribute__((noinline, visibility("default"))) __jit_debug_register_code()
+    {
+        __asm__ __volatile__("");
+    }
+
+    __attribute__((visibility("default"))) jit_descriptor __jit_debug_descriptor = { 1, JIT_NOACTION, NULL, NULL };
+}
+#endif
 
 int __declspec(dllexport) __stdcall ParseExpression(const char* expr, int expr_len, void** exprPtr)
 {
@@ -19,9 +41,53 @@ int __declspec(dllexport) __stdcall ParseExpression(const char* expr, int expr_l
     return ERR_SUCCESS;
 }
 
+int __declspec(dllexport) __stdcall CreateExpressionStream(const char* input, int input_len, void** streamPtr)
+{
+    if (!input || input_len < 0 || !streamPtr)
+        return ERR_INVALID_INPUT;
+
+    *(AstParser**)streamPtr = new AstParser(input, input_len, true);
+
+    return ERR_SUCCESS;
+}
+
+int __declspec(dllexport) __stdcall ParseNextExpression(void* streamPtr, void** exprPtr, int* offset, int* length)
+{
+    if (!streamPtr || !exprPtr)
+        return ERR_INVALID_INPUT;
+
+    Expression* abstractExpression;
+    int exprOffset, exprLength;
+    int res = ((AstParser*)streamPtr)->ParseNext(&abstractExpression, &exprOffset, &exprLength);
+    if (res == ERR_END_OF_INPUT)
+        return res;
+
+    if (offset)
+        *offset = exprOffset;
+    if (length)
+        *length = exprLength;
+
+    if (res <= 0)
+        return res;
+
+    *(Expression**)exprPtr = abstractExpression;
+
+    return ERR_SUCCESS;
+}
+
+int __declspec(dllexport) __stdcall ReleaseExpressionStream(void* streamPtr)
+{
+    if (!streamPtr)
+        return ERR_INVALID_INPUT;
+
+    delete (AstParser*)streamPtr;
+
+    return 1;
+}
+
 int __declspec(dllexport) __stdcall PrintExpression(const void* exprPtr, char* store, int store_len)
 {
-    if (!store || store_len <= 0 || !exprPtr)
+    if ((store && store_len <= 0) || !exprPtr)
         return ERR_INVALID_INPUT;
 
     return ((const Expression*)exprPtr)->ToString(store, store_len);
@@ -29,30 +95,307 @@ int __declspec(dllexport) __stdcall PrintExpression(const void* exprPtr, char* s
 
 int __declspec(dllexport) __stdcall CompileExpression(const void* exprPtr, uint8* output, int output_len, pIdentifierInfoCallback identifierInfoCallback)
 {
-    if (!output || output_len <= 0 || !exprPtr || !identifierInfoCallback)
-        return ERR_INVALID_INPUT;
+    return CompileExpressionEx(exprPtr, output, output_len, identifierInfoCallback, NULL, NULL);
+}
 
-    const Expression* abstractExpression = (const Expression*)exprPtr;
+// Compiles the folded expression and its gradient into buf.
+static int EmitExpression(const Expression* abstractExpression, GradientBuilder& grad, ByteBuffer& buf, CompileContext& ctx)
+{
+    if (!ctx.EmitPrologue(buf))
+        return ERR_OUTPUT_BUFFER_TOO_SMALL;
 
-    ByteBuffer buf(output, output_len);
-    int emitted = abstractExpression->Emit(buf, identifierInfoCallback);
+    int emitted = abstractExpression->Emit(buf, ctx);
     if (!emitted)
         return ERR_COMPILATION_FAILED;
     else if (emitted < 0)
         return emitted;
 
-    if (!buf.append_8(0xC3))
+    int derived = grad.Emit(buf);
+    if (derived <= 0)
+        return derived ? derived : ERR_COMPILATION_FAILED;
+
+    if (!ctx.EmitEpilogue(buf))
+        return ERR_OUTPUT_BUFFER_TOO_SMALL;
+
+    if (!ctx.EmitDataArea(buf))
         return ERR_OUTPUT_BUFFER_TOO_SMALL;
 
     return buf.pos();
 }
 
+int __declspec(dllexport) __stdcall CompileExpressionEx(const void* exprPtr, uint8* output, int output_len, pIdentifierInfoCallback identifierInfoCallback,
+    const CompileOptions* options, CompileStats* stats)
+{
+    if ((output && output_len <= 0) || !exprPtr || !identifierInfoCallback)
+        return ERR_INVALID_INPUT;
+
+    if (options && options->gradient_count < 0)
+        return ERR_INVALID_INPUT;
+
+    if (options && (options->flags & (COMPILE_COUNT_CALLS | COMPILE_COUNT_CYCLES)) && !options->counters)
+        return ERR_INVALID_INPUT;
+
+    if (options && options->gradient_variables)
+    {
+        for (int i = 0; i < options->gradient_count; ++i)
+            if (!options->gradient_variables[i].identifier || !options->gradient_variables[i].derivative)
+                return ERR_INVALID_INPUT;
+    }
+
+    // The output length is unbounded when only the size is computed.
+    int length = output ? output_len : INT_MAX;
+    int maxCodeSize = options ? options->max_code_size : 0;
+    bool codeLimited = maxCodeSize > 0 && maxCodeSize < length;
+    if (codeLimited)
+        length = maxCodeSize;
+
+    const Expression* abstractExpression = (const Expression*)exprPtr;
+
+    ByteBuffer buf(output, length);
+    CompileContext ctx(identifierInfoCallback, options);
+    int folded = abstractExpression->Fold(ctx);
+    if (folded <= 0)
+        return folded ? folded : ERR_COMPILATION_FAILED;
+
+    GradientBuilder grad(ctx);
+    int built = grad.Build(abstractExpression);
+    if (built <= 0)
+        return built ? built : ERR_COMPILATION_FAILED;
+
+    int res = EmitExpression(abstractExpression, grad, buf, ctx);
+    if (res == ERR_OUTPUT_BUFFER_TOO_SMALL && codeLimited)
+        return ERR_CODE_LIMIT_EXCEEDED;
+    else if (res <= 0)
+        return res;
+
+    // The memo storage is only addressed once the code is emitted.
+    int memoSize = ctx.GetStats().memo_storage_size;
+    if (output && memoSize)
+    {
+        if (!options->memo_storage || options->memo_storage_size < memoSize)
+            return ERR_MEMO_STORAGE_TOO_SMALL;
+
+        memset(options->memo_storage, 0, memoSize);
+    }
+
+    if (output && options && options->counters)
+        memset(options->counters, 0, sizeof(ExecutionCounters));
+
+    if (stats)
+        *stats = ctx.GetStats();
+
+    return res;
+}
+
+int __declspec(dllexport) __stdcall GetCompiledSize(const void* exprPtr, pIdentifierInfoCallback identifierInfoCallback,
+    const CompileOptions* options)
+{
+    return CompileExpressionEx(exprPtr, NULL, 0, identifierInfoCallback, options, NULL);
+}
+
+int __declspec(dllexport) __stdcall EvaluateExpression(const void* exprPtr, pIdentifierInfoCallback identifierInfoCallback, double* result)
+{
+    if (!exprPtr || !identifierInfoCallback || !result)
+        return ERR_INVALID_INPUT;
+
+    CompileContext ctx(identifierInfoCallback, NULL);
+    return ((const Expression*)exprPtr)->Evaluate(ctx, result);
+}
+
+int __declspec(dllexport) __stdcall RebindVariable(uint8* code, const VariablePatchSite* sites, int site_count,
+    const char* identifier, int identifierLen, const Identifier* info)
+{
+    if (!code || !sites || site_count < 0 || !identifier || identifierLen <= 0 || !info)
+        return ERR_INVALID_INPUT;
+
+    int patched = 0;
+    for (int i = 0; i < site_count; ++i)
+    {
+        const VariablePatchSite& site = sites[i];
+        if (site.identifier_len != identifierLen || memcmp(site.identifier, identifier, identifierLen))
+            continue;
+
+        int res = VariableExpression::Rebind(code, site, *info);
+        if (res <= 0)
+            return res;
+
+        ++patched;
+    }
+
+    return patched;
+}
+
+int __declspec(dllexport) __stdcall RegisterCodeSymbol(const void* exprPtr, const uint8* code, int code_size, const char* name,
+    uint32 flags, void** symbolPtr)
+{
+    if (!code || code_size <= 0 || !symbolPtr || (!exprPtr && !name) ||
+        (flags & ~uint32(SYMBOLS_PERF_MAP | SYMBOLS_GDB_JIT)))
+        return ERR_INVALID_INPUT;
+
+    CodeSymbol* symbol = new CodeSymbol(code, code_size);
+    int res = symbol->Register((const Expression*)exprPtr, name, flags);
+    if (res <= 0)
+    {
+        delete symbol;
+        return res;
+    }
+
+    *(CodeSymbol**)symbolPtr = symbol;
+
+    return ERR_SUCCESS;
+}
+
+int __declspec(dllexport) __stdcall ReleaseCodeSymbol(void* symbolPtr)
+{
+    if (!symbolPtr)
+        return ERR_INVALID_INPUT;
+
+    delete (CodeSymbol*)symbolPtr;
+
+    return 1;
+}
+
+// Counter of the code GetHotCode ranks by.
+static uint64 GetProfileKey(const ProfiledCode& code, int order)
+{
+    return order == PROFILE_BY_CYCLES ? code.counters->cycles : code.counters->calls;
+}
+
+// Whether code one ranks below code two, the larger key and then the lower index ranks higher.
+static bool RanksBelow(uint64 oneKey, int one, uint64 twoKey, int two)
+{
+    return oneKey < twoKey || (oneKey == twoKey && one > two);
+}
+
+// Restores the heap below pos, the code ranked lowest is at the root.
+static void SiftDown(int* top, uint64* keys, int count, int pos)
+{
+    while (true)
+    {
+        int lowest = pos;
+        for (int child = 2 * pos + 1; child <= 2 * pos + 2 && child < count; ++child)
+            if (RanksBelow(keys[child], top[child], keys[lowest], top[lowest]))
+                lowest = child;
+
+        if (lowest == pos)
+            return;
+
+        int index = top[pos];
+        top[pos] = top[lowest];
+        top[lowest] = index;
+
+        uint64 key = keys[pos];
+        keys[pos] = keys[lowest];
+        keys[lowest] = key;
+
+        pos = lowest;
+    }
+}
+
+int __declspec(dllexport) __stdcall GetHotCode(const ProfiledCode* codes, int code_count, int order, int* top, int top_count)
+{
+    if ((!codes && code_count) || code_count < 0 || (!top && top_count) || top_count < 0 ||
+        (order != PROFILE_BY_CALLS && order != PROFILE_BY_CYCLES))
+        return ERR_INVALID_INPUT;
+
+    if (!top_count)
+        return 0;
+
+    // The top_count hottest codes so far are kept in a heap with the coolest of them
+    // at the root, a hotter code replaces it.
+    uint64* keys = new uint64[top_count];
+    int count = 0;
+    for (int i = 0; i < code_count; ++i)
+    {
+        if (!codes[i].counters)
+            continue;
+
+        uint64 key = GetProfileKey(codes[i], order);
+        if (count < top_count)
+        {
+            // The heap is built once it's full.
+            top[count] = i;
+            keys[count] = key;
+            if (++count == top_count)
+                for (int pos = count / 2 - 1; pos >= 0; --pos)
+                    SiftDown(top, keys, count, pos);
+        }
+        else if (RanksBelow(keys[0], top[0], key, i))
+        {
+            top[0] = i;
+            keys[0] = key;
+            SiftDown(top, keys, count, 0);
+        }
+    }
+
+    if (count < top_count)
+        for (int pos = count / 2 - 1; pos >= 0; --pos)
+            SiftDown(top, keys, count, pos);
+
+    // Moving the root to the end of the heap sorts the codes, the hottest first.
+    for (int end = count - 1; end > 0; --end)
+    {
+        int index = top[0];
+        top[0] = top[end];
+        top[end] = index;
+
+        uint64 key = keys[0];
+        keys[0] = keys[end];
+        keys[end] = key;
+
+        SiftDown(top, keys, end, 0);
+    }
+
+    delete[] keys;
+
+    return count;
+}
+
+uint32 __declspec(dllexport) __stdcall GetCpuFeatures()
+{
+    return CpuInfo::GetFeatures();
+}
+
+int __declspec(dllexport) __stdcall CreateSpecializationCache(const void* exprPtr, const SpecializationInfo* info, void** cachePtr)
+{
+    if (!exprPtr || !info || !cachePtr || !info->identifierInfoCallback || !info->alloc_code || !info->free_code ||
+        info->frozen_count < 0 || (info->frozen_count && !info->frozen) ||
+        (info->symbol_flags & ~uint32(SYMBOLS_PERF_MAP | SYMBOLS_GDB_JIT)))
+        return ERR_INVALID_INPUT;
+
+    for (int i = 0; i < info->frozen_count; ++i)
+        if (!info->frozen[i])
+            return ERR_INVALID_INPUT;
+
+    *(SpecializationCache**)cachePtr = new SpecializationCache(exprPtr, *info);
+
+    return ERR_SUCCESS;
+}
+
+int __declspec(dllexport) __stdcall SpecializeExpression(void* cachePtr, const double* values, uint8** code)
+{
+    if (!cachePtr || !code)
+        return ERR_INVALID_INPUT;
+
+    return ((SpecializationCache*)cachePtr)->Specialize(values, code);
+}
+
+int __declspec(dllexport) __stdcall ReleaseSpecializationCache(void* cachePtr)
+{
+    if (!cachePtr)
+        return ERR_INVALID_INPUT;
+
+    delete (SpecializationCache*)cachePtr;
+
+    return 1;
+}
+
 int __declspec(dllexport) __stdcall ReleaseExpression(void* exprPtr)
 {
     if (!exprPtr)
         return ERR_INVALID_INPUT;
 
-    delete exprPtr;
+    delete (Expression*)exprPtr;
 
     return 1;
 }
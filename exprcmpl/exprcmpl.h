@@ -11,12 +11,28 @@
 # define CHECK_SIZE(TYPE, SIZE)
 #endif
 
+// The API is declared with the calling convention and export of Visual C++.
+// GCC and Clang on other systems than Windows spell them as attributes,
+// the conventions only exist on x86 and are the default ones elsewhere.
+#if !defined(_MSC_VER) && !defined(_WIN32)
+# if defined(__i386__)
+#  define __stdcall __attribute__((stdcall))
+#  define __cdecl __attribute__((cdecl))
+# else
+#  define __stdcall
+#  define __cdecl
+# endif
+# define __declspec(x) __attribute__((visibility("default")))
+#endif
+
 typedef signed char         int8;
 typedef unsigned char       uint8;
 typedef signed short        int16;
 typedef unsigned short      uint16;
 typedef signed int          int32;
 typedef unsigned int        uint32;
+typedef signed long long    int64;
+typedef unsigned long long  uint64;
 
 CHECK_SIZE(int8, 1);
 CHECK_SIZE(uint8, 1);
@@ -24,6 +40,8 @@ CHECK_SIZE(int16, 2);
 CHECK_SIZE(uint16, 2);
 CHECK_SIZE(int32, 4);
 CHECK_SIZE(uint32, 4);
+CHECK_SIZE(int64, 8);
+CHECK_SIZE(uint64, 8);
 
 enum IdentifierType
 {
@@ -34,6 +52,31 @@ enum IdentifierType
     IDENTIFIER_FUNC     = 4,
 };
 
+enum CallingConvention
+{
+    CALLCONV_DEFAULT    = 0,        // stdcall on x86, SysV on x86-64, none on Windows x64 (see below)
+    CALLCONV_STDCALL    = 1,        // x86 only, callee pops the arguments, at most 128 bytes of them
+    CALLCONV_CDECL      = 2,        // x86 only, caller pops the arguments, at most 128 bytes of them
+    CALLCONV_SYSV64     = 3,        // x86-64 only, arguments in xmm0-7 and rdi, rsi, rdx, rcx, r8, r9 only
+};
+
+// CallingConvention
+// The code doesn't implement the Windows x64 convention, so on Windows x64 each call of a host
+// function fails with ERR_CALLCONV_UNSUPPORTED, in compiled code and in EvaluateExpression alike.
+// Expressions without host functions compile there.
+
+enum IdentifierFlags
+{
+    IDENTIFIER_FLAG_PURE = 0x01,    // IDENTIFIER_FUNC: the result depends on the arguments only
+    IDENTIFIER_FLAG_RANGE = 0x02,   // the value or result is never NaN and lies in [range_min, range_max] (see below)
+    IDENTIFIER_FLAG_EXPENSIVE = 0x04, // IDENTIFIER_FUNC: calls are slow, COMPILE_LAZY_CALLS avoids them (see there)
+};
+
+enum IdentifierArgFlags
+{
+    IDENTIFIER_ARG_UNUSED = 0x80,   // func_argtypes entry: the function ignores the argument (see below)
+};
+
 enum Error
 {
     ERR_SUCCESS                 =  1,
@@ -49,6 +92,14 @@ enum Error
     ERR_UNKNOWN_OPERAND         = -9,       // [Internal Error]
     ERR_ARG_TYPE_ERR            =-10,       // Argument of a func is of an unsupported type
     ERR_RET_TYPE_ERR            =-11,       // Return type of a func is not supported
+    ERR_CALLCONV_UNSUPPORTED    =-12,       // Calling convention of a func is not supported on this target
+    ERR_END_OF_INPUT            =-13,       // No more expressions in the stream
+    ERR_NODE_LIMIT_EXCEEDED     =-14,       // The expression has more nodes than CompileOptions::max_nodes
+    ERR_CODE_LIMIT_EXCEEDED     =-15,       // The code is larger than CompileOptions::max_code_size
+    ERR_TIME_LIMIT_EXCEEDED     =-16,       // Compiling took longer than CompileOptions::max_compile_ms
+    ERR_NOT_DIFFERENTIABLE      =-17,       // A host function depends on a variable of the gradient
+    ERR_SYMBOLS_UNAVAILABLE     =-18,       // The requested code symbols can't be written on this platform
+    ERR_MEMO_STORAGE_TOO_SMALL  =-19,       // CompileOptions::memo_storage is smaller than CompileStats::memo_storage_size
     // other errors
 };
 
@@ -59,15 +110,228 @@ struct Identifier
     uint8 Type;
     uint8        func_rtype;        // IdentifierType enum
     void*        ptr;               // ptr to imm value or function
-    const uint8* func_argtypes;     // 0-terminated array of IdentifierType enum
+    const uint8* func_argtypes;     // 0-terminated array of IdentifierType enum | IdentifierArgFlags
+    uint8        func_callconv;     // CallingConvention enum
+    uint8        flags;             // IdentifierFlags enum
+    double       range_min;         // IDENTIFIER_FLAG_RANGE
+    double       range_max;
 };
 
 #pragma pack(pop)
 
-CHECK_SIZE(Identifier, 1+1+4+4);
+CHECK_SIZE(Identifier, 1+1+sizeof(void*)+sizeof(void*)+1+1+8+8);
+
+// IDENTIFIER_FLAG_RANGE
+// The compiler derives the ranges of the subexpressions from the ranges of the variables and
+// of the results of host functions, and simplifies the code where they permit: abs of a
+// positive value is dropped, min, max, clamp and if that always choose the same argument
+// evaluate only that one, comparisons that are always true or false are constants, exp and
+// pow skip the handling of infinite exponents when the exponent is finite, and integer
+// divisions whose divisor is never 0 or -1 (COMPILE_INT32_ARITHMETIC) use idiv alone.
+// The code relies on the ranges: with a value outside its range the result is undefined
+// and an integer division may raise a divide error. The ranges have to hold for the
+// variables a patch site is rebound to as well. Subexpressions the ranges make constant
+// are folded like constant ones, so pow follows the rules of a constant exponent when its
+// exponent becomes one. An empty range (range_min > range_max, a NaN bound, or no integer
+// in the range of an IDENTIFIER_INT32 variable or result) is invalid input.
+
+// IDENTIFIER_ARG_UNUSED
+// An argument type or'ed with IDENTIFIER_ARG_UNUSED declares that the function ignores
+// the argument. The code passes 0 in its place and doesn't evaluate the argument unless it
+// calls a host function that isn't pure, then the value is dropped. A pure call whose other
+// arguments are constant is folded. EvaluateExpression passes 0 as well.
+
+enum CompileFlags
+{
+    COMPILE_DEFAULT             = 0,
+    COMPILE_MEMOIZE_PURE_CALLS  = 0x01,     // Cache the last arguments and result of each pure call site (see CompileExpressionEx)
+    COMPILE_FLOAT32             = 0x02,     // Compute in single precision, the code returns a float (see below)
+    COMPILE_INT32_ARITHMETIC    = 0x04,     // Compute integer subexpressions with integer instructions (see below)
+    COMPILE_COUNT_CALLS         = 0x08,     // Count the runs of the code (see below)
+    COMPILE_COUNT_CYCLES        = 0x10,     // Count the runs and the time stamp counter cycles spent in the code
+    COMPILE_HORNER              = 0x20,     // Evaluate polynomials of one variable in Horner form (see below)
+    COMPILE_LAZY_CALLS          = 0x40,     // Skip operands with expensive calls the result doesn't need (see below)
+};
+
+// COMPILE_FLOAT32
+// The x87 precision control is set to 24 bits while the code runs, so + - * / and sqrt
+// round to float32 significands. The exponent range stays extended, intermediates don't
+// overflow at the float32 limits. Constants are rounded to float32, the built-in
+// transcendental functions and host calls compute in the caller's precision.
+// The result is rounded to float32 once more. For n rounded operations the relative
+// difference to the default mode is at most about (n + 1) * 2^-24 times the condition
+// number of the expression.
+
+// COMPILE_INT32_ARITHMETIC
+// IDENTIFIER_INT32 variables, integer literals in the int32 range and host functions returning
+// IDENTIFIER_INT32 (unless they are memoized) are integers. + - * / < > == && || and the built-in chs, abs, min, max, clamp
+// and if applied to integers give integers, computed in 32-bit registers like C with wrapping:
+// + - * chs and abs wrap modulo 2^32, / truncates toward zero, x / 0 is 0 and
+// -2147483648 / -1 is -2147483648. The comparisons and logical operators give 1 or 0.
+// Integers are converted to floating point only where a floating point operation or
+// the result uses them, and are passed to IDENTIFIER_INT32 arguments unchanged.
+// Integer loads are recorded as patch sites, they can only be rebound to IDENTIFIER_INT32.
+// The flag is ignored when a gradient is compiled.
+
+// COMPILE_COUNT_CALLS, COMPILE_COUNT_CYCLES
+// The code increments ExecutionCounters::calls when it's entered. With COMPILE_COUNT_CYCLES it
+// also adds the rdtsc cycles from its entry to its return, host calls and the gradient included,
+// to ExecutionCounters::cycles. rdtsc isn't serializing, so the cycles of a short run are approximate.
+// The counters are the application's, given by CompileOptions::counters, and are kept apart
+// from the code, so the writes don't hit the code's cache lines. The compiler zeroes them
+// when it emits the code, the application may read and reset them at any time.
+// The increments aren't atomic, counts of runs on several threads at once may be lost.
+// Without the flags the code has no instrumentation at all.
+
+// COMPILE_HORNER
+// Subexpressions that are polynomials of degree 8 at most in one variable, built of + - * chs,
+// constants, divisions by powers of 2 and pow with a constant integer exponent, are expanded
+// at compile time and computed as ((c[n] x + c[n-1]) x + ...) x + c[0] where that takes fewer
+// instructions, e.g. a*x*x*x + b*x*x + c*x + d or (x - 1) * (x + 2). The variable is loaded
+// once. The coefficients are computed in double precision (single in float32 mode), so the
+// result differs from the expression as written by rounding, and it may differ in the sign
+// of a zero and for infinite x, where the written form may give NaN: x*x - x is NaN for
+// x = inf, (x - 1) * x isn't. The flag is ignored when a gradient is compiled.
+
+// COMPILE_LAZY_CALLS
+// Operands that call an IDENTIFIER_FLAG_EXPENSIVE function are evaluated only when the result
+// depends on them. The other operand is evaluated first and tested with a branch:
+//  a * b: b isn't evaluated when a is 0 or NaN, if the range of b is finite (declare the range
+//  of the function's result with IDENTIFIER_FLAG_RANGE). The result is a then, it differs from
+//  a * b in the sign of a zero only.
+//  a && b, a || b: b isn't evaluated when a is 0, or not 0.
+//  c ? a : b and if(c, a, b): only the argument c chooses is evaluated.
+// The operands of * && || are swapped where that puts the expensive one second. The calls
+// that are skipped aren't made, also those of functions that aren't pure.
+// Without expensive calls in an operand the code is the same as without the flag.
+// The flag is ignored when a gradient is compiled.
+
+enum CpuFeatures
+{
+    CPU_SSE41                   = 0x01,
+    CPU_AVX                     = 0x02,     // AVX and the operating system saves the ymm registers
+    CPU_AVX2                    = 0x04,
+    CPU_FMA                     = 0x08,     // FMA3, set along with CPU_AVX only
+    CPU_AVX512F                 = 0x10,     // AVX-512 Foundation and the operating system saves the zmm registers
+};
+
+// CpuFeatures
+// The processor is probed with cpuid once per process (GetCpuFeatures), the compiler picks
+// the instruction forms of the code from the features it finds, less the ones
+// CompileOptions::disabled_cpu_features excludes. CompileStats::cpu_features reports the
+// features the code was compiled for, it runs on processors that have all of them.
+// The x87 code is the same on every processor except:
+//  CPU_FMA: polynomials in Horner form (COMPILE_HORNER) are computed with fused multiply-adds
+//  in double precision (not in float32 mode). The result may differ from the x87 one by rounding.
+// Disable the features to get the same results on every processor, or to test the lower
+// tiers on a processor that has them.
+
+// Location of a variable load in the compiled code.
+struct VariablePatchSite
+{
+    const char* identifier;         // name of the variable, points into the parsed expression
+    int identifier_len;
+    int opcode_pos;                 // offset of the load opcode in the code
+    int address_pos;                // offset of the absolute address in the code
+};
+
+// Variable that is compiled as a constant.
+struct FrozenVariable
+{
+    const char* identifier;
+    int identifier_len;
+    double value;
+};
+
+// Variable the compiled code differentiates the expression by.
+// Each run of the code stores the partial derivative of the result by the variable into *derivative.
+// The value and the derivatives are computed in one pass (reverse mode), the derivatives
+// reuse the intermediate values of the expression.
+// abs, min, max, clamp and if pass on the derivative of the argument they choose,
+// floor, ceil and the comparisons have none. Host functions can't be differentiated.
+// Through an infinite or NaN intermediate the derivatives may be NaN where the result is
+// finite, e.g. 1 / (1 / x) at x = 0.
+struct GradientVariable
+{
+    const char* identifier;
+    int identifier_len;
+    double* derivative;
+};
+
+// Counters of instrumented code, see COMPILE_COUNT_CALLS.
+struct ExecutionCounters
+{
+    uint64 calls;
+    uint64 cycles;
+};
+
+struct CompileOptions
+{
+    uint32 flags;                   // CompileFlags enum
+    VariablePatchSite* patch_sites; // receives the variable loads, may be NULL
+    int max_patch_sites;            // number of entries patch_sites can hold
+    const FrozenVariable* frozen_variables; // may be NULL
+    int frozen_count;               // number of entries in frozen_variables
+    int max_nodes;                  // limit of nodes in the expression, 0 = no limit
+    int max_code_size;              // limit of the code size in bytes (data area included), 0 = no limit
+    int max_compile_ms;             // limit of the compile time in milliseconds of clock(), 0 = no limit
+    const GradientVariable* gradient_variables; // may be NULL
+    int gradient_count;             // number of entries in gradient_variables
+    uint32 disabled_cpu_features;   // CpuFeatures enum the code must not use, 0 = all the processor has
+    ExecutionCounters* counters;    // counters of the runs, required with COMPILE_COUNT_CALLS/CYCLES
+    void* memo_storage;             // memo caches of COMPILE_MEMOIZE_PURE_CALLS, 8 byte aligned, may be NULL
+    int memo_storage_size;          // size of memo_storage in bytes
+};
+
+// Compiled code with counters, see GetHotCode.
+struct ProfiledCode
+{
+    const ExecutionCounters* counters;  // CompileOptions::counters of the code, NULL if it has no counters
+};
+
+enum ProfileOrder
+{
+    PROFILE_BY_CALLS    = 0,
+    PROFILE_BY_CYCLES   = 1,
+};
+
+struct CompileStats
+{
+    int folded_calls;               // pure calls evaluated at compile time
+    int memoized_calls;             // pure call sites with a memo cache
+    int patch_sites;                // variable loads, including the ones that didn't fit into patch_sites
+    int int32_nodes;                // nodes computed with integer instructions
+    int range_simplified;           // operations simplified by the ranges of the values
+    int pruned_args;                // unused host call arguments that aren't evaluated
+    int horner_polynomials;         // polynomials computed in Horner form (COMPILE_HORNER)
+    int lazy_guards;                // branches around operands with expensive calls (COMPILE_LAZY_CALLS)
+    uint32 cpu_features;            // CpuFeatures enum the code was compiled for
+    int memo_storage_size;          // bytes of CompileOptions::memo_storage the memo caches take
+};
+
+enum SymbolFlags
+{
+    SYMBOLS_PERF_MAP            = 0x01,     // Append the code to /tmp/perf-<pid>.map for perf (Linux)
+    SYMBOLS_GDB_JIT             = 0x02,     // Register the code with the GDB JIT interface (Linux x86-64)
+};
 
 typedef int(__stdcall *pIdentifierInfoCallback)(const char* identifier, int identifierLen, Identifier* info);
 
+// Allocates executable memory for code of the given size.
+typedef uint8*(__stdcall *pCodeAllocCallback)(int size);
+typedef void(__stdcall *pCodeFreeCallback)(uint8* code, int size);
+
+struct SpecializationInfo
+{
+    pIdentifierInfoCallback identifierInfoCallback;
+    pCodeAllocCallback alloc_code;
+    pCodeFreeCallback free_code;
+    uint32 flags;                   // CompileFlags enum
+    const char* const* frozen;      // 0-terminated names of the frozen variables
+    int frozen_count;
+    uint32 symbol_flags;            // SymbolFlags enum, each specialization is registered like RegisterCodeSymbol does
+};
+
 extern "C"
 {
     // Parses an expression into AST.
@@ -82,18 +346,66 @@ extern "C"
     // <=0 = error
     int __declspec(dllexport) __stdcall ParseExpression(const char* expr, int expr_len, void** exprPtr);
 
-    // Prints the parsed expression.
+    // Starts parsing a buffer that holds many expressions separated by ';' or newlines.
+    // Newlines inside parentheses don't separate expressions.
+    // The expressions parsed from the stream refer to the identifiers in the buffer,
+    // so the buffer must outlive them; identifiers passed to the callbacks aren't 0-terminated.
     // Args:
-    //  exprPtr: pointer to parsed expression
-    //  store: pointer to an array of bytes
-    //  store_len: length of store in bytes
+    //  input: pointer to expressions in ASCII
+    //  input_len: length of input in bytes
+    //  streamPtr: pointer to pointer to the stream.
+    //             set if returned value is 1
+    //
+    // Returns:
+    //   1 = OK
+    // <=0 = error
+    int __declspec(dllexport) __stdcall CreateExpressionStream(const char* input, int input_len, void** streamPtr);
+
+    // Parses the next expression of the stream into AST.
+    // After a syntax error the next call continues with the expression that follows.
+    // Args:
+    //  streamPtr: pointer to the stream
+    //  exprPtr: pointer to pointer to parsed expression.
+    //           set if returned value is 1
+    //  offset: receives the offset of the expression in the input, may be NULL
+    //  length: receives the length of the expression in bytes, may be NULL
+    //          both are set if returned value is 1 or ERR_PARSING_FAILED
+    //
+    // Returns:
+    //   1 = OK
+    //  ERR_END_OF_INPUT = no more expressions
+    // <=0 = error
+    int __declspec(dllexport) __stdcall ParseNextExpression(void* streamPtr, void** exprPtr, int* offset, int* length);
+
+    // Releases the stream. The expressions parsed from it stay valid.
+    // Args:
+    //  streamPtr: pointer to the stream
     //
     // Returns:
-    //  >0 = number of stored ASCII characters
+    //   1 = OK
     // <=0 = error
+    int __declspec(dllexport) __stdcall ReleaseExpressionStream(void* streamPtr);
+
+    // Prints the parsed expression followed by a NUL. The text parses back into the same
+    // expression: numbers are printed with the fewest digits that read back as the same
+    // double and only the parentheses the precedence requires are printed.
+    // If store is NULL nothing is written and the number of characters is returned,
+    // a store of that many bytes plus one holds the text.
+    // Args:
+    //  exprPtr: pointer to parsed expression
+    //  store: pointer to an array of bytes, may be NULL
+    //  store_len: length of store in bytes, ignored if store is NULL
+    //
+    // Returns:
+    //  >0 = number of stored ASCII characters, the NUL not included
+    // <=0 = error, 0 if store is too small
     int __declspec(dllexport) __stdcall PrintExpression(const void* exprPtr, char* store, int store_len);
 
-    // Compiles the parsed expression into 80x86 machine code.
+    // Compiles the parsed expression into machine code for the host (x86, or x86-64
+    // other than Windows x64, see CallingConvention).
+    // The code is a function without arguments that returns a double
+    // in st0 (x86) or in xmm0 (x86-64).
+    // Fields of Identifier the callback doesn't set read as zero.
     // Args:
     //  exprPtr: pointer to parsed expression
     //  output: pointer to an array of bytes
@@ -105,6 +417,180 @@ extern "C"
     // <=0 = error
     int __declspec(dllexport) __stdcall CompileExpression(const void* exprPtr, uint8* output, int output_length, pIdentifierInfoCallback identifierInfoCallback);
 
+    // Compiles the parsed expression like CompileExpression does.
+    // Pure functions (IDENTIFIER_FLAG_PURE) called with constant double arguments
+    // are evaluated at compile time.
+    // Variables listed in options->frozen_variables are compiled as constants and folded.
+    // With options->gradient_variables the code also stores the partial derivatives
+    // by the variables, see GradientVariable. Frozen variables have none.
+    // The variable loads are recorded into options->patch_sites for RebindVariable.
+    // With COMPILE_MEMOIZE_PURE_CALLS the memo caches are kept in options->memo_storage,
+    // apart from the code. Compiling with output NULL reports the size they need in
+    // stats->memo_storage_size, the storage is zeroed when the code is emitted and must
+    // live as long as the code. The caches are updated under a sequence lock, so the code
+    // may run on several threads at once, a thread that finds a cache being updated
+    // calls the function.
+    // The intermediate values of a gradient are kept on the stack.
+    // The parsed expression isn't modified, it may be compiled on several threads at once.
+    // The limits in options bound the work done for untrusted expressions, the node limit
+    // is checked before any code is emitted.
+    // If output is NULL nothing is written and the exact size of the code is returned,
+    // compiling into a buffer of that size succeeds as long as the callback answers
+    // the same way (pure functions folded at compile time are called again).
+    // Args:
+    //  exprPtr: pointer to parsed expression
+    //  output: pointer to an array of bytes, may be NULL
+    //  output_length: length of output in bytes, ignored if output is NULL
+    //  identifierInfoCallback: pointer to callback function
+    //  options: pointer to compile options, may be NULL
+    //  stats: pointer to structure that receives compile statistics, may be NULL
+    //
+    // Returns:
+    //  >0 = number of emitted bytes
+    // <=0 = error
+    int __declspec(dllexport) __stdcall CompileExpressionEx(const void* exprPtr, uint8* output, int output_length, pIdentifierInfoCallback identifierInfoCallback,
+        const CompileOptions* options, CompileStats* stats);
+
+    // Computes the exact size of the code CompileExpressionEx emits for the same arguments
+    // without emitting it, so the output can be allocated once.
+    // Args:
+    //  exprPtr: pointer to parsed expression
+    //  identifierInfoCallback: pointer to callback function
+    //  options: pointer to compile options, may be NULL
+    //
+    // Returns:
+    //  >0 = size of the code in bytes
+    // <=0 = error
+    int __declspec(dllexport) __stdcall GetCompiledSize(const void* exprPtr, pIdentifierInfoCallback identifierInfoCallback,
+        const CompileOptions* options);
+
+    // Evaluates the parsed expression with the current values of the variables without
+    // compiling it, as a reference for the compiled code.
+    // Each node is computed in double precision by the C library, like the constants
+    // CompileExpressionEx folds, and host functions are called from C++.
+    // The compiled code keeps extended precision intermediates, so the results agree
+    // within rounding. They differ where the compiler documents other semantics:
+    // pow of a negative base with an exponent that isn't a constant integer is NaN in the code,
+    // as are pow(0, 0), pow(inf, 0) and pow(1, inf) when the exponent isn't a constant,
+    // and COMPILE_FLOAT32 and COMPILE_INT32_ARITHMETIC aren't modelled.
+    // Host functions are called with the arguments converted to their declared types.
+    // Args:
+    //  exprPtr: pointer to parsed expression
+    //  identifierInfoCallback: pointer to callback function
+    //  result: receives the value of the expression.
+    //          set if returned value is 1
+    //
+    // Returns:
+    //   1 = OK
+    // <=0 = error
+    int __declspec(dllexport) __stdcall EvaluateExpression(const void* exprPtr, pIdentifierInfoCallback identifierInfoCallback, double* result);
+
+    // Points the loads of a variable in compiled code at a new address and/or type
+    // without compiling the expression again.
+    // The code must be writable and must not be running while it is patched.
+    // Args:
+    //  code: pointer to the compiled code
+    //  sites: patch sites recorded by CompileExpressionEx for this code
+    //  site_count: number of entries in sites
+    //  identifier: name of the variable
+    //  identifierLen: length of identifier in bytes
+    //  info: new binding of the variable (IDENTIFIER_INT32, IDENTIFIER_FLOAT32 or IDENTIFIER_FLOAT64)
+    //
+    // Returns:
+    // >=0 = number of patched loads
+    //  <0 = error
+    int __declspec(dllexport) __stdcall RebindVariable(uint8* code, const VariablePatchSite* sites, int site_count,
+        const char* identifier, int identifierLen, const Identifier* info);
+
+    // Names compiled code for profilers and debuggers, so samples and backtraces in it
+    // are attributed to the formula instead of an unknown address.
+    // Without a name the code is named expr_ followed by the 64-bit FNV-1a hash of the
+    // printed expression in 16 hex digits, which is stable across runs and processes.
+    // SYMBOLS_PERF_MAP appends "<address> <size> <name> <expression>" to /tmp/perf-<pid>.map,
+    // the expression cut to 256 characters. perf reads the file when it reports, so lines
+    // of freed code stay in it and a later line for the same address wins.
+    // SYMBOLS_GDB_JIT registers an in-memory ELF object with a symbol for the code
+    // until ReleaseCodeSymbol, it has no unwind information.
+    // Args:
+    //  exprPtr: pointer to the parsed expression the code was compiled from, may be NULL if name is given
+    //  code: pointer to the compiled code
+    //  code_size: size of the code in bytes as returned by CompileExpressionEx
+    //  name: NUL-terminated name of the code, may be NULL
+    //  flags: SymbolFlags enum
+    //  symbolPtr: pointer to pointer to the registration, release it before the code is freed.
+    //             set if returned value is 1
+    //
+    // Returns:
+    //   1 = OK
+    // <=0 = error
+    int __declspec(dllexport) __stdcall RegisterCodeSymbol(const void* exprPtr, const uint8* code, int code_size, const char* name,
+        uint32 flags, void** symbolPtr);
+
+    // Unregisters the code from the GDB JIT interface and releases the registration.
+    // Args:
+    //  symbolPtr: pointer to the registration
+    //
+    // Returns:
+    //   1 = OK
+    // <=0 = error
+    int __declspec(dllexport) __stdcall ReleaseCodeSymbol(void* symbolPtr);
+
+    // Finds the code that runs most often or longest among compiled code with counters,
+    // so the hot formulas of a large set can be found without profiling each one.
+    // Code without counters is skipped, ties are ranked by their index in codes.
+    // Args:
+    //  codes: counters of the compiled code
+    //  code_count: number of entries in codes
+    //  order: ProfileOrder enum, the counter to rank by
+    //  top: receives the indices into codes of the hottest code, hottest first
+    //  top_count: number of entries top can hold
+    //
+    // Returns:
+    // >=0 = number of indices written to top
+    //  <0 = error
+    int __declspec(dllexport) __stdcall GetHotCode(const ProfiledCode* codes, int code_count, int order, int* top, int top_count);
+
+    // Returns the features of the processor, CpuFeatures enum.
+    // The processor is probed on the first call, later calls return the same features.
+    uint32 __declspec(dllexport) __stdcall GetCpuFeatures();
+
+    // Creates a cache of code specialized for values of a set of frozen variables.
+    // The parsed expression must outlive the cache.
+    // Args:
+    //  exprPtr: pointer to parsed expression
+    //  info: callbacks, compile flags and names of the frozen variables
+    //  cachePtr: pointer to pointer to the cache.
+    //            set if returned value is 1
+    //
+    // Returns:
+    //   1 = OK
+    // <=0 = error
+    int __declspec(dllexport) __stdcall CreateSpecializationCache(const void* exprPtr, const SpecializationInfo* info, void** cachePtr);
+
+    // Returns the code specialized for the values of the frozen variables,
+    // compiling it on the first use of the values.
+    // The code is owned by the cache and is freed by ReleaseSpecializationCache.
+    // The cache must not be used on several threads at once.
+    // Args:
+    //  cachePtr: pointer to the cache
+    //  values: values of the frozen variables, in the order of SpecializationInfo::frozen
+    //  code: pointer to pointer to the code.
+    //        set if returned value is positive
+    //
+    // Returns:
+    //  >0 = size of the code in bytes
+    // <=0 = error
+    int __declspec(dllexport) __stdcall SpecializeExpression(void* cachePtr, const double* values, uint8** code);
+
+    // Releases the cache and all of the code compiled by it.
+    // Args:
+    //  cachePtr: pointer to the cache
+    //
+    // Returns:
+    //   1 = OK
+    // <=0 = error
+    int __declspec(dllexport) __stdcall ReleaseSpecializationCache(void* cachePtr);
+
     // Releases the parsed expression.
     // Args:
     //  expr: pointer to parsed expression
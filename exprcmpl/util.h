@@ -6,6 +6,11 @@
 
 #include "exprcmpl.h"
 
+// The emitted code targets the architecture the library itself is built for.
+#if defined(_M_X64) || defined(__x86_64__)
+# define _EXPR_TARGET_X64
+#endif
+
 #include "ByteBuffer.h"
 
 #define _ENABLE_EXPR_TOSTRING
@@ -22,13 +27,49 @@
 # define NULL 0
 #endif
 
+// The bounded sprintf of Visual C++ is snprintf in C99.
+#ifndef _MSC_VER
+# define sprintf_s snprintf
+#endif
+
+enum CharClass
+{
+    CHAR_WHITESPACE     = 0x01,
+    CHAR_LCLETTER       = 0x02,
+    CHAR_UCLETTER       = 0x04,
+    CHAR_DIGIT          = 0x08,
+    CHAR_IDENTIFIER     = 0x10,     // [a-zA-Z0-9_]
+};
+
+// CharClass bits of each byte.
+static const uint8 s_charClasses[256] =
+{
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
+    0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x00, 0x00, 0x00, 0x00, 0x10,
+    0x00, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12,
+    0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x12, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
 inline bool is_char(int32 c) { return (uint32(c) & (uint32(-1) << 8)) == 0; }
-inline bool is_whitespace_char(int32 c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
-inline bool is_lcletter_char(int32 c) { return c >= 'a' && c <= 'z'; STATIC_ASSERT('a' < 'z', "Char failure"); }
-inline bool is_ucletter_char(int32 c) { return c >= 'A' && c <= 'Z'; STATIC_ASSERT('A' < 'Z', "Char failure"); }
-inline bool is_digit_char(int32 c) { return c >= '0' && c <= '9'; STATIC_ASSERT('0' < '9', "Char failure"); }
-inline bool is_letter_char(int32 c) { return is_lcletter_char(c) || is_ucletter_char(c); }
-inline bool is_identifier_char(int32 c) { return is_letter_char(c) || is_digit_char(c) || c == '_'; }
+inline bool is_char_class(int32 c, int cls) { return is_char(c) && (s_charClasses[c] & cls) != 0; }
+inline bool is_whitespace_char(int32 c) { return is_char_class(c, CHAR_WHITESPACE); }
+inline bool is_lcletter_char(int32 c) { return is_char_class(c, CHAR_LCLETTER); }
+inline bool is_ucletter_char(int32 c) { return is_char_class(c, CHAR_UCLETTER); }
+inline bool is_digit_char(int32 c) { return is_char_class(c, CHAR_DIGIT); }
+inline bool is_letter_char(int32 c) { return is_char_class(c, CHAR_LCLETTER | CHAR_UCLETTER); }
+inline bool is_identifier_char(int32 c) { return is_char_class(c, CHAR_IDENTIFIER); }
 
 inline bool eqdbl(double one, double two)
 {
@@ -0,0 +1,330 @@
+
+#include "../exprcmpl/exprcmpl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <sys/mman.h>
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__)
+# define BENCH_STDCALL CALLCONV_DEFAULT
+# define BENCH_CDECL CALLCONV_DEFAULT
+#else
+# define BENCH_STDCALL CALLCONV_STDCALL
+# define BENCH_CDECL CALLCONV_CDECL
+#endif
+
+#ifndef _MSC_VER
+# define sprintf_s snprintf
+#endif
+
+// Executable memory for the compiled code.
+static uint8* AllocCode(int size)
+{
+#ifdef _WIN32
+    return (uint8*)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+    void* code = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return code != MAP_FAILED ? (uint8*)code : NULL;
+#endif
+}
+
+static void FreeCode(uint8* code, int size)
+{
+#ifdef _WIN32
+    VirtualFree(code, 0, MEM_RELEASE);
+#else
+    munmap(code, size);
+#endif
+}
+
+typedef double(*pCompiledExpression)();
+
+static double a, b, t;
+static int steps;
+
+static double __stdcall Lerp(double x, double y, double k)
+{
+    return x + (y - x) * k;
+}
+
+static double __cdecl Dist(double x, double y)
+{
+    return sqrt(x * x + y * y);
+}
+
+static int __stdcall Quantize(double x, int n)
+{
+    return int(x * n);
+}
+
+static const uint8 s_lerpArgs[] = { IDENTIFIER_FLOAT64, IDENTIFIER_FLOAT64, IDENTIFIER_FLOAT64, IDENTIFIER_NONE };
+static const uint8 s_distArgs[] = { IDENTIFIER_FLOAT64, IDENTIFIER_FLOAT64, IDENTIFIER_NONE };
+static const uint8 s_quantizeArgs[] = { IDENTIFIER_FLOAT64, IDENTIFIER_INT32, IDENTIFIER_NONE };
+
+static void SetVariable(Identifier* info, IdentifierType type, void* ptr)
+{
+    info->Type = uint8(type);
+    info->ptr = ptr;
+}
+
+static void SetFunction(Identifier* info, IdentifierType rtype, void* ptr, const uint8* argtypes, CallingConvention conv)
+{
+    info->Type = IDENTIFIER_FUNC;
+    info->func_rtype = uint8(rtype);
+    info->ptr = ptr;
+    info->func_argtypes = argtypes;
+    info->func_callconv = uint8(conv);
+}
+
+int __stdcall IdentifierInfoCallback(const char* identifier, int identifierLen, Identifier* info)
+{
+    if (identifierLen == 1 && identifier[0] == 'a')
+        SetVariable(info, IDENTIFIER_FLOAT64, &a);
+    else if (identifierLen == 1 && identifier[0] == 'b')
+        SetVariable(info, IDENTIFIER_FLOAT64, &b);
+    else if (identifierLen == 1 && identifier[0] == 't')
+        SetVariable(info, IDENTIFIER_FLOAT64, &t);
+    else if (identifierLen == 5 && !memcmp(identifier, "steps", 5))
+        SetVariable(info, IDENTIFIER_INT32, &steps);
+    else if (identifierLen == 4 && !memcmp(identifier, "lerp", 4))
+        SetFunction(info, IDENTIFIER_FLOAT64, (void*)&Lerp, s_lerpArgs, BENCH_STDCALL);
+    else if (identifierLen == 4 && !memcmp(identifier, "dist", 4))
+        SetFunction(info, IDENTIFIER_FLOAT64, (void*)&Dist, s_distArgs, BENCH_CDECL);
+    else if (identifierLen == 8 && !memcmp(identifier, "quantize", 8))
+        SetFunction(info, IDENTIFIER_INT32, (void*)&Quantize, s_quantizeArgs, BENCH_STDCALL);
+    else
+        return 0;
+
+    return 1;
+}
+
+static double Reference()
+{
+    return Lerp(a, b, t) * Dist(a, b) + Lerp(Dist(a, t), Dist(b, t), t) - Quantize(t, steps) / Dist(a + 1, b + 1);
+}
+
+// Host calls dominate the cost of this expression.
+static const char s_callHeavy[] = "lerp(a, b, t) * dist(a, b) + lerp(dist(a, t), dist(b, t), t) - quantize(t, steps) / dist(a + 1, b + 1)";
+
+static int BenchCalls(int iterations)
+{
+    void* expr;
+    int res = ParseExpression(s_callHeavy, sizeof(s_callHeavy) - 1, &expr);
+    if (res <= 0)
+    {
+        printf("ParseExpression => %d\n", res);
+        return 1;
+    }
+
+    int codeSize = GetCompiledSize(expr, IdentifierInfoCallback, NULL);
+    if (codeSize <= 0)
+    {
+        ReleaseExpression(expr);
+        printf("GetCompiledSize => %d\n", codeSize);
+        return 1;
+    }
+
+    uint8* code = AllocCode(codeSize);
+    res = CompileExpression(expr, code, codeSize, IdentifierInfoCallback);
+    ReleaseExpression(expr);
+    if (res <= 0)
+    {
+        printf("CompileExpression => %d\n", res);
+        return 1;
+    }
+
+    pCompiledExpression func = (pCompiledExpression)code;
+
+    a = 1.5;
+    b = 2.5;
+    steps = 16;
+
+    // Check the result before timing anything.
+    t = 0.375;
+    if (fabs(func() - Reference()) > 1e-9)
+    {
+        printf("result mismatch: %.17g != %.17g\n", func(), Reference());
+        return 1;
+    }
+
+    double sum = 0.0;
+    clock_t start = clock();
+    for (int i = 0; i < iterations; ++i)
+    {
+        t = (i & 1023) / 1024.0;
+        sum += func();
+    }
+    double jitSeconds = double(clock() - start) / CLOCKS_PER_SEC;
+
+    double refSum = 0.0;
+    start = clock();
+    for (int i = 0; i < iterations; ++i)
+    {
+        t = (i & 1023) / 1024.0;
+        refSum += Reference();
+    }
+    double refSeconds = double(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("calls: %d bytes of code, %d evaluations\n", res, iterations);
+    printf("  compiled: %8.2f ns/eval (sum %.6g)\n", jitSeconds * 1e9 / iterations, sum);
+    printf("  native:   %8.2f ns/eval (sum %.6g)\n", refSeconds * 1e9 / iterations, refSum);
+
+    FreeCode(code, codeSize);
+    return 0;
+}
+
+// Polynomial in expanded form, as formulas are often written.
+static const char s_polynomial[] = "0.5*t*t*t*t*t - 1.25*t*t*t*t + 2*t*t*t - 0.75*t*t + 3*t - 1";
+
+static double PolynomialReference()
+{
+    return 0.5*t*t*t*t*t - 1.25*t*t*t*t + 2*t*t*t - 0.75*t*t + 3*t - 1;
+}
+
+// Times the polynomial as written and in Horner form (COMPILE_HORNER).
+static int BenchPolynomial(int iterations)
+{
+    void* expr;
+    int res = ParseExpression(s_polynomial, sizeof(s_polynomial) - 1, &expr);
+    if (res <= 0)
+    {
+        printf("ParseExpression => %d\n", res);
+        return 1;
+    }
+
+    // The Horner form is measured with the instructions of the processor and with x87 alone.
+    static const uint32 flags[] = { COMPILE_DEFAULT, COMPILE_HORNER, COMPILE_HORNER };
+    static const uint32 disabled[] = { 0, 0, CPU_FMA };
+    static const char* const names[] = { "expanded", "horner", "horner-x87" };
+
+    printf("polynomial: %d evaluations, cpu features 0x%02X\n", iterations, GetCpuFeatures());
+    for (int i = 0; i < 3; ++i)
+    {
+        CompileOptions options = {};
+        options.flags = flags[i];
+        options.disabled_cpu_features = disabled[i];
+
+        int codeSize = GetCompiledSize(expr, IdentifierInfoCallback, &options);
+        uint8* code = codeSize > 0 ? AllocCode(codeSize) : NULL;
+        res = code ? CompileExpressionEx(expr, code, codeSize, IdentifierInfoCallback, &options, NULL) : codeSize;
+        if (res <= 0)
+        {
+            ReleaseExpression(expr);
+            printf("CompileExpressionEx => %d\n", res);
+            return 1;
+        }
+
+        pCompiledExpression func = (pCompiledExpression)code;
+
+        t = 0.375;
+        if (fabs(func() - PolynomialReference()) > 1e-9)
+        {
+            printf("result mismatch: %.17g != %.17g\n", func(), PolynomialReference());
+            ReleaseExpression(expr);
+            return 1;
+        }
+
+        double sum = 0.0;
+        clock_t start = clock();
+        for (int j = 0; j < iterations; ++j)
+        {
+            t = (j & 1023) / 1024.0;
+            sum += func();
+        }
+        double seconds = double(clock() - start) / CLOCKS_PER_SEC;
+
+        printf("  %-10s %8.2f ns/eval, %d bytes of code (sum %.6g)\n", names[i], seconds * 1e9 / iterations, res, sum);
+        FreeCode(code, codeSize);
+    }
+
+    ReleaseExpression(expr);
+    return 0;
+}
+
+// Builds machine generated looking formulas with long identifiers, one per line.
+static char* MakeFormulas(int count, int* length)
+{
+    static const char* const terms[] =
+    {
+        "coefficient_table_entry_%05d_weight * sensor_reading_channel_%04d",
+        "0.125 * (offset_calibration_term_%d - baseline_measurement_value_%d)",
+        "interpolate_lookup_table_%d(normalized_input_signal_%d, 0.75)",
+        "temperature_compensation_factor_%03d / pressure_reference_%03d",
+    };
+
+    int capacity = count * 512;
+    char* buf = new char[capacity];
+    int len = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        for (int j = 0; j < 6; ++j)
+        {
+            if (j)
+                len += sprintf_s(buf + len, capacity - len, " + ");
+            len += sprintf_s(buf + len, capacity - len, terms[(i + j) & 3], i * 7 + j, i + j);
+        }
+
+        buf[len++] = '\n';
+    }
+
+    *length = len;
+    return buf;
+}
+
+static int BenchParse(int passes)
+{
+    int length;
+    char* input = MakeFormulas(10000, &length);
+
+    int expressions = 0;
+    clock_t start = clock();
+    for (int pass = 0; pass < passes; ++pass)
+    {
+        void* stream;
+        CreateExpressionStream(input, length, &stream);
+
+        void* expr;
+        int res;
+        while ((res = ParseNextExpression(stream, &expr, NULL, NULL)) > 0)
+        {
+            ReleaseExpression(expr);
+            ++expressions;
+        }
+
+        ReleaseExpressionStream(stream);
+        if (res != ERR_END_OF_INPUT)
+        {
+            printf("ParseNextExpression => %d\n", res);
+            delete[] input;
+            return 1;
+        }
+    }
+    double seconds = double(clock() - start) / CLOCKS_PER_SEC;
+
+    // Parsing includes building and releasing the ASTs, not just lexing.
+    printf("parse: %d bytes, %d expressions\n", length * passes, expressions);
+    printf("  %8.2f MB/s\n", length * double(passes) / (seconds * 1024 * 1024));
+
+    delete[] input;
+    return 0;
+}
+
+int main(int argc, char** args)
+{
+    int iterations = argc > 1 ? atoi(args[1]) : 10000000;
+    int passes = argc > 2 ? atoi(args[2]) : 20;
+
+    if (BenchCalls(iterations))
+        return 1;
+
+    if (BenchPolynomial(iterations))
+        return 1;
+
+    return BenchParse(passes);
+}
@@ -0,0 +1,1157 @@
+
+#include "../exprcmpl/exprcmpl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <limits.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <sys/mman.h>
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__)
+# define FUZZ_STDCALL CALLCONV_DEFAULT
+# define FUZZ_CDECL CALLCONV_DEFAULT
+#else
+# define FUZZ_STDCALL CALLCONV_STDCALL
+# define FUZZ_CDECL CALLCONV_CDECL
+#endif
+
+// Executable memory for the compiled code.
+static uint8* AllocCode(int size)
+{
+#ifdef _WIN32
+    return (uint8*)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+    void* code = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return code != MAP_FAILED ? (uint8*)code : NULL;
+#endif
+}
+
+static void FreeCode(uint8* code, int size)
+{
+#ifdef _WIN32
+    VirtualFree(code, 0, MEM_RELEASE);
+#else
+    munmap(code, size);
+#endif
+}
+
+typedef double(*pCompiledExpression)();
+typedef float(*pCompiledExpression32)();
+
+static double x, y;
+static float f;
+static int n, m;                    // m is never 0
+
+// Bindings RebindVariable points x, y and n at.
+static float reboundX;
+static double reboundY;
+static int reboundN;
+static bool s_rebound;
+
+static double __stdcall Blend(double p, double q)
+{
+    return p * 0.75 + q * 0.25;
+}
+
+static double __cdecl Halve(double p)
+{
+    return p * 0.5;
+}
+
+// Declares q unused, the code has to pass 0 for it.
+static double __cdecl Pick(double p, double q)
+{
+    return p + q;
+}
+
+// Never NaN and in [-1, 1], declared with IDENTIFIER_FLAG_RANGE.
+static double __cdecl Squash(double p)
+{
+    if (p != p)
+        return 0.0;
+
+    if (fabs(p) > 1e300)
+        return p > 0.0 ? 1.0 : -1.0;
+
+    return p / (1.0 + fabs(p));
+}
+
+// Integers in, integers out, bounded so the integer expressions don't overflow.
+static int __cdecl Clip(int p)
+{
+    return p < -64 ? -64 : p > 64 ? 64 : p;
+}
+
+// Exact for the leaves, which are exact in single precision.
+static float __cdecl Narrow(float p)
+{
+    return p * 0.75f;
+}
+
+static const uint8 s_blendArgs[] = { IDENTIFIER_FLOAT64, IDENTIFIER_FLOAT64, IDENTIFIER_NONE };
+static const uint8 s_halveArgs[] = { IDENTIFIER_FLOAT64, IDENTIFIER_NONE };
+static const uint8 s_squashArgs[] = { IDENTIFIER_FLOAT64, IDENTIFIER_NONE };
+static const uint8 s_pickArgs[] = { IDENTIFIER_FLOAT64, IDENTIFIER_FLOAT64 | IDENTIFIER_ARG_UNUSED, IDENTIFIER_NONE };
+static const uint8 s_clipArgs[] = { IDENTIFIER_INT32, IDENTIFIER_NONE };
+static const uint8 s_narrowArgs[] = { IDENTIFIER_FLOAT32, IDENTIFIER_NONE };
+
+static void SetVariable(Identifier* info, IdentifierType type, void* ptr)
+{
+    info->Type = uint8(type);
+    info->ptr = ptr;
+}
+
+static void SetFunction(Identifier* info, void* ptr, const uint8* argtypes, CallingConvention conv, bool pure,
+    IdentifierType rtype = IDENTIFIER_FLOAT64)
+{
+    info->Type = IDENTIFIER_FUNC;
+    info->func_rtype = uint8(rtype);
+    info->ptr = ptr;
+    info->func_argtypes = argtypes;
+    info->func_callconv = uint8(conv);
+    info->flags = pure ? IDENTIFIER_FLAG_PURE : 0;
+}
+
+// COMPILE_LAZY_CALLS branches around the calls.
+static void SetExpensiveFunction(Identifier* info, void* ptr, const uint8* argtypes, CallingConvention conv, bool pure)
+{
+    SetFunction(info, ptr, argtypes, conv, pure);
+    info->flags |= IDENTIFIER_FLAG_EXPENSIVE;
+}
+
+int __stdcall IdentifierInfoCallback(const char* identifier, int identifierLen, Identifier* info)
+{
+    if (identifierLen == 1 && identifier[0] == 'x')
+    {
+        if (s_rebound)
+            SetVariable(info, IDENTIFIER_FLOAT32, &reboundX);
+        else
+            SetVariable(info, IDENTIFIER_FLOAT64, &x);
+    }
+    else if (identifierLen == 1 && identifier[0] == 'y')
+        SetVariable(info, IDENTIFIER_FLOAT64, s_rebound ? &reboundY : &y);
+    else if (identifierLen == 1 && identifier[0] == 'f')
+        SetVariable(info, IDENTIFIER_FLOAT32, &f);
+    else if (identifierLen == 1 && identifier[0] == 'n')
+        SetVariable(info, IDENTIFIER_INT32, s_rebound ? &reboundN : &n);
+    else if (identifierLen == 1 && identifier[0] == 'm')
+        SetVariable(info, IDENTIFIER_INT32, &m);
+    else if (identifierLen == 5 && !memcmp(identifier, "blend", 5))
+        SetExpensiveFunction(info, (void*)&Blend, s_blendArgs, FUZZ_STDCALL, true);
+    else if (identifierLen == 5 && !memcmp(identifier, "halve", 5))
+        SetFunction(info, (void*)&Halve, s_halveArgs, FUZZ_CDECL, false);
+    else if (identifierLen == 4 && !memcmp(identifier, "pick", 4))
+        SetFunction(info, (void*)&Pick, s_pickArgs, FUZZ_CDECL, true);
+    else if (identifierLen == 4 && !memcmp(identifier, "clip", 4))
+        SetFunction(info, (void*)&Clip, s_clipArgs, FUZZ_CDECL, true, IDENTIFIER_INT32);
+    else if (identifierLen == 6 && !memcmp(identifier, "narrow", 6))
+        SetFunction(info, (void*)&Narrow, s_narrowArgs, FUZZ_CDECL, true, IDENTIFIER_FLOAT32);
+    else if (identifierLen == 6 && !memcmp(identifier, "squash", 6))
+    {
+        SetExpensiveFunction(info, (void*)&Squash, s_squashArgs, FUZZ_CDECL, false);
+        info->flags |= IDENTIFIER_FLAG_RANGE;
+        info->range_min = -1.0;
+        info->range_max = 1.0;
+    }
+    else
+        return 0;
+
+    return 1;
+}
+
+// xorshift32, the same sequence with every C runtime.
+static uint32 s_state;
+
+static uint32 Random(uint32 range)
+{
+    s_state ^= s_state << 13;
+    s_state ^= s_state >> 17;
+    s_state ^= s_state << 5;
+    return s_state % range;
+}
+
+// The values are exact in single precision, so COMPILE_FLOAT32 cancels them like the reference.
+static void SetRandomValues()
+{
+    x = (int(Random(16385)) - 8192) / 1024.0;
+    y = (int(Random(16385)) - 8192) / 1024.0;
+    f = (int(Random(1025)) - 512) / 64.0f;
+    n = int(Random(17)) - 8;
+    m = Random(2) ? int(Random(8)) + 1 : -int(Random(8)) - 1;
+    reboundX = (int(Random(16385)) - 8192) / 1024.0f;
+    reboundY = (int(Random(16385)) - 8192) / 1024.0;
+    reboundN = int(Random(17)) - 8;
+}
+
+// Builds random expressions the compiled code and the reference evaluator agree on
+// within rounding. The code keeps extended precision intermediates, so the expressions
+// stay clear of the places where a rounding difference changes the result by more:
+// - comparisons, floor and ceil only take variables and constants, which both compute
+//   exactly, so a rounding difference never flips them;
+// - divisors, the bases of negative powers and the operands of sqrt and log are either
+//   variables and constants or kept away from 0, where a cancellation may leave a tiny
+//   value of the other sign, and atan2 takes a positive second argument;
+// - sin, cos and exp take operands of magnitude at most 8, which keeps the values
+//   from overflowing the double range the extended precision code doesn't overflow;
+// - unless the exponent is a constant integer the code computes pow through log2, which
+//   differs from the C library for bases that are negative, 0, infinite or NaN and for
+//   a NaN exponent, so the base is clamped into [0.125, 64] and the exponent into [-8, 8].
+// With COMPILE_INT32_ARITHMETIC the integer subexpressions are computed with integer
+// instructions, which agree with the reference as long as nothing wraps or truncates:
+// - the divisors are floating point values, except the exact divisions of Integer;
+// - Integer keeps its values below 2^24 in magnitude, which float32 mode computes exactly
+//   too, and is made floating point before the other operations take it.
+class Generator
+{
+public:
+    Generator(char* buf, int capacity)
+        : m_buf(buf), m_capacity(capacity), m_len(0)
+    {
+    }
+
+    // Returns the length of the expression, 0 if it doesn't fit.
+    int Generate(int depth)
+    {
+        m_len = 0;
+        Any(depth);
+        if (m_len >= m_capacity)
+            return 0;
+
+        m_buf[m_len] = 0;
+        return m_len;
+    }
+
+private:
+    void Append(const char* str)
+    {
+        while (*str)
+        {
+            if (m_len < m_capacity)
+                m_buf[m_len] = *str;
+            ++m_len;
+            ++str;
+        }
+    }
+
+    void Leaf()
+    {
+        static const char* const leaves[] = { "x", "y", "f", "n", "m", "0", "1", "2.5", "0.125", "3", "(-4)" };
+        Append(leaves[Random(11)]);
+    }
+
+    void FloatLeaf()
+    {
+        static const char* const leaves[] = { "x", "y", "f", "2.5", "0.125" };
+        Append(leaves[Random(5)]);
+    }
+
+    // At most 8 in magnitude.
+    void IntegerLeaf()
+    {
+        static const char* const leaves[] = { "n", "m", "0", "1", "3", "(-4)" };
+        Append(leaves[Random(6)]);
+    }
+
+    // Integer below 8 * 12^depth in magnitude, and so are the products it computes on the way.
+    void Integer(int depth)
+    {
+        static const char* const divisors[] = { "1", "2", "3", "4", "6", "12", "(-3)", "(-6)" };
+        static const char* const unary[] = { "abs(", "chs(", "clip(" };
+
+        switch (depth > 0 ? Random(7) : 0)
+        {
+            case 0:
+                IntegerLeaf();
+                break;
+            case 1:
+                Append("(");
+                Integer(depth - 1);
+                Append(Random(2) ? " + " : " - ");
+                Integer(depth - 1);
+                Append(")");
+                break;
+            case 2:
+                Append("(");
+                Integer(depth - 1);
+                Append(" * ");
+                IntegerLeaf();
+                Append(")");
+                break;
+            case 3:
+                Append(unary[Random(3)]);
+                Integer(depth - 1);
+                Append(")");
+                break;
+            case 4:
+                // The divisions are exact.
+                Append("(");
+                Integer(depth - 1);
+                if (Random(2))
+                {
+                    Append(" * 12 / ");
+                    Append(divisors[Random(8)]);
+                }
+                else
+                    Append(" * m / m");
+                Append(")");
+                break;
+            case 5:
+                switch (Random(3))
+                {
+                    case 0:
+                        Append("clamp(");
+                        Integer(depth - 1);
+                        Append(", (-4), 3)");
+                        break;
+                    default:
+                        Append(Random(2) ? "min(" : "max(");
+                        Integer(depth - 1);
+                        Append(", ");
+                        Integer(depth - 1);
+                        Append(")");
+                        break;
+                }
+                break;
+            default:
+                Append("(");
+                Discrete(depth - 1);
+                Append(" ? ");
+                Integer(depth - 1);
+                Append(" : ");
+                Integer(depth - 1);
+                Append(")");
+                break;
+        }
+    }
+
+    // Value that is exact in both evaluations and is 0 or 1 most of the time.
+    void Discrete(int depth)
+    {
+        static const char* const comparisons[] = { " < ", " > ", " == " };
+        static const char* const logicals[] = { " && ", " || " };
+
+        switch (depth > 0 ? Random(4) : 0)
+        {
+            case 0:
+                Append("(");
+                Leaf();
+                Append(comparisons[Random(3)]);
+                Leaf();
+                Append(")");
+                break;
+            case 1:
+                Append(Random(2) ? "floor(" : "ceil(");
+                Leaf();
+                Append(")");
+                break;
+            default:
+                Append("(");
+                Discrete(depth - 1);
+                Append(logicals[Random(2)]);
+                Discrete(depth - 1);
+                Append(")");
+                break;
+        }
+    }
+
+    // Floating point value that is exactly 0 only if it's a variable or a constant.
+    void Apart(int depth)
+    {
+        if (depth <= 0 || Random(2))
+        {
+            FloatLeaf();
+            return;
+        }
+
+        Append("(abs(");
+        Any(depth - 1);
+        Append(") + 0.5)");
+    }
+
+    // Value of magnitude at most 8.
+    void Bounded(int depth)
+    {
+        switch (depth > 0 ? Random(6) : 0)
+        {
+            case 0:
+                Leaf();
+                break;
+            case 1:
+                Append(Random(2) ? "sin(" : "cos(");
+                Bounded(depth - 1);
+                Append(")");
+                break;
+            case 2:
+                Append("atan2(");
+                Any(depth - 1);
+                Append(", (abs(");
+                Any(depth - 1);
+                Append(") + 0.5))");
+                break;
+            case 3:
+                Append(Random(2) ? "min(" : "max(");
+                Bounded(depth - 1);
+                Append(", ");
+                Bounded(depth - 1);
+                Append(")");
+                break;
+            case 4:
+            {
+                // pick ignores its second argument, squash takes any value,
+                // narrow takes exact values only.
+                int function = int(Random(4));
+                if (function == 2)
+                {
+                    Append("squash(");
+                    Any(depth - 1);
+                    Append(")");
+                    break;
+                }
+
+                if (function == 3)
+                {
+                    Append("narrow(");
+                    Leaf();
+                    Append(")");
+                    break;
+                }
+
+                bool blend = function != 0;
+                Append(blend ? "blend(" : "pick(");
+                Bounded(depth - 1);
+                Append(", ");
+                if (blend)
+                    Bounded(depth - 1);
+                else
+                    Any(depth - 1);
+                Append(")");
+                break;
+            }
+            default:
+                Discrete(depth - 1);
+                break;
+        }
+    }
+
+    void Any(int depth)
+    {
+        static const char* const operators[] = { " + ", " - ", " * " };
+        static const char* const unary[] = { "abs(", "chs(", "halve(" };
+        static const char* const exponents[] = { "2", "3", "0", "5" };
+        static const char* const negativeExponents[] = { "(-1)", "(-2)" };
+
+        switch (depth > 0 ? Random(12) : Random(2))
+        {
+            case 0:
+                Leaf();
+                break;
+            case 1:
+                Bounded(depth > 0 ? depth - 1 : 0);
+                break;
+            case 2:
+            case 3:
+                Append("(");
+                Any(depth - 1);
+                Append(operators[Random(3)]);
+                Any(depth - 1);
+                Append(")");
+                break;
+            case 4:
+                Append("(");
+                Any(depth - 1);
+                Append(" / ");
+                Apart(depth - 1);
+                Append(")");
+                break;
+            case 5:
+                Append(unary[Random(3)]);
+                Any(depth - 1);
+                Append(")");
+                break;
+            case 6:
+            {
+                int funct = Random(4);
+                Append(funct == 0 ? "sqrt(" : funct == 1 ? "log(" : funct == 2 ? "log10(" : "exp(");
+                if (funct == 3)
+                    Bounded(depth - 1);
+                else
+                    Apart(depth - 1);
+                Append(")");
+                break;
+            }
+            case 7:
+                Append("pow(");
+                switch (Random(3))
+                {
+                    case 0:
+                        Any(depth - 1);
+                        Append(", ");
+                        Append(exponents[Random(4)]);
+                        break;
+                    case 1:
+                        Apart(depth - 1);
+                        Append(", ");
+                        Append(negativeExponents[Random(2)]);
+                        break;
+                    default:
+                        Append("clamp(");
+                        Any(depth - 1);
+                        Append(", 0.125, 64), clamp(");
+                        Bounded(depth - 1);
+                        Append(", (-8), 8)");
+                        break;
+                }
+                Append(")");
+                break;
+            case 8:
+                Append("clamp(");
+                Any(depth - 1);
+                Append(", ");
+                Bounded(depth - 1);
+                Append(", ");
+                Bounded(depth - 1);
+                Append(")");
+                break;
+            case 9:
+                Append("(");
+                Discrete(depth - 1);
+                Append(" ? ");
+                Any(depth - 1);
+                Append(" : ");
+                Any(depth - 1);
+                Append(")");
+                break;
+            case 10:
+                Append("(");
+                Integer(depth - 1 < 4 ? depth - 1 : 4);
+                Append(" * 0.5)");
+                break;
+            default:
+                Append(Random(2) ? "min(" : "max(");
+                Any(depth - 1);
+                Append(", ");
+                Any(depth - 1);
+                Append(")");
+                break;
+        }
+    }
+
+    char* m_buf;
+    int m_capacity;
+    int m_len;
+};
+
+// Maps the doubles onto integers in the same order, -0.0 onto the same one as 0.0.
+static int64 OrderedBits(double value)
+{
+    int64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits < 0 ? (int64)(0x8000000000000000ULL - uint64(bits)) : bits;
+}
+
+// Whether the results agree: NaN only matches NaN, other values match if they are
+// at most maxUlps units in the last place apart or closer than absTolerance,
+// which covers the results of cancellations.
+static bool Matches(double result, double reference, uint64 maxUlps, double absTolerance)
+{
+    if (result != result || reference != reference)
+        return result != result && reference != reference;
+
+    int64 one = OrderedBits(result);
+    int64 two = OrderedBits(reference);
+    uint64 ulps = one > two ? uint64(one) - uint64(two) : uint64(two) - uint64(one);
+    return ulps <= maxUlps || fabs(result - reference) <= absTolerance;
+}
+
+// How a mode runs the code.
+enum ModeKind
+{
+    RUN_COMPILED,                   // CompileExpressionEx, each sample run twice
+    RUN_SPECIALIZED,                // SpecializeExpression with x and n frozen
+    RUN_REBOUND,                    // RebindVariable points x, y and n at other variables
+    RUN_GRADIENT,                   // derivatives by x and y against central differences
+};
+
+struct Mode
+{
+    const char* name;
+    ModeKind kind;
+    uint32 flags;
+    uint32 disabledCpuFeatures;
+    uint64 maxUlps;
+    double absTolerance;
+};
+
+static const Mode s_modes[] =
+{
+    { "double", RUN_COMPILED, COMPILE_DEFAULT, 0, 1 << 12, 1e-12 },
+    { "float32", RUN_COMPILED, COMPILE_FLOAT32, 0, uint64(1) << 42, 1e-3 },
+    { "counted", RUN_COMPILED, COMPILE_COUNT_CYCLES, 0, 1 << 12, 1e-12 },
+    // The expanded coefficients of e.g. pow(x - 2.5, 5) cancel near the root.
+    { "horner", RUN_COMPILED, COMPILE_HORNER, 0, uint64(1) << 32, 1e-9 },
+    { "horner-x87", RUN_COMPILED, COMPILE_HORNER, CPU_FMA, uint64(1) << 32, 1e-9 },
+    { "lazy", RUN_COMPILED, COMPILE_LAZY_CALLS, 0, 1 << 12, 1e-12 },
+    { "int32", RUN_COMPILED, COMPILE_INT32_ARITHMETIC, 0, 1 << 12, 1e-12 },
+    { "memoized", RUN_COMPILED, COMPILE_MEMOIZE_PURE_CALLS, 0, 1 << 12, 1e-12 },
+    { "specialized", RUN_SPECIALIZED, COMPILE_MEMOIZE_PURE_CALLS | COMPILE_COUNT_CALLS, 0, 1 << 12, 1e-12 },
+    { "rebound", RUN_REBOUND, COMPILE_INT32_ARITHMETIC, 0, 1 << 12, 1e-12 },
+    { "gradient", RUN_GRADIENT, COMPILE_DEFAULT, 0, 1 << 12, 1e-12 },
+};
+
+static const int MODE_COUNT = sizeof(s_modes) / sizeof(s_modes[0]);
+
+// Values of the variables each expression is checked with.
+static const int SAMPLES = 4;
+
+// Bytes of memo caches the compiled code may use.
+static const int MEMO_STORAGE_SIZE = 1 << 16;
+
+static int Report(const char* what, const char* text, int res)
+{
+    printf("%s => %d: %s\n", what, res, text);
+    return 1;
+}
+
+static int ReportMismatch(const Mode& mode, double result, double reference, const char* text)
+{
+    printf("%s: %.17g != %.17g (x %.17g, y %.17g, f %.9g, n %d, m %d): %s\n",
+        mode.name, result, reference, x, y, f, n, m, text);
+    return 1;
+}
+
+static int Evaluate(void* expr, const char* text, double& value)
+{
+    int res = EvaluateExpression(expr, IdentifierInfoCallback, &value);
+    return res > 0 ? 0 : Report("EvaluateExpression", text, res);
+}
+
+// Compiles the expression into code with the options of the mode.
+static int Compile(const Mode& mode, CompileOptions& options, void* expr, const char* text,
+    uint8* code, int codeCapacity, CompileStats& stats)
+{
+    options.flags = mode.flags;
+    options.disabled_cpu_features = mode.disabledCpuFeatures;
+
+    int size = GetCompiledSize(expr, IdentifierInfoCallback, &options);
+    if (size <= 0 || size > codeCapacity)
+        return Report("GetCompiledSize", text, size);
+
+    int res = CompileExpressionEx(expr, code, size, IdentifierInfoCallback, &options, &stats);
+    if (res != size)
+        return Report("CompileExpressionEx", text, res);
+
+    return 0;
+}
+
+static double Run(const Mode& mode, const uint8* code)
+{
+    if (mode.flags & COMPILE_FLOAT32)
+        return ((pCompiledExpression32)code)();
+
+    return ((pCompiledExpression)code)();
+}
+
+// Compares the result of the code with the reference, rounded like the code rounds it.
+static int CheckResult(const Mode& mode, double result, double reference, const char* text)
+{
+    if (mode.flags & COMPILE_FLOAT32)
+        reference = float(reference);
+
+    if (!Matches(result, reference, mode.maxUlps, mode.absTolerance))
+        return ReportMismatch(mode, result, reference, text);
+
+    return 0;
+}
+
+// Runs the code with each sample twice, the second run with the same values gives the same
+// result (the memo caches hit then), and compares the printed expression with the parsed one.
+static int CheckCompiled(const Mode& mode, void* expr, void* reparsed, const char* text, const char* printed,
+    uint8* code, int codeCapacity)
+{
+    static uint64 memoStorage[MEMO_STORAGE_SIZE / 8];
+    ExecutionCounters counters;
+    CompileOptions options = {};
+    options.counters = &counters;
+    options.memo_storage = memoStorage;
+    options.memo_storage_size = MEMO_STORAGE_SIZE;
+    CompileStats stats;
+    if (Compile(mode, options, expr, text, code, codeCapacity, stats))
+        return 1;
+
+    for (int sample = 0; sample < SAMPLES; ++sample)
+    {
+        SetRandomValues();
+
+        double reference, again;
+        if (Evaluate(expr, text, reference) || Evaluate(reparsed, text, again))
+            return 1;
+
+        if (memcmp(&reference, &again, sizeof(again)) && !(reference != reference && again != again))
+        {
+            printf("reparsed %.17g != %.17g: %s\n  printed: %s\n", again, reference, text, printed);
+            return 1;
+        }
+
+        double result = Run(mode, code);
+        double repeated = Run(mode, code);
+        if (memcmp(&result, &repeated, sizeof(result)))
+        {
+            printf("%s: second run %.17g != %.17g: %s\n", mode.name, repeated, result, text);
+            return 1;
+        }
+
+        if (CheckResult(mode, result, reference, text))
+            return 1;
+    }
+
+    // Each run of instrumented code is counted once.
+    if ((mode.flags & (COMPILE_COUNT_CALLS | COMPILE_COUNT_CYCLES)) && counters.calls != 2 * SAMPLES)
+    {
+        printf("%s: %llu calls counted for %d runs: %s\n", mode.name, (unsigned long long)counters.calls, 2 * SAMPLES, text);
+        return 1;
+    }
+
+    return 0;
+}
+
+static uint8* __stdcall AllocSpecializedCode(int size)
+{
+    return AllocCode(size);
+}
+
+static void __stdcall FreeSpecializedCode(uint8* code, int size)
+{
+    FreeCode(code, size);
+}
+
+// Specializes the code for the values of x and n of each sample. Specializing for the same
+// values again returns the same code.
+static int CheckSpecialized(const Mode& mode, void* expr, const char* text)
+{
+    static const char* const frozen[] = { "x", "n", NULL };
+    SpecializationInfo info = {};
+    info.identifierInfoCallback = IdentifierInfoCallback;
+    info.alloc_code = AllocSpecializedCode;
+    info.free_code = FreeSpecializedCode;
+    info.flags = mode.flags;
+    info.frozen = frozen;
+    info.frozen_count = 2;
+
+    void* cache;
+    int res = CreateSpecializationCache(expr, &info, &cache);
+    if (res <= 0)
+        return Report("CreateSpecializationCache", text, res);
+
+    int failures = 0;
+    for (int sample = 0; sample < SAMPLES && !failures; ++sample)
+    {
+        SetRandomValues();
+
+        double values[] = { x, double(n) };
+        uint8* code;
+        uint8* cached;
+        if ((res = SpecializeExpression(cache, values, &code)) <= 0 ||
+            (res = SpecializeExpression(cache, values, &cached)) <= 0)
+        {
+            failures += Report("SpecializeExpression", text, res);
+            break;
+        }
+
+        if (cached != code)
+        {
+            printf("%s: the same values compiled again: %s\n", mode.name, text);
+            ++failures;
+            break;
+        }
+
+        double reference;
+        failures += Evaluate(expr, text, reference);
+        if (!failures)
+            failures += CheckResult(mode, Run(mode, code), reference, text);
+    }
+
+    ReleaseSpecializationCache(cache);
+    return failures;
+}
+
+// Runs the code with the original bindings, then points x at a float, y and n at
+// other variables of their types and compares with the reference of the new bindings.
+static int CheckRebound(const Mode& mode, void* expr, const char* text, uint8* code, int codeCapacity)
+{
+    // Each load takes at least one character of the text.
+    static VariablePatchSite sites[4096];
+    CompileOptions options = {};
+    options.patch_sites = sites;
+    options.max_patch_sites = sizeof(sites) / sizeof(sites[0]);
+
+    CompileStats stats;
+    if (Compile(mode, options, expr, text, code, codeCapacity, stats))
+        return 1;
+
+    SetRandomValues();
+    double reference;
+    if (Evaluate(expr, text, reference) || CheckResult(mode, Run(mode, code), reference, text))
+        return 1;
+
+    static const char* const names[] = { "x", "y", "n" };
+    s_rebound = true;
+    int failures = 0;
+    for (int i = 0; i < 3 && !failures; ++i)
+    {
+        Identifier info = {};
+        IdentifierInfoCallback(names[i], 1, &info);
+        int res = RebindVariable(code, sites, stats.patch_sites, names[i], 1, &info);
+        if (res < 0)
+            failures += Report("RebindVariable", text, res);
+    }
+
+    for (int sample = 0; sample < SAMPLES && !failures; ++sample)
+    {
+        SetRandomValues();
+        failures += Evaluate(expr, text, reference);
+        if (!failures)
+            failures += CheckResult(mode, Run(mode, code), reference, text);
+    }
+
+    s_rebound = false;
+    return failures;
+}
+
+// Derivative of the reference by the variable, 0 where it isn't smooth or not finite there.
+static bool CentralDifference(void* expr, double& variable, double& derivative)
+{
+    double value = variable;
+    double step = 1e-6 * (fabs(value) > 1.0 ? fabs(value) : 1.0);
+    double lower, center, upper;
+    variable = value - step;
+    EvaluateExpression(expr, IdentifierInfoCallback, &lower);
+    variable = value + step;
+    EvaluateExpression(expr, IdentifierInfoCallback, &upper);
+    variable = value;
+    EvaluateExpression(expr, IdentifierInfoCallback, &center);
+
+    if (!(fabs(lower) < 1e100 && fabs(center) < 1e100 && fabs(upper) < 1e100))
+        return false;
+
+    // Kinks and steps within the step, where the one-sided differences disagree.
+    double left = (center - lower) / step;
+    double right = (upper - center) / step;
+    double scale = fabs(left) + fabs(right) + fabs(center) + 1.0;
+    if (fabs(left - right) > 1e-3 * scale)
+        return false;
+
+    derivative = (upper - lower) / (2 * step);
+    return true;
+}
+
+// Compares the derivatives by x and y the code stores with central differences of the
+// reference, where the expression is smooth. Expressions with host calls that depend on
+// x or y can't be differentiated.
+static int CheckGradient(const Mode& mode, void* expr, const char* text, uint8* code, int codeCapacity)
+{
+    double derivatives[2];
+    GradientVariable variables[] = { { "x", 1, &derivatives[0] }, { "y", 1, &derivatives[1] } };
+    CompileOptions options = {};
+    options.gradient_variables = variables;
+    options.gradient_count = 2;
+    options.flags = mode.flags;
+
+    int size = GetCompiledSize(expr, IdentifierInfoCallback, &options);
+    if (size == ERR_NOT_DIFFERENTIABLE)
+        return 0;
+
+    CompileStats stats;
+    if (Compile(mode, options, expr, text, code, codeCapacity, stats))
+        return 1;
+
+    double* const variablePtrs[] = { &x, &y };
+    for (int sample = 0; sample < SAMPLES; ++sample)
+    {
+        SetRandomValues();
+
+        double reference;
+        if (Evaluate(expr, text, reference) || CheckResult(mode, Run(mode, code), reference, text))
+            return 1;
+
+        for (int i = 0; i < 2; ++i)
+        {
+            double difference;
+            if (!CentralDifference(expr, *variablePtrs[i], difference))
+                continue;
+
+            // Divisors and logarithms of the variables that are 0 are infinite,
+            // the derivatives through them NaN (see GradientVariable).
+            double derivative = derivatives[i];
+            if (derivative != derivative && (x == 0.0 || y == 0.0 || f == 0.0f))
+                continue;
+
+            double scale = fabs(difference) + fabs(reference) + 1.0;
+            if (!(fabs(derivative - difference) <= 1e-4 * scale))
+            {
+                printf("%s: d/d%s %.17g != %.17g (x %.17g, y %.17g, f %.9g, n %d, m %d): %s\n",
+                    mode.name, variables[i].identifier, derivative, difference, x, y, f, n, m, text);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Compiles the expression in each mode and compares the code with the reference evaluator
+// and the printed expression with the parsed one. Returns the number of failures.
+static int CheckExpression(const char* text, int len, uint8* code, int codeCapacity)
+{
+    void* expr;
+    int res = ParseExpression(text, len, &expr);
+    if (res <= 0)
+        return Report("ParseExpression", text, res);
+
+    // The printed expression parses back into one with the same value.
+    int failures = 0;
+    char printed[4096];
+    void* reparsed = NULL;
+    res = PrintExpression(expr, printed, sizeof(printed));
+    if (res <= 0 || ParseExpression(printed, res, &reparsed) <= 0)
+    {
+        ReleaseExpression(expr);
+        return Report("PrintExpression", text, res);
+    }
+
+    for (int i = 0; i < MODE_COUNT && !failures; ++i)
+    {
+        const Mode& mode = s_modes[i];
+        switch (mode.kind)
+        {
+            case RUN_COMPILED:
+                failures += CheckCompiled(mode, expr, reparsed, text, printed, code, codeCapacity);
+                break;
+            case RUN_SPECIALIZED:
+                failures += CheckSpecialized(mode, expr, text);
+                break;
+            case RUN_REBOUND:
+                failures += CheckRebound(mode, expr, text, code, codeCapacity);
+                break;
+            default:
+                failures += CheckGradient(mode, expr, text, code, codeCapacity);
+                break;
+        }
+    }
+
+    ReleaseExpression(reparsed);
+    ReleaseExpression(expr);
+    return failures;
+}
+
+static int Check(int count, int depth)
+{
+    const int codeCapacity = 1 << 20;
+    uint8* code = AllocCode(codeCapacity);
+
+    char text[4096];
+    Generator generator(text, sizeof(text));
+
+    int failures = 0, checked = 0;
+    for (int i = 0; i < count && failures < 20; ++i)
+    {
+        int len = generator.Generate(1 + Random(depth));
+        if (!len)
+            continue;
+
+        failures += CheckExpression(text, len, code, codeCapacity);
+        ++checked;
+    }
+
+    printf("check: %d expressions, %d modes, %d failures\n", checked, MODE_COUNT, failures);
+
+    FreeCode(code, codeCapacity);
+    return failures ? 1 : 0;
+}
+
+// Expressions of the throughput run, released with it on every path.
+struct ThroughputSet
+{
+    explicit ThroughputSet(int count)
+        : count(count), texts(new char[size_t(count) * TEXT_CAPACITY]), lengths(new int[size_t(count)]),
+        exprs(new void*[size_t(count)]()), offsets(new int[size_t(count)]), code(NULL), codeBytes(0)
+    {
+    }
+
+    ~ThroughputSet()
+    {
+        for (int i = 0; i < count; ++i)
+            if (exprs[i])
+                ReleaseExpression(exprs[i]);
+
+        if (code)
+            FreeCode(code, codeBytes);
+
+        delete[] offsets;
+        delete[] exprs;
+        delete[] lengths;
+        delete[] texts;
+    }
+
+    const char* Text(int i) const
+    {
+        return texts + size_t(i) * TEXT_CAPACITY;
+    }
+
+    static const int TEXT_CAPACITY = 4096;
+    // Keeps the texts addressable by int offsets.
+    static const int MAX_COUNT = INT_MAX / TEXT_CAPACITY;
+
+    int count;
+    char* texts;
+    int* lengths;
+    void** exprs;
+    int* offsets;
+    uint8* code;
+    int codeBytes;
+
+private:
+    ThroughputSet(const ThroughputSet&);
+    ThroughputSet& operator=(const ThroughputSet&);
+};
+
+// Compiles many expressions and runs them, for stress and for catching slowdowns
+// of the compiler and of the code against the reference evaluator.
+// The results of the code are then compared with the reference like in the double mode.
+static int Throughput(int count, int depth, int runs)
+{
+    ThroughputSet set(count);
+
+    int textBytes = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        Generator gen(set.texts + size_t(i) * ThroughputSet::TEXT_CAPACITY, ThroughputSet::TEXT_CAPACITY);
+        while (!(set.lengths[i] = gen.Generate(1 + Random(depth))))
+            ;
+        textBytes += set.lengths[i];
+    }
+
+    clock_t start = clock();
+    for (int i = 0; i < count; ++i)
+    {
+        int res = ParseExpression(set.Text(i), set.lengths[i], &set.exprs[i]);
+        if (res <= 0)
+        {
+            set.exprs[i] = NULL;
+            return Report("ParseExpression", set.Text(i), res);
+        }
+    }
+    double parseSeconds = double(clock() - start) / CLOCKS_PER_SEC;
+
+    int codeBytes = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        set.offsets[i] = codeBytes;
+        int size = GetCompiledSize(set.exprs[i], IdentifierInfoCallback, NULL);
+        if (size <= 0)
+            return Report("GetCompiledSize", set.Text(i), size);
+
+        if (size > INT_MAX - codeBytes)
+            return Report("GetCompiledSize", set.Text(i), ERR_CODE_LIMIT_EXCEEDED);
+
+        codeBytes += size;
+    }
+
+    set.code = AllocCode(codeBytes);
+    if (!set.code)
+        return Report("AllocCode", "", codeBytes);
+
+    set.codeBytes = codeBytes;
+    uint8* code = set.code;
+    start = clock();
+    for (int i = 0; i < count; ++i)
+    {
+        int res = CompileExpression(set.exprs[i], code + set.offsets[i], codeBytes - set.offsets[i], IdentifierInfoCallback);
+        if (res <= 0)
+            return Report("CompileExpression", set.Text(i), res);
+    }
+    double compileSeconds = double(clock() - start) / CLOCKS_PER_SEC;
+
+    double sum = 0.0;
+    start = clock();
+    for (int run = 0; run < runs; ++run)
+    {
+        x = run * 0.001;
+        for (int i = 0; i < count; ++i)
+            sum += ((pCompiledExpression)(code + set.offsets[i]))();
+    }
+    double runSeconds = double(clock() - start) / CLOCKS_PER_SEC;
+
+    double refSum = 0.0;
+    start = clock();
+    for (int run = 0; run < runs; ++run)
+    {
+        x = run * 0.001;
+        for (int i = 0; i < count; ++i)
+        {
+            double value;
+            int res = EvaluateExpression(set.exprs[i], IdentifierInfoCallback, &value);
+            if (res <= 0)
+                return Report("EvaluateExpression", set.Text(i), res);
+
+            refSum += value;
+        }
+    }
+    double refSeconds = double(clock() - start) / CLOCKS_PER_SEC;
+
+    // Untimed, with the tolerance of the double mode.
+    const Mode& mode = s_modes[0];
+    int failures = 0;
+    for (int run = 0; run < runs && failures < 20; ++run)
+    {
+        x = run * 0.001;
+        for (int i = 0; i < count && failures < 20; ++i)
+        {
+            double reference;
+            int res = EvaluateExpression(set.exprs[i], IdentifierInfoCallback, &reference);
+            if (res <= 0)
+                return Report("EvaluateExpression", set.Text(i), res);
+
+            double result = ((pCompiledExpression)(code + set.offsets[i]))();
+            failures += CheckResult(mode, result, reference, set.Text(i));
+        }
+    }
+
+    double evaluations = double(count) * runs;
+    printf("throughput: %d expressions, %d bytes of text, %d bytes of code\n", count, textBytes, codeBytes);
+    printf("  parse:     %10.0f expressions/s\n", count / parseSeconds);
+    printf("  compile:   %10.0f expressions/s, %8.2f MB/s of code\n", count / compileSeconds,
+        codeBytes / (compileSeconds * 1024 * 1024));
+    printf("  compiled:  %10.2f ns/eval (sum %.6g)\n", runSeconds * 1e9 / evaluations, sum);
+    printf("  reference: %10.2f ns/eval (sum %.6g)\n", refSeconds * 1e9 / evaluations, refSum);
+    printf("  %d mismatches\n", failures);
+
+    return failures ? 1 : 0;
+}
+
+// exprcmplfuzz [throughput] [count] [seed]
+int main(int argc, char** args)
+{
+    bool throughput = argc > 1 && !strcmp(args[1], "throughput");
+    int first = throughput ? 2 : 1;
+    int count = argc > first ? atoi(args[first]) : (throughput ? 20000 : 100000);
+    s_state = argc > first + 1 ? uint32(strtoul(args[first + 1], NULL, 10)) : 1;
+    if (!s_state)
+        s_state = 1;
+
+    if (count <= 0 || (throughput && count > ThroughputSet::MAX_COUNT))
+    {
+        printf("count must be in [1, %d]\n", throughput ? ThroughputSet::MAX_COUNT : INT_MAX);
+        return 2;
+    }
+
+    const int depth = 6;
+    if (throughput)
+        return Throughput(count, depth, 100);
+
+    return Check(count, depth);
+}
@@ -18,7 +18,14 @@ static const char* error_messages[] =
     "Argument count doesn't match the expected number",
     "Found unknown operand (internal error)",
     "Argument of a custom function is of an unsupported type",
-    "Return type of a custom function is not supported"
+    "Return type of a custom function is not supported",
+    "Calling convention of a custom function is not supported on this target",
+    "No more expressions in the input",
+    "The expression has too many nodes",
+    "The code is larger than allowed",
+    "Compiling took longer than allowed",
+    "A host function depends on a variable of the gradient",
+    "The requested code symbols can't be written on this platform"
 };
 
 int __stdcall IdentifierInfoCallback(const char* identifier, int identifierLen, Identifier* info)
@@ -40,7 +47,8 @@ int printErr(const char* name, int res)
 int main(int argc, char** args)
 {
     char s[1024+1];
-    gets_s(s);
+    if (!fgets(s, sizeof(s), stdin))
+        return 1;
 
     void* expr;
     int res = ParseExpression(s, 1024, &expr);
@@ -48,22 +56,43 @@ int main(int argc, char** args)
     if (res <= 0)
         return 1;
 
-    res = PrintExpression(expr, s, 1024);
+    int textLen = PrintExpression(expr, NULL, 0);
+    char* text = new char[textLen + 1];
+    res = PrintExpression(expr, text, textLen + 1);
     printErr("PrintExpression", res);
     if (res <= 0)
+    {
+        delete[] text;
+        return 1;
+    }
+    printf("%s\n", text);
+    delete[] text;
+
+    double value;
+    res = EvaluateExpression(expr, IdentifierInfoCallback, &value);
+    printErr("EvaluateExpression", res);
+    if (res <= 0)
+        return 1;
+    printf("%.17g\n", value);
+
+    int size = GetCompiledSize(expr, IdentifierInfoCallback, NULL);
+    printErr("GetCompiledSize", size);
+    if (size <= 0)
         return 1;
-    s[res] = 0;
-    printf("%s\n", s);
 
-    uint8 output[1024];
-    res = CompileExpression(expr, output, 1024, IdentifierInfoCallback);
+    uint8* output = new uint8[size];
+    res = CompileExpression(expr, output, size, IdentifierInfoCallback);
     printErr("CompileExpression", res);
     if (res <= 0)
+    {
+        delete[] output;
         return 1;
+    }
 
     std::ofstream f("output.bin");
     f.write((char*)output, res);
     f.close();
+    delete[] output;
 
     res = ReleaseExpression(expr);
     printErr("ReleaseExpression", res);